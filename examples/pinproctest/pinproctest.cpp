@@ -205,6 +205,11 @@ void RunLoop(PRHandle proc)
 
     int p = 0;
 
+    // Read from the P-ROC in the background so PRWaitForEvents() can block on the event descriptor.
+    bool eventThreadStarted = PRStartEventThread(proc) == kPRSuccess;
+    if (!eventThreadStarted)
+        fprintf(stderr, "Unable to start the event thread: %s\n", PRGetLastErrorText());
+
     while (runLoopRun)
     {
         PRDriverWatchdogTickle(proc);
@@ -223,6 +228,12 @@ void RunLoop(PRHandle proc)
 //        printf("\nAccel chip id: %x\n", readData[0]);
 
         int numEvents = PRGetEvents(proc, events, maxEvents);
+        bool readFailed = numEvents < 0;
+        if (readFailed)
+        {
+            fprintf(stderr, "\nError getting events: %s", PRGetLastErrorText());
+            numEvents = 0;
+        }
 //        if (numEvents > 0) printf("\nNum events: %x\n", numEvents);
         for (int i = 0; i < numEvents; i++)
         {
@@ -301,11 +312,16 @@ void RunLoop(PRHandle proc)
             }
         }
         PRFlushWriteData(proc);
+        // Wait up to 10ms for more events so we aren't pegging the CPU.  After a read error the
+        // wait returns straight away, so sleep instead, as we do without the event thread.
+        if (readFailed || !eventThreadStarted || PRWaitForEvents(proc, 10*1000) < 0)
+        {
 #ifdef _MSC_VER
-        Sleep(10);
+            Sleep(10);
 #else
-        usleep(10*1000); // Sleep for 10ms so we aren't pegging the CPU.
+            usleep(10*1000);
 #endif
+        }
     }
 }
 
@@ -116,11 +116,108 @@ typedef enum PRMachineType {
 
 // PRHandle Creation and Deletion
 
+/** How the library reaches the P-ROC.  Selected with PRCreateOptions.transport. */
+typedef enum PRTransportType {
+    kPRTransportFTDI = 0,      /**< USB through the FTDI chip on the board (libftdi or D2xx).  The default. */
+    kPRTransportSimulator = 1, /**< An in-process simulated P-ROC; no hardware needed.  See PRSimulatorInjectEvents(). */
+    kPRTransportCustom = 2,    /**< Bytes are passed to the functions in PRCreateOptions.customTransport. */
+    kPRTransportReplay = 3,    /**< Plays back PRCreateOptions.replayFile, recorded with PRCreateOptions.captureFile. */
+} PRTransportType;
+
+/** Caller-supplied transport used with #kPRTransportCustom.  Bytes are the raw big-endian P-ROC wire protocol in both directions. */
+typedef struct PRTransportFunctions {
+    PRResult (*open)(void *context); /**< Called once while the handle is created.  May be NULL. */
+    void (*close)(void *context);    /**< Called from PRDelete().  May be NULL. */
+    int (*read)(void *context, uint8_t *buffer, int maxBytes); /**< Copy up to maxBytes received bytes into buffer without waiting for more.  Return the number copied, or -1 on error. */
+    int (*write)(void *context, const uint8_t *buffer, int bytes); /**< Send bytes to the device.  Return the number of bytes sent. */
+} PRTransportFunctions;
+
+/**
+ * Tuning of the USB link to the FTDI chip.  These trade host CPU time against latency, and the best
+ * values differ between desktops and small single-board hosts; see PRCalibrateLink().  A field set
+ * to 0 leaves that setting as it is.
+ */
+typedef struct PRLinkParams {
+    int32_t latencyTimer; /**< Milliseconds the FTDI chip holds a partly filled packet before sending it, 1-255.  Lower means lower read latency and more USB traffic. */
+    int32_t readChunkSize; /**< Bytes asked of the USB stack per read, 64-65536 in multiples of 64.  The D2xx USB transfer size for IN, and the size of each queued transfer with asyncTransfers. */
+    int32_t writeChunkSize; /**< Bytes handed to the USB stack per write, 64-65536 in multiples of 64.  The D2xx USB transfer size for OUT, and the size of each queued transfer with asyncTransfers. */
+    int32_t baudRate; /**< Only used by the D2xx driver. */
+} PRLinkParams;
+
+/** What happens to new events while the queue read by PRGetEvents() is full.  See PRCreateOptions.eventQueueSize. */
+typedef enum PREventOverflowPolicy {
+    kPREventOverflowDropOldest = 0,  /**< The oldest queued events are discarded to make room.  The default. */
+    kPREventOverflowDropNewest = 1,  /**< Events arriving while the queue is full are discarded. */
+    kPREventOverflowCoalesceDMD = 2, /**< Same as #kPREventOverflowDropOldest, and while a DMD frame event is still queued newer ones are held back, keeping only the latest.  It is queued once the reader has taken the earlier one, so a stalled reader finds at most one at a time and the last it gets has the current frame, though that one may follow events that arrived after it. */
+} PREventOverflowPolicy;
+
+/** Options used by PRCreateWithOptions() when opening the device.  Always initialize with PRCreateOptionsInit() before changing individual fields. */
+typedef struct PRCreateOptions {
+    bool_t asyncTransfers; /**< If true, several USB read and write transfers are kept in flight at once instead of one blocking transfer at a time.  Only supported by the libftdi driver; ignored elsewhere. */
+    char serialNumber[64]; /**< Serial number of the FTDI chip on the board to open.  Leave empty to choose by deviceIndex instead. */
+    int32_t deviceIndex; /**< Which of the attached boards to open when serialNumber is empty, counting from 0 in USB enumeration order.  Use a different index or serial number per handle to drive several boards from one process. */
+    PRTransportType transport; /**< How to reach the device.  Defaults to #kPRTransportFTDI. */
+    const PRTransportFunctions *customTransport; /**< Used with #kPRTransportCustom; must stay valid until PRDelete(). */
+    void *customTransportContext; /**< Passed to each of the customTransport functions. */
+    bool_t eventThread; /**< If true, the event thread is started as soon as the device has been opened.  See PRStartEventThread(). */
+    PRLinkParams linkParams; /**< USB link settings applied when the device is opened.  Can be changed later with PRSetLinkParams(). */
+    int32_t eventQueueSize; /**< Number of events held for PRGetEvents(), rounded up to a power of two.  The queue is allocated once, here; 0 uses the default of 4096. */
+    PREventOverflowPolicy eventOverflowPolicy; /**< What to do with events that don't fit in the queue. */
+    const char *captureFile; /**< If not NULL, every byte read from or written to the device from now until PRDelete() is recorded to this file, which is replaced.  Only needs to stay valid during PRCreateWithOptions(). */
+    const char *replayFile; /**< The capture played back by #kPRTransportReplay.  Only needs to stay valid during PRCreateWithOptions(). */
+    double replaySpeed; /**< With #kPRTransportReplay, how fast to play back: 1 is the recorded speed, 2 twice as fast, and 0 as fast as possible. */
+} PRCreateOptions;
+
+/**
+ * Wire captures.
+ * A capture (see PRCreateOptions.captureFile) is a #PRCaptureFileHeader followed by one
+ * #PRCaptureRecord per transport read or write, up to the end of the file.  Each record is followed
+ * by its bytes exactly as they crossed the wire (big-endian P-ROC words) and zero padding up to a
+ * multiple of 8 bytes, so every header is 8-byte aligned and a memory mapped capture can be walked
+ * in place.  Header fields are in host byte order.
+ *
+ * Replaying a capture (#kPRTransportReplay) returns the received bytes in the recorded chunks.  A
+ * chunk is only returned once the application has written as many bytes as had been written when
+ * it was recorded, so responses never overtake their requests; this expects the application to
+ * make the same requests as the recorded one.  What it writes is otherwise ignored.
+ */
+#define kPRCaptureMagic "PRCAPTUR"
+#define kPRCaptureVersion (1)
+
+typedef struct PRCaptureFileHeader {
+    char magic[8];        /**< #kPRCaptureMagic, without the terminating NUL. */
+    uint32_t version;     /**< #kPRCaptureVersion. */
+    uint32_t headerSize;  /**< Offset of the first record. */
+    uint64_t startTime;   /**< PRGetHostTime() when the capture started. */
+} PRCaptureFileHeader;
+
+typedef enum PRCaptureDirection {
+    kPRCaptureReceived = 0,     /**< Bytes read from the device. */
+    kPRCaptureTransmitted = 1,  /**< Bytes written to the device. */
+} PRCaptureDirection;
+
+typedef struct PRCaptureRecord {
+    uint64_t time;        /**< PRGetHostTime() when the read returned or the write was handed to the transport. */
+    uint32_t length;      /**< Number of bytes that follow. */
+    uint32_t direction;   /**< A #PRCaptureDirection. */
+} PRCaptureRecord;
+
+PINPROC_API void PRCreateOptionsInit(PRCreateOptions *options); /**< Fills in the given #PRCreateOptions with the defaults used by PRCreate(). */
+
 PINPROC_API PRHandle PRCreate(PRMachineType machineType); /**< Create a new P-ROC device handle.  Only one handle per device may be created. This handle must be destroyed with PRDelete() when it is no longer needed.  Returns #kPRHandleInvalid if an error occurred. */
+PINPROC_API PRHandle PRCreateWithOptions(PRMachineType machineType, const PRCreateOptions *options); /**< Same as PRCreate(), but opens the device using the given options.  options may be NULL to use the defaults. */
 PINPROC_API void PRDelete(PRHandle handle);               /**< Destroys an existing P-ROC device handle. */
 
 #define kPRResetFlagDefault (0) /**< Only resets state in memory and does not write changes to the device. */
 #define kPRResetFlagUpdateDevice (1) /**< Instructs PRReset() to update the device once it has reset the configuration to its defaults. */
+/**
+ * With #kPRResetFlagUpdateDevice, reads the switch rules and driver states back from the device
+ * first and only writes those that differ from the defaults, e.g. when restarting after a crash.
+ * If a switch rule batch is open (see PRSwitchRulesBegin()), the switch rules are left to its
+ * commit instead, so rules set again before it are only written if they changed.  Falls back to
+ * writing everything if the readback fails.
+ */
+#define kPRResetFlagReconcile (2)
 
 /**
  * @brief Resets internally maintained driver and switch rule structures.
@@ -135,6 +232,55 @@ PINPROC_API PRResult PRReset(PRHandle handle, uint32_t resetFlags);
 /** Flush all pending write data out to the P-ROC. */
 PINPROC_API PRResult PRFlushWriteData(PRHandle handle);
 
+/** When buffered writes are sent to the P-ROC without waiting for PRFlushWriteData().  Set with PRSetWriteFlushPolicy(). */
+typedef struct PRWriteFlushPolicy {
+    int32_t maxPendingWords; /**< Flush once at least this many words are waiting.  0 only flushes when the write buffer is full. */
+    int32_t maxLatencyMicroseconds; /**< Flush once the oldest waiting word has waited this long.  0 means no time limit. */
+    bool_t flushOnGetEvents; /**< If true, every PRGetEvents() call also flushes. */
+} PRWriteFlushPolicy;
+
+/**
+ * @brief Sets when buffered writes are flushed automatically.
+ * Flushes triggered by maxPendingWords or maxLatencyMicroseconds are done by a background thread, so
+ * the call that buffered the words never waits for USB.  The default policy (all zeros) leaves
+ * flushing to PRFlushWriteData(), which still works as before under any policy.  A failed
+ * background flush is reported by the next PRFlushWriteData().
+ */
+PINPROC_API PRResult PRSetWriteFlushPolicy(PRHandle handle, const PRWriteFlushPolicy *policy);
+/** Copies the current write flush policy into policy. */
+PINPROC_API PRResult PRGetWriteFlushPolicy(PRHandle handle, PRWriteFlushPolicy *policy);
+
+/** Applies new USB link settings to an open device.  Fails without changing anything if the transport has no link settings or a value is out of range. */
+PINPROC_API PRResult PRSetLinkParams(PRHandle handle, const PRLinkParams *params);
+/** Copies the USB link settings last applied into params.  Fields still 0 are at the driver's default. */
+PINPROC_API PRResult PRGetLinkParams(PRHandle handle, PRLinkParams *params);
+
+/** What PRCalibrateLink() optimizes for. */
+typedef enum PRLinkGoal {
+    kPRLinkGoalLowestLatency = 0, /**< The settings with the shortest register read round trip. */
+    kPRLinkGoalLowestCPU = 1,     /**< The settings using the least host CPU time per round trip whose round trip is still within maxRoundTripMicroseconds. */
+} PRLinkGoal;
+
+/** One set of link settings as measured by PRCalibrateLink(). */
+typedef struct PRLinkMeasurement {
+    PRLinkParams params;
+    int32_t roundTripMicroseconds; /**< Median time to read one register. */
+    int32_t wordsPerSecond; /**< Read throughput with many register reads in flight. */
+    int32_t cpuMicroseconds; /**< Host CPU time used per round trip by the calling thread and, if it is running, the event thread. */
+} PRLinkMeasurement;
+
+/**
+ * @brief Measures candidate link settings against the connected board and applies the best one.
+ * Every candidate is timed with register reads, so the board must be open and otherwise quiet;
+ * switch events arriving meanwhile are kept for PRGetEvents() as usual.  Takes in the order of a
+ * second.  On failure the original settings are restored.  Only latencyTimer and readChunkSize
+ * are tried; writeChunkSize and baudRate are kept as they are, since the measurement only reads.
+ * @param goal What to optimize for.
+ * @param maxRoundTripMicroseconds Only used with #kPRLinkGoalLowestCPU.  0 means no limit.
+ * @param chosen If not NULL, receives the measurement of the settings that were applied.
+ */
+PINPROC_API PRResult PRCalibrateLink(PRHandle handle, PRLinkGoal goal, int32_t maxRoundTripMicroseconds, PRLinkMeasurement *chosen);
+
 /** Write data out to the P-ROC immediately (does not require a call to PRFlushWriteData). */
 PINPROC_API PRResult PRWriteData(PRHandle handle, uint32_t moduleSelect, uint32_t startingAddr, int32_t numWriteWords, uint32_t * writeBuffer);
 
@@ -144,6 +290,31 @@ PINPROC_API PRResult PRWriteDataUnbuffered(PRHandle handle, uint32_t moduleSelec
 /** Read data from the P-ROC. */
 PINPROC_API PRResult PRReadData(PRHandle handle, uint32_t moduleSelect, uint32_t startingAddr, int32_t numReadWords, uint32_t * readBuffer);
 
+/**
+ * Called when a read started with PRReadDataAsync() completes.  data holds the numWords words read
+ * from startingAddr.  Runs on the event thread if it is running, otherwise inside the libpinproc call
+ * that received the response (PRGetEvents(), PRWaitForEvents(), PRReadDataWait() or another read).
+ * Must not block.
+ */
+typedef void (*PRReadCallback)(void *context, int32_t ticket, uint32_t moduleSelect, uint32_t startingAddr, const uint32_t *data, int32_t numWords);
+
+/**
+ * @brief Sends a read request to the P-ROC without waiting for the answer.
+ * Any number of reads may be outstanding; each response is matched to its request by the address
+ * header the P-ROC echoes back.  When it arrives the data is copied to readBuffer (if not NULL) and
+ * callback (if not NULL) is called.  readBuffer must stay valid until then or until PRReadDataCancel().
+ * \return A ticket for PRReadDataWait() and PRReadDataCancel(), or -1 if the request could not be sent.
+ */
+PINPROC_API int32_t PRReadDataAsync(PRHandle handle, uint32_t moduleSelect, uint32_t startingAddr, int32_t numReadWords, uint32_t * readBuffer, PRReadCallback callback, void *context);
+/**
+ * @brief Waits for a read started with PRReadDataAsync() to complete.
+ * @param timeoutMicroseconds How long to wait; 0 only checks, negative waits forever.
+ * \return 1 once the read has completed (or ticket is not outstanding), 0 if the timeout expired, -1 if reading from the device failed.
+ */
+PINPROC_API int PRReadDataWait(PRHandle handle, int32_t ticket, int32_t timeoutMicroseconds);
+/** Forgets an outstanding read.  Its response is dropped if it still arrives. */
+PINPROC_API PRResult PRReadDataCancel(PRHandle handle, int32_t ticket);
+
 // Manager
 /** @defgroup Manager
  * @{
@@ -233,6 +404,14 @@ PINPROC_API PRResult PRDriverGetState(PRHandle handle, uint8_t driverNum, PRDriv
  * @brief Sets the state of the given driver (lamp or coil).
  */
 PINPROC_API PRResult PRDriverUpdateState(PRHandle handle, PRDriverState *driverState);
+/**
+ * @brief Sets the states of several drivers at once, e.g. a frame of lamp matrix updates.
+ * The updates are sorted by driver number and consecutive drivers are written with a single
+ * burst, so a run of n drivers costs 2n + 1 words instead of 3n.  If a driver appears more than
+ * once, the last of its states wins.  Nothing is written if any of the updates would be refused
+ * by PRDriverUpdateState().
+ */
+PINPROC_API PRResult PRDriverUpdateStates(PRHandle handle, const PRDriverState *driverStates, int numStates);
 /**
  * @brief Loads the driver defaults for the given machine type.
  *
@@ -385,6 +564,8 @@ typedef enum PREventType {
     kPREventTypeAccelerometerY           = 9, /**< New value from the accelerometer - Y plane. */
     kPREventTypeAccelerometerZ           = 10, /**< New value from the accelerometer - Z plane. */
     kPREventTypeAccelerometerIRQ         = 11, /**< New interrupt from the accelerometer */
+    kPREventTypeAccelerometerNudge       = 12, /**< A sample moved away from the accelerometer's resting position by more than #PRAccelConfig's nudgeThreshold.  value is the distance in counts. */
+    kPREventTypeAccelerometerTilt        = 13, /**< The filtered accelerometer samples moved away from the level position by more than #PRAccelConfig's tiltThreshold (value is the distance in counts), or back within half of it (value is 0). */
     kPREventTypetLast = kPREventTypeSwitchOpenNondebounced
 } PREventType;
 
@@ -399,6 +580,178 @@ typedef struct PREvent {
  */
 PINPROC_API int PRGetEvents(PRHandle handle, PREvent *eventsOut, int maxEvents);
 
+/**
+ * Same as PRGetEvents(), but stores the events as separate arrays for consumers that process
+ * them in bulk.  Event i is types[i], values[i] and times[i]; each array must hold maxEvents.
+ * \return Number of events returned; -1 if an error occurred.
+ */
+PINPROC_API int PRGetEventsSoA(PRHandle handle, PREventType *types, uint32_t *values, uint32_t *times, int maxEvents);
+
+/** Microseconds of the host's monotonic clock (CLOCK_MONOTONIC on Linux), the time base of #PREventEx. */
+PINPROC_API uint64_t PRGetHostTime(void);
+
+/**
+ * A #PREvent with timestamps that can be compared across long sessions and with host time.
+ * hostReceiveTime - hostTime is the event's latency beyond the smallest one seen.
+ */
+typedef struct PREventEx {
+    PREventType type;          /**< As in #PREvent. */
+    uint32_t value;            /**< As in #PREvent. */
+    uint32_t time;             /**< As in #PREvent: the device's timestamp, which wraps. */
+    uint64_t deviceTime;       /**< Device time in microseconds, unwrapped.  Only as fine as the device's timestamp: 1ms, 4ms for accelerometer events. */
+    uint64_t hostReceiveTime;  /**< PRGetHostTime() when the event was read from USB. */
+    uint64_t hostTime;         /**< deviceTime converted to PRGetHostTime() with the clock estimate current when the event was decoded.  Never after hostReceiveTime. */
+} PREventEx;
+
+/**
+ * Same as PRGetEvents(), but with #PREventEx times.  Events of all three PRGetEvents() calls come
+ * from the same queue and the times are kept up to date whichever is used.
+ * \return Number of events returned; -1 if an error occurred.
+ */
+PINPROC_API int PRGetEventsEx(PRHandle handle, PREventEx *eventsOut, int maxEvents);
+
+/**
+ * Relation between the device's clock and PRGetHostTime(), estimated from the lower envelope of
+ * hostReceiveTime - deviceTime over all events received.
+ */
+typedef struct PRClockEstimate {
+    uint64_t deviceTime;         /**< deviceTime of the latest event the estimate includes. */
+    int64_t offsetMicroseconds;  /**< Host time - device time at deviceTime, including the smallest USB latency seen. */
+    double driftPPM;             /**< How much faster the host clock runs than the device's, in parts per million.  0 until numWindows reaches 2. */
+    int32_t numWindows;          /**< Number of 10 second windows of events the drift is fitted to; at most 32. */
+} PRClockEstimate;
+
+/** Copies the current clock estimate into estimate.  All zeros until the first event has been received. */
+PINPROC_API PRResult PRGetClockEstimate(PRHandle handle, PRClockEstimate *estimate);
+
+#define kPREventHandlerAnySwitch (-1) /**< switchNum for PRSetEventHandler() matching every event of the type. */
+
+/**
+ * Called for an event registered with PRSetEventHandler(), after the switch states (see
+ * PRSwitchGetState()) have been updated with it.  Runs on the event thread if it is running,
+ * otherwise inside the libpinproc call that received the event (PRGetEvents(), PRWaitForEvents(),
+ * PRReadDataWait() or another read).  Must not block and must not call PRGetEvents().
+ */
+typedef void (*PREventHandler)(void *context, const PREventEx *event);
+
+/**
+ * @brief Calls handler for events of the given type and switch instead of returning them from PRGetEvents().
+ * @param switchNum For switch and burst switch events, the switch to handle or #kPREventHandlerAnySwitch
+ * for all of them.  Must be #kPREventHandlerAnySwitch for other types.  A handler for a single switch
+ * takes precedence over one for any switch.
+ * @param handler NULL removes the registration.  Unless PRSetEventHandler() is called from a handler,
+ * the previous handler is not running anymore when it returns.
+ */
+PINPROC_API PRResult PRSetEventHandler(PRHandle handle, PREventType type, int32_t switchNum, PREventHandler handler, void *context);
+
+/**
+ * Accounting of the queue read by PRGetEvents().  Discarded events have still updated the switch
+ * states and been offered to the event handlers.
+ */
+typedef struct PREventQueueStats {
+    uint32_t capacity;   /**< Events the queue holds. */
+    uint32_t size;       /**< Events waiting now. */
+    uint32_t highWater;  /**< Most events waiting at once since the handle was created or PRResetEventQueueStats(). */
+    uint32_t dropped;    /**< Events discarded because the queue was full. */
+    uint32_t coalesced;  /**< DMD frame events discarded by #kPREventOverflowCoalesceDMD because a newer one replaced them. */
+} PREventQueueStats;
+
+PINPROC_API PRResult PRGetEventQueueStats(PRHandle handle, PREventQueueStats *stats);
+/** Sets highWater to the current size and the other counters of #PREventQueueStats to 0. */
+PINPROC_API PRResult PRResetEventQueueStats(PRHandle handle);
+
+/** A complete reading of the accelerometer, returned by PRAccelGetSamples(). */
+typedef struct PRAccelSample {
+    int32_t x;            /**< Acceleration along the X axis in the accelerometer's signed 14-bit counts, after the low-pass filter. */
+    int32_t y;            /**< As x, along the Y axis. */
+    int32_t z;            /**< As x, along the Z axis. */
+    uint32_t time;        /**< As in #PREventEx, of the Z value that completed the sample. */
+    uint64_t deviceTime;  /**< As in #PREventEx. */
+    uint64_t hostTime;    /**< As in #PREventEx. */
+} PRAccelSample;
+
+/** What the library does with accelerometer events.  Set with PRAccelSetConfig(). */
+typedef struct PRAccelConfig {
+    bool_t enabled;                   /**< If true, X, Y and Z events are combined into samples for PRAccelGetSamples() instead of being returned by PRGetEvents() or passed to event handlers.  IRQ events are unaffected. */
+    int32_t decimation;               /**< Only every decimation-th sample is queued for PRAccelGetSamples(); 0 and 1 queue all of them.  Filtering and detection still see every sample. */
+    float lowPassAlpha;               /**< Weight of each new reading in the low-pass filter, between 0 and 1.  0 and 1 turn the filter off. */
+    int32_t nudgeThreshold;           /**< Queue a #kPREventTypeAccelerometerNudge when X or Y of an unfiltered sample is further than this from the resting position, which follows the samples slowly.  0 turns nudge detection off. */
+    int32_t nudgeHoldoffMilliseconds; /**< Minimum device time between two nudge events. */
+    int32_t tiltThreshold;            /**< Queue a #kPREventTypeAccelerometerTilt when X or Y of the filtered samples is further than this from the level position.  0 turns tilt detection off. */
+} PRAccelConfig;
+
+/**
+ * @brief Sets how accelerometer events are handled.
+ * The default configuration (all zeros) leaves them to PRGetEvents() as before.  Enabling it, or
+ * re-enabling it restarts the filter, detection and the level position; samples already queued
+ * stay queued.
+ */
+PINPROC_API PRResult PRAccelSetConfig(PRHandle handle, const PRAccelConfig *config);
+/** Copies the current accelerometer configuration into config. */
+PINPROC_API PRResult PRAccelGetConfig(PRHandle handle, PRAccelConfig *config);
+/**
+ * Makes the next filtered sample the level position #kPREventTypeAccelerometerTilt is measured
+ * from, e.g. once the machine has been levelled.  Until called, the first sample after enabling is used.
+ */
+PINPROC_API PRResult PRAccelSetLevel(PRHandle handle);
+/**
+ * @brief Copies out samples combined while #PRAccelConfig's enabled is set, oldest first.
+ * Samples are queued separately from the events of PRGetEvents(); up to #kPRAccelSampleQueueSize
+ * are kept, after which the oldest are discarded.  New samples don't make PRWaitForEvents() return;
+ * nudge and tilt events do.
+ * \return Number of samples returned; -1 if an error occurred.
+ */
+PINPROC_API int PRAccelGetSamples(PRHandle handle, PRAccelSample *samples, int maxSamples);
+
+#define kPRAccelSampleQueueSize (1024) /**< Samples kept for PRAccelGetSamples(). */
+
+/**
+ * @brief Starts a background thread that continuously reads from the P-ROC.
+ *
+ * Without the event thread, all USB reads happen inside PRGetEvents() and the other calls that
+ * return data, so events are only collected as often as the application polls.  With it running,
+ * incoming events are decoded on the thread into a lock-free queue and PRGetEvents() only copies
+ * them out, and register reads wait for the thread to deliver their data.
+ *
+ * Only one other thread may call into the handle at a time while the event thread is running.
+ * The log callback may be invoked from the event thread.
+ */
+PINPROC_API PRResult PRStartEventThread(PRHandle handle);
+/** Stops the thread started by PRStartEventThread().  Events it has already collected are still returned by PRGetEvents(). */
+PINPROC_API PRResult PRStopEventThread(PRHandle handle);
+
+/**
+ * @brief Returns a file descriptor that is readable while events are waiting for PRGetEvents().
+ *
+ * Meant to be added to an application's own select()/poll()/epoll loop.  Only read from it via
+ * PRGetEvents(), which clears it once all pending events have been taken.  The descriptor stays
+ * valid until PRDelete().  Requires the event thread (see PRStartEventThread()) and is not
+ * available on Windows.
+ * \return The descriptor, or -1 if an error occurred.
+ */
+PINPROC_API int PRGetEventDescriptor(PRHandle handle);
+
+/**
+ * @brief Blocks until PRGetEvents() has events to return or the timeout expires.
+ * @param timeoutMicroseconds Maximum time to wait; negative waits forever.
+ * \return 1 if events (or an error) are waiting for PRGetEvents(), 0 if the timeout expired, -1 if an error occurred.
+ *
+ * Uses the event descriptor when the event thread is running.  Otherwise the device is checked
+ * every millisecond.
+ */
+PINPROC_API int PRWaitForEvents(PRHandle handle, int32_t timeoutMicroseconds);
+
+/**
+ * @brief Queues events on a handle created with #kPRTransportSimulator, as if the P-ROC had sent them.
+ *
+ * Each event is encoded into the wire format of a version 2 P-ROC, including its time, and is
+ * returned by a later PRGetEvents().  Switch events also update the switch states reported by
+ * PRSwitchGetStates().  Fails on handles using any other transport.
+ */
+PINPROC_API PRResult PRSimulatorInjectEvents(PRHandle handle, const PREvent *events, int numEvents);
+/** Appends raw words (headers included) to the data the simulated P-ROC returns, for scripting responses the simulator doesn't produce itself. */
+PINPROC_API PRResult PRSimulatorInjectData(PRHandle handle, const uint32_t *words, int numWords);
+
 
 #define kPRSwitchPhysicalFirst (0)   /**< Switch number of the first physical switch. */
 #define kPRSwitchPhysicalLast (255)  /**< Switch number of the last physical switch.  */
@@ -481,11 +834,118 @@ PINPROC_API PRResult PRSwitchUpdateConfig(PRHandle handle, PRSwitchConfig *switc
  */
 PINPROC_API PRResult PRSwitchUpdateRule(PRHandle handle, uint8_t switchNum, PREventType eventType, PRSwitchRule *rule, PRDriverState *linkedDrivers, int numDrivers, bool_t drive_outputs_now);
 
-/** Returns a list of PREventTypes describing the states of the requested number of switches  */
+/**
+ * @brief Starts a batch of switch rule changes.
+ *
+ * Until PRSwitchRulesCommit(), PRSwitchUpdateRule() only changes the library's copy of the rules.
+ * The commit then sends the rules that differ from what was last sent to the device, as one upload.
+ * Rewriting a rule with the same drivers it already links to keeps its linked rules.  Linked rule
+ * indexes a batch releases are only reused after its commit, so a batch that replaces chains may
+ * briefly need room for both the old and the new links.
+ */
+PINPROC_API PRResult PRSwitchRulesBegin(PRHandle handle);
+/**
+ * Sends the rules changed since PRSwitchRulesBegin().  All linked rules are written before the
+ * rules of the switches themselves, so the device never follows a link to a rule that is yet to
+ * be written.  Like other writes, the upload is sent by PRFlushWriteData() or the flush policy.
+ */
+PINPROC_API PRResult PRSwitchRulesCommit(PRHandle handle);
+
+/**
+ * Use of the switch rules that hold linked driver updates.  A rule with n linked drivers keeps
+ * the first driver in the switch's own rule and takes n - 1 rules from this pool.
+ */
+typedef struct PRSwitchRulePoolStats {
+    uint32_t size;       /**< Rules in the pool: the debounced rules of switches #kPRSwitchNeverDebounceFirst and up, plus any added with PRSwitchRulePoolDonate(). */
+    uint32_t used;       /**< Rules holding linked driver updates. */
+    uint32_t free;       /**< Rules PRSwitchUpdateRule() can link to now. */
+    uint32_t released;   /**< Rules dropped in an open batch (see PRSwitchRulesBegin()), free once it is committed. */
+    uint32_t fragmented; /**< Free rules below the highest one in use, which PRSwitchRulePoolCompact() would fill. */
+} PRSwitchRulePoolStats;
+
+PINPROC_API PRResult PRSwitchRulePoolGetStats(PRHandle handle, PRSwitchRulePoolStats *stats);
+/**
+ * @brief Adds one of a switch's own rules to the pool, e.g. the debounced rules of an opto that is never debounced.
+ * The rule must not notify the host or drive outputs.  Afterwards PRSwitchUpdateRule() fails for it.
+ * Donations last until the next PRReset().
+ */
+PINPROC_API PRResult PRSwitchRulePoolDonate(PRHandle handle, uint8_t switchNum, PREventType eventType);
+/**
+ * @brief Moves linked driver updates to the lowest free rules of the pool.
+ * Each move writes the update to its new rule before pointing the rule that links to it there,
+ * so the device always follows complete chains.  Fails while a batch is open.
+ * \return Number of linked rules moved; -1 if an error occurred.
+ */
+PINPROC_API int PRSwitchRulePoolCompact(PRHandle handle);
+
+/**
+ * Returns a list of PREventTypes describing the states of the requested number of switches.
+ * Reads the switch state and debounce tables from the device, one burst each, and waits for them.
+ */
 PINPROC_API PRResult PRSwitchGetStates(PRHandle handle, PREventType * switchStates, uint16_t numSwitches);
 
+/** Called with the switch states read by PRSwitchGetStatesAsync().  switchStates is only valid during the call. */
+typedef void (*PRSwitchStatesCallback)(void *context, const PREventType *switchStates, uint16_t numSwitches);
+/**
+ * @brief Like PRSwitchGetStates(), but returns once the reads are sent.
+ * callback gets the states when both reads have been answered.  It runs like a #PRReadCallback: on
+ * the event thread if it is running, otherwise inside the libpinproc call that received the answer,
+ * e.g. PRGetEvents() or PRWaitForEvents().  The switch states returned by PRSwitchGetStateBitmap()
+ * are refreshed just before.  numSwitches must be at least 32; like PRSwitchGetStates(), only
+ * whole groups of 32 are read.  If either answer hasn't arrived after a second, the request is
+ * given up and callback is never called.
+ */
+PINPROC_API PRResult PRSwitchGetStatesAsync(PRHandle handle, uint16_t numSwitches, PRSwitchStatesCallback callback, void *context);
+
+/**
+ * Last known switch states, one bit per switch: switch n is bit (n % 32) of word (n / 32).
+ * The library keeps these up to date from switch events as they are decoded (on the event thread
+ * if it is running, otherwise inside PRGetEvents()), so only switches with rules that notify the
+ * host are tracked.  PRSwitchGetStates() also refreshes them from the device.
+ */
+typedef struct PRSwitchStateBitmap {
+    uint32_t known[kPRSwitchCount / 32]; /**< Set once a switch's state has been seen in an event or read with PRSwitchGetStates(). */
+    uint32_t openNondebounced[kPRSwitchCount / 32]; /**< Set while the raw switch input is open. */
+    uint32_t openDebounced[kPRSwitchCount / 32]; /**< Set while the debounced switch state is open. */
+} PRSwitchStateBitmap;
+
+/** Copies the last known switch states.  Never talks to the device. */
+PINPROC_API PRResult PRSwitchGetStateBitmap(PRHandle handle, PRSwitchStateBitmap *bitmap);
+/** Returns 1 if the switch was last known to be open, 0 if closed, and -1 if its state isn't known or switchNum is out of range.  Never talks to the device. */
+PINPROC_API int PRSwitchGetState(PRHandle handle, uint16_t switchNum, bool_t debounced);
+/** Returns the time of the switch's last debounced or non-debounced state change, in the units of #PREvent.time.  0 if none was seen. */
+PINPROC_API uint32_t PRSwitchGetLastChangeTime(PRHandle handle, uint16_t switchNum, bool_t debounced);
+
 /** @} */ // End of Switches & Events
 
+// Machine Images
+
+/**
+ * @defgroup machineimage Machine Images
+ * A machine image holds a whole driver and switch configuration: the driver globals, groups and
+ * states, the switch configuration and every switch rule, linked driver chains included, compiled
+ * into the bursts that write it.  Configure the machine once, save the result with
+ * PRMachineImageSave(), and on later starts load it with PRMachineImageLoad() instead of
+ * rebuilding it call by call.  Bursts that write consecutive addresses, like the driver table,
+ * are joined in the image, and loading fills every transfer to the device.
+ *
+ * An image also holds the library's own copy of the configuration, which loading restores, so it
+ * only loads into the machine type and version of libpinproc it was saved with.  If loading
+ * fails, configure the machine as usual and save a new image.
+ * @{
+ */
+
+/** Saves the current driver and switch configuration to path, replacing it.  Fails while a switch rule batch is open. */
+PINPROC_API PRResult PRMachineImageSave(PRHandle handle, const char *path);
+/**
+ * Writes the configuration saved in the image at path to the device and makes it the current
+ * configuration.  Like other writes, it is sent by PRFlushWriteData() or the flush policy.
+ * Fails while a switch rule batch is open.
+ */
+PINPROC_API PRResult PRMachineImageLoad(PRHandle handle, const char *path);
+
+/** @} */ // End of Machine Images
+
 // DMD
 
 /**
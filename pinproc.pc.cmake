@@ -8,4 +8,5 @@ Description: P-ROC interface library
 Version: @PINPROC_VERSION@
 Requires:
 Libs: -L${libdir} -lpinproc
+Libs.private: @CMAKE_THREAD_LIBS_INIT@
 Cflags: -I${includedir}
@@ -0,0 +1,176 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PRAccelerometer.cpp
+ *  libpinproc
+ */
+
+#include "PRAccelerometer.h"
+#include "PREventDecoder.h"
+#include <math.h>
+#include <string.h>
+
+/** Accelerometer values are 14-bit two's complement. */
+static int32_t PRAccelSignExtend(uint32_t value)
+{
+    int32_t counts = (int32_t)(value & P_ROC_EVENT_ACCEL_VALUE_MASK);
+    return counts >= 0x2000 ? counts - 0x4000 : counts;
+}
+
+/** Larger of the X and Y distances between a and b. */
+static float PRAccelDistance(const float *a, const float *b)
+{
+    float dx = fabsf(a[0] - b[0]);
+    float dy = fabsf(a[1] - b[1]);
+    return dx > dy ? dx : dy;
+}
+
+PRAccelerometer::PRAccelerometer() : enabled(false), samples(kPRAccelSampleQueueSize)
+{
+    memset(&config, 0, sizeof(config));
+    Restart();
+}
+
+void PRAccelerometer::Restart()
+{
+    pendingAxes = 0;
+    filterStarted = false;
+    levelSet = false;
+    tilted = false;
+    nudged = false;
+    lastNudgeTime = 0;
+    decimationCount = 0;
+}
+
+void PRAccelerometer::SetConfig(const PRAccelConfig *config)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (config->enabled && !this->config.enabled)
+        Restart();
+    this->config = *config;
+    enabled = config->enabled != 0;
+}
+
+void PRAccelerometer::GetConfig(PRAccelConfig *config)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    *config = this->config;
+}
+
+void PRAccelerometer::SetLevel()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    levelSet = false;
+    tilted = false;
+}
+
+void PRAccelerometer::Notify(PREventEx *event, PREventType type, uint32_t value)
+{
+    event->type = type;
+    event->value = value;
+}
+
+bool PRAccelerometer::Process(PREventEx *event)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    int32_t axis = event->type - kPREventTypeAccelerometerX;
+    if (axis < 2)
+    {
+        pendingValues[axis] = PRAccelSignExtend(event->value);
+        pendingAxes |= 1 << axis;
+        return false;
+    }
+    if (pendingAxes != 3)
+    {
+        pendingAxes = 0; // Enabled partway through a sample.
+        return false;
+    }
+    pendingAxes = 0;
+
+    float raw[3] = { (float)pendingValues[0], (float)pendingValues[1], (float)PRAccelSignExtend(event->value) };
+    float nudgeDistance = 0;
+    if (!filterStarted)
+    {
+        memcpy(filtered, raw, sizeof(raw));
+        memcpy(baseline, raw, sizeof(raw));
+        filterStarted = true;
+    }
+    else
+    {
+        float alpha = config.lowPassAlpha > 0 && config.lowPassAlpha < 1 ? config.lowPassAlpha : 1;
+        nudgeDistance = PRAccelDistance(raw, baseline);
+        for (int i = 0; i < 3; i++)
+        {
+            filtered[i] += alpha * (raw[i] - filtered[i]);
+            baseline[i] += accelBaselineAlpha * (raw[i] - baseline[i]);
+        }
+    }
+    if (!levelSet)
+    {
+        memcpy(level, filtered, sizeof(level));
+        levelSet = true;
+    }
+
+    if (++decimationCount >= config.decimation)
+    {
+        PRAccelSample sample;
+        sample.x = (int32_t)lroundf(filtered[0]);
+        sample.y = (int32_t)lroundf(filtered[1]);
+        sample.z = (int32_t)lroundf(filtered[2]);
+        sample.time = event->time;
+        sample.deviceTime = event->deviceTime;
+        sample.hostTime = event->hostTime;
+        samples.PushDroppingOldest(sample);
+        decimationCount = 0;
+    }
+
+    // One notification per sample.  A tilt is still there on the next sample, a nudge may not be.
+    if (config.nudgeThreshold > 0 && nudgeDistance > config.nudgeThreshold &&
+        (!nudged || event->deviceTime - lastNudgeTime >= (uint64_t)config.nudgeHoldoffMilliseconds * 1000))
+    {
+        nudged = true;
+        lastNudgeTime = event->deviceTime;
+        Notify(event, kPREventTypeAccelerometerNudge, (uint32_t)lroundf(nudgeDistance));
+        return true;
+    }
+    if (config.tiltThreshold > 0)
+    {
+        float tiltDistance = PRAccelDistance(filtered, level);
+        if (!tilted && tiltDistance > config.tiltThreshold)
+        {
+            tilted = true;
+            Notify(event, kPREventTypeAccelerometerTilt, (uint32_t)lroundf(tiltDistance));
+            return true;
+        }
+        if (tilted && tiltDistance <= config.tiltThreshold / 2.0f)
+        {
+            tilted = false;
+            Notify(event, kPREventTypeAccelerometerTilt, 0);
+            return true;
+        }
+    }
+    return false;
+}
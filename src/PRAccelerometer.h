@@ -0,0 +1,101 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PRAccelerometer.h
+ *  libpinproc
+ */
+#ifndef PINPROC_PRACCELEROMETER_H
+#define PINPROC_PRACCELEROMETER_H
+#if !defined(__GNUC__) || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4) || (__GNUC__ >= 4)	// GCC supports "pragma once" correctly since 3.4
+#pragma once
+#endif
+
+#include "pinproc.h"
+#include "PREventRing.h"
+#include <atomic>
+#include <mutex>
+
+#define accelBaselineAlpha (1.0f / 64) // Weight of each sample in the resting position nudges are measured from.
+
+/**
+ * Combines accelerometer X, Y and Z events into samples while PRAccelConfig::enabled is set,
+ * filters them, queues them for PRAccelGetSamples() and turns nudges and tilts into events.
+ *
+ * The P-ROC sends the three axes as consecutive events, so a Z value completes a sample with
+ * the X and Y values before it.  Process() belongs to whichever thread decodes events;
+ * everything else may be called from any thread.  The filter state is guarded by mutex,
+ * which is only taken for accelerometer events.
+ */
+class PRAccelerometer
+{
+public:
+    PRAccelerometer();
+
+    void SetConfig(const PRAccelConfig *config);
+    void GetConfig(PRAccelConfig *config);
+    /** Makes the next filtered sample the level position. */
+    void SetLevel();
+
+    /** True if X, Y and Z events should go to Process() instead of the event queue. */
+    bool Enabled() const { return enabled.load(std::memory_order_relaxed); }
+    static bool IsAxisType(PREventType type)
+    {
+        return type >= kPREventTypeAccelerometerX && type <= kPREventTypeAccelerometerZ;
+    }
+
+    /**
+     * Takes an X, Y or Z event that has been timed.  Returns true if it has been turned into a
+     * nudge or tilt event to be passed on instead; otherwise the event has been consumed.
+     */
+    bool Process(PREventEx *event);
+
+    /** Consumer side of the sample queue. */
+    int GetSamples(PRAccelSample *samplesOut, int maxSamples) { return samples.Pop(samplesOut, maxSamples); }
+
+protected:
+    void Restart();
+    /** Turns event into a notification of the given type and value. */
+    static void Notify(PREventEx *event, PREventType type, uint32_t value);
+
+    std::mutex mutex;
+    PRAccelConfig config; /**< Guarded by mutex, as is everything below it. */
+    std::atomic<bool> enabled;
+    int32_t pendingValues[2]; /**< X and Y values waiting for a Z value. */
+    uint32_t pendingAxes; /**< Bit per axis in pendingValues received since the last sample. */
+    bool filterStarted;
+    float filtered[3]; /**< Output of the low-pass filter. */
+    float baseline[3]; /**< Resting position: the samples filtered with accelBaselineAlpha. */
+    bool levelSet;
+    float level[3]; /**< Filtered sample tilts are measured from. */
+    bool tilted;
+    bool nudged;
+    uint64_t lastNudgeTime; /**< Device time of the last nudge event, if nudged. */
+    int32_t decimationCount;
+
+    PRRing<PRAccelSample> samples;
+};
+
+#endif	/* PINPROC_PRACCELEROMETER_H */
@@ -0,0 +1,113 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PRByteOrder.cpp
+ *  libpinproc
+ */
+
+#include "PRByteOrder.h"
+#include <string.h>
+
+#if !PR_HOST_BIG_ENDIAN
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PR_BYTEORDER_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+#endif
+
+#if !PR_HOST_BIG_ENDIAN
+/**
+ * Reverses the bytes of each 32-bit word going from src to dst.  Encoding and decoding are
+ * the same operation on a little-endian host.  Neither pointer needs to be aligned.
+ */
+static void SwapWords(const uint8_t *src, uint8_t *dst, int32_t numWords)
+{
+    int32_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    for (; i + 8 <= numWords; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + (i * 4)));
+        _mm256_storeu_si256((__m256i *)(dst + (i * 4)), _mm256_shuffle_epi8(v, mask));
+    }
+#elif defined(__SSSE3__)
+    const __m128i mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    for (; i + 4 <= numWords; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + (i * 4)));
+        _mm_storeu_si128((__m128i *)(dst + (i * 4)), _mm_shuffle_epi8(v, mask));
+    }
+#elif defined(PR_BYTEORDER_SSE2)
+    // No byte shuffle before SSSE3: swap the bytes of each 16-bit half, then the halves.
+    for (; i + 4 <= numWords; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + (i * 4)));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i *)(dst + (i * 4)), v);
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; i + 4 <= numWords; i += 4)
+        vst1q_u8(dst + (i * 4), vrev32q_u8(vld1q_u8(src + (i * 4))));
+#endif
+
+    // Whatever the vector loop left over, or everything on other hosts.
+    for (; i < numWords; i++)
+    {
+        uint32_t word;
+        memcpy(&word, src + (i * 4), 4);
+        word = PRSwapBytes32(word);
+        memcpy(dst + (i * 4), &word, 4);
+    }
+}
+#endif
+
+void PREncodeWordsBE(const uint32_t *words, uint8_t *bytes, int32_t numWords)
+{
+#if PR_HOST_BIG_ENDIAN
+    memcpy(bytes, words, numWords * 4);
+#else
+    SwapWords((const uint8_t *)words, bytes, numWords);
+#endif
+}
+
+void PRDecodeWordsBE(const uint8_t *bytes, uint32_t *words, int32_t numWords)
+{
+#if PR_HOST_BIG_ENDIAN
+    memcpy(words, bytes, numWords * 4);
+#else
+    SwapWords(bytes, (uint8_t *)words, numWords);
+#endif
+}
@@ -0,0 +1,75 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PRByteOrder.h
+ *  libpinproc
+ */
+#ifndef PINPROC_PRBYTEORDER_H
+#define PINPROC_PRBYTEORDER_H
+#if !defined(__GNUC__) || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4) || (__GNUC__ >= 4)	// GCC supports "pragma once" correctly since 3.4
+#pragma once
+#endif
+
+#include "pinproc.h"
+
+#if defined(_MSC_VER)
+#include <stdlib.h>
+#endif
+
+// The P-ROC sends and receives 32-bit words most significant byte first.
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define PR_HOST_BIG_ENDIAN 1
+#else
+#define PR_HOST_BIG_ENDIAN 0
+#endif
+
+static inline uint32_t PRSwapBytes32(uint32_t word)
+{
+#if defined(__GNUC__)
+    return __builtin_bswap32(word);
+#elif defined(_MSC_VER)
+    return _byteswap_ulong(word);
+#else
+    return (word >> 24) | ((word >> 8) & 0x0000ff00) | ((word << 8) & 0x00ff0000) | (word << 24);
+#endif
+}
+
+/** Converts a host order word to the byte order used on the wire, or back again. */
+static inline uint32_t PRWireWord(uint32_t word)
+{
+#if PR_HOST_BIG_ENDIAN
+    return word;
+#else
+    return PRSwapBytes32(word);
+#endif
+}
+
+/** Converts numWords host order words into big-endian bytes. */
+void PREncodeWordsBE(const uint32_t *words, uint8_t *bytes, int32_t numWords);
+/** Converts numWords big-endian words starting at bytes into host order words. */
+void PRDecodeWordsBE(const uint8_t *bytes, uint32_t *words, int32_t numWords);
+
+#endif /* PINPROC_PRBYTEORDER_H */
@@ -0,0 +1,253 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PRCapture.cpp
+ *  libpinproc
+ */
+
+#include "PRCapture.h"
+#include "PRCommon.h"
+#include "PREventClock.h"
+#include <string.h>
+#include <vector>
+#include <atomic>
+
+#define captureBufferSize (256 * 1024)
+
+static const uint8_t capturePadding[8] = { 0 };
+
+static size_t CapturePaddedLength(uint32_t length)
+{
+    return (length + 7) & ~(size_t)7;
+}
+
+PRWireCapture::PRWireCapture() : file(NULL) {}
+
+PRWireCapture::~PRWireCapture()
+{
+    Close();
+}
+
+PRResult PRWireCapture::Open(const char *path)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        PRSetLastErrorText("Unable to create capture file %s.", path);
+        return kPRFailure;
+    }
+    // Records are small; a large buffer keeps the writes off the I/O path most of the time.
+    setvbuf(file, NULL, _IOFBF, captureBufferSize);
+
+    PRCaptureFileHeader header;
+    memcpy(header.magic, kPRCaptureMagic, sizeof(header.magic));
+    header.version = kPRCaptureVersion;
+    header.headerSize = sizeof(header);
+    header.startTime = PRHostTimeMicroseconds();
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+    {
+        PRSetLastErrorText("Unable to write capture file %s.", path);
+        fclose(file);
+        file = NULL;
+        return kPRFailure;
+    }
+    return kPRSuccess;
+}
+
+void PRWireCapture::Close()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (file != NULL)
+        fclose(file);
+    file = NULL;
+}
+
+void PRWireCapture::Record(PRCaptureDirection direction, const uint8_t *bytes, int numBytes)
+{
+    if (numBytes <= 0)
+        return;
+
+    PRCaptureRecord record;
+    record.time = PRHostTimeMicroseconds();
+    record.length = numBytes;
+    record.direction = direction;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (file == NULL)
+        return;
+    if (fwrite(&record, sizeof(record), 1, file) != 1 ||
+        fwrite(bytes, 1, numBytes, file) != (size_t)numBytes ||
+        fwrite(capturePadding, 1, CapturePaddedLength(numBytes) - numBytes, file) != CapturePaddedLength(numBytes) - numBytes)
+    {
+        DEBUG(PRLog(kPRLogError, "Error writing capture file; capture stopped.\n"));
+        fclose(file);
+        file = NULL;
+    }
+}
+
+// Replay transport.  The whole capture is loaded at open; records are walked in place.
+
+typedef struct PRReplayState {
+    std::vector<uint8_t> data;
+    size_t nextRecord; /**< Offset of the next record header not looked at yet. */
+    const uint8_t *chunk; /**< Received bytes of the current record not returned yet. */
+    uint32_t chunkBytes;
+    uint32_t recordedWritten; /**< Bytes written before the next received record, as recorded.  Wraps. */
+    std::atomic<uint32_t> bytesWritten; /**< Bytes written by the application so far.  Wraps; written by the flush thread. */
+    double speed;
+    uint64_t recordedStart; /**< startTime of the capture. */
+    uint64_t replayStart; /**< Host time the replay started. */
+    uint64_t lastTransmitTime; /**< Recorded time of the last written record walked over. */
+    bool requestPending; /**< A written record was walked over since lag was last updated. */
+    double lag; /**< Microseconds the application has fallen behind the recording by. */
+} PRReplayState;
+
+static void *ReplayOpen(PRMachineType, const PRCreateOptions *options)
+{
+    if (options->replayFile == NULL)
+    {
+        PRSetLastErrorText("The replay transport requires a replay file.");
+        return NULL;
+    }
+    FILE *file = fopen(options->replayFile, "rb");
+    if (file == NULL)
+    {
+        PRSetLastErrorText("Unable to open replay file %s.", options->replayFile);
+        return NULL;
+    }
+
+    PRReplayState *replay = new PRReplayState;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    replay->data.resize(size > 0 ? size : 0);
+    if (size > 0 && fread(&replay->data[0], 1, size, file) != (size_t)size)
+        replay->data.clear();
+    fclose(file);
+
+    PRCaptureFileHeader header;
+    if (replay->data.size() < sizeof(header))
+    {
+        PRSetLastErrorText("%s is not a capture.", options->replayFile);
+        delete replay;
+        return NULL;
+    }
+    memcpy(&header, &replay->data[0], sizeof(header));
+    if (memcmp(header.magic, kPRCaptureMagic, sizeof(header.magic)) != 0 || header.headerSize < sizeof(header))
+    {
+        PRSetLastErrorText("%s is not a capture.", options->replayFile);
+        delete replay;
+        return NULL;
+    }
+    if (header.version != kPRCaptureVersion)
+    {
+        PRSetLastErrorText("Capture %s has unsupported version %d.", options->replayFile, header.version);
+        delete replay;
+        return NULL;
+    }
+
+    replay->nextRecord = header.headerSize;
+    replay->chunk = NULL;
+    replay->chunkBytes = 0;
+    replay->recordedWritten = 0;
+    replay->bytesWritten = 0;
+    replay->speed = options->replaySpeed;
+    replay->recordedStart = header.startTime;
+    replay->replayStart = PRHostTimeMicroseconds();
+    replay->lastTransmitTime = header.startTime;
+    replay->requestPending = false;
+    replay->lag = 0;
+    return replay;
+}
+
+static void ReplayClose(void *state)
+{
+    delete (PRReplayState *)state;
+}
+
+static int ReplayRead(void *state, uint8_t *buffer, int maxBytes)
+{
+    PRReplayState *replay = (PRReplayState *)state;
+
+    while (replay->chunkBytes == 0)
+    {
+        PRCaptureRecord record;
+        if (replay->nextRecord + sizeof(record) > replay->data.size())
+            return 0; // End of the capture; the device stays quiet from now on.
+        memcpy(&record, &replay->data[replay->nextRecord], sizeof(record));
+        size_t payload = replay->nextRecord + sizeof(record);
+        if (payload + record.length > replay->data.size())
+            return 0; // Cut off mid-record, as a capture of a crashed process may be.
+
+        if (record.direction == kPRCaptureTransmitted)
+        {
+            replay->recordedWritten += record.length;
+            replay->lastTransmitTime = record.time;
+            replay->requestPending = true;
+            replay->nextRecord = payload + CapturePaddedLength(record.length);
+            continue;
+        }
+
+        // Hold the chunk back until its request has been made and, unless playing as fast
+        // as possible, until its time has come.  An application that made a request later
+        // than the recorded one delays everything after it by as much.
+        if ((int32_t)(replay->bytesWritten.load() - replay->recordedWritten) < 0)
+            return 0;
+        if (replay->speed > 0)
+        {
+            double now = (double)(int64_t)(PRHostTimeMicroseconds() - replay->replayStart);
+            if (replay->requestPending)
+            {
+                double late = now - (double)(int64_t)(replay->lastTransmitTime - replay->recordedStart) / replay->speed;
+                if (late > replay->lag)
+                    replay->lag = late;
+                replay->requestPending = false;
+            }
+            double due = (double)(int64_t)(record.time - replay->recordedStart) / replay->speed + replay->lag;
+            if (now < due)
+                return 0;
+        }
+        replay->chunk = &replay->data[payload];
+        replay->chunkBytes = record.length;
+        replay->nextRecord = payload + CapturePaddedLength(record.length);
+    }
+
+    int numBytes = (uint32_t)maxBytes < replay->chunkBytes ? maxBytes : (int)replay->chunkBytes;
+    memcpy(buffer, replay->chunk, numBytes);
+    replay->chunk += numBytes;
+    replay->chunkBytes -= numBytes;
+    return numBytes;
+}
+
+static int ReplayWrite(void *state, uint8_t *, int bytes)
+{
+    PRReplayState *replay = (PRReplayState *)state;
+    replay->bytesWritten += bytes;
+    return bytes;
+}
+
+const PRTransport PRReplayTransport = { ReplayOpen, ReplayClose, ReplayRead, ReplayWrite, NULL };
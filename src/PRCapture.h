@@ -0,0 +1,62 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PRCapture.h
+ *  libpinproc
+ */
+#ifndef PINPROC_PRCAPTURE_H
+#define PINPROC_PRCAPTURE_H
+#if !defined(__GNUC__) || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4) || (__GNUC__ >= 4)	// GCC supports "pragma once" correctly since 3.4
+#pragma once
+#endif
+
+#include <stdio.h>
+#include <mutex>
+#include "PRTransport.h"
+
+/**
+ * Writes a capture in the format described with #PRCaptureFileHeader.  The device records
+ * each transport read and write through it right where it calls the transport, so the
+ * capture doesn't depend on which transport is in use.  Record() is called from both the
+ * read and the write side, so it serializes on its own mutex.
+ */
+class PRWireCapture
+{
+public:
+    PRWireCapture();
+    ~PRWireCapture();
+
+    PRResult Open(const char *path);
+    void Close();
+
+    void Record(PRCaptureDirection direction, const uint8_t *bytes, int numBytes);
+
+protected:
+    FILE *file;
+    std::mutex mutex;
+};
+
+#endif	/* PINPROC_PRCAPTURE_H */
@@ -29,27 +29,62 @@
  */
 
 #include "PRDevice.h"
+#include "PRSimulator.h"
+#include "PRByteOrder.h"
+#include "PRMachineImage.h"
 #include <stdlib.h>
 #include <string.h>
 #ifndef _MSC_VER
 #include <unistd.h>
 #endif
 #include <stdio.h>
+#include <chrono>
+#include <algorithm>
+#if defined(__APPLE__)
+#include <pthread.h>
+#include <mach/mach.h>
+#elif !defined(_MSC_VER)
+#include <pthread.h>
+#include <time.h>
+#endif
 
-PRDevice::PRDevice(PRMachineType machineType) : machineType(machineType)
+PRDevice::PRDevice(PRMachineType machineType, const PRCreateOptions *options) : eventThreadRunning(false), eventThreadStop(false), eventThreadError(false), wakeupPending(false), flushThreadRunning(false), flushThreadStop(false), flushRequested(false), flushThreadError(false), transport(NULL), transportState(NULL), wireCapture(NULL), machineType(machineType), createOptions(*options)
 {
+    memset(&writeFlushPolicy, 0, sizeof(writeFlushPolicy));
+    preparedWriteWords = writeBuffers[0];
+    numPreparedWriteWords = 0;
+    emptySwitchRulesPolarity = false;
+    switchRulesBatchOpen = false;
+    memset(switchRuleBatchFlags, 0, sizeof(switchRuleBatchFlags));
+    memset(deviceSwitchRuleKnown, 0, sizeof(deviceSwitchRuleKnown));
+    nextReadTicket = 1;
+    unrequestedWordsHead = 0;
+    version = 0;
+    SetEventDecoder();
+    linkParams = createOptions.linkParams;
+    eventRing.Allocate(createOptions.eventQueueSize > 0 ? createOptions.eventQueueSize : defaultRingEvents);
+    eventOverflowPolicy = createOptions.eventOverflowPolicy;
+    lastDMDEventPosition = 0;
+    queuedDMDEvent = false;
+    heldDMDEvent = false;
+    eventQueueHighWater = 0;
+    eventsDropped = 0;
+    eventsCoalesced = 0;
+
     // Reset internally maintainted driver and switch structures, but do not update the device.
     Reset(kPRResetFlagDefault);
 }
 
 PRDevice::~PRDevice()
 {
+    StopFlushThread();
+    StopEventThread();
     Close();
 }
 
-PRDevice* PRDevice::Create(PRMachineType machineType)
+PRDevice* PRDevice::Create(PRMachineType machineType, const PRCreateOptions *options)
 {
-    PRDevice *dev = new PRDevice(machineType);
+    PRDevice *dev = new PRDevice(machineType, options);
 
     if (dev == NULL)
     {
@@ -89,6 +124,13 @@ PRDevice* PRDevice::Create(PRMachineType machineType)
         return NULL;
     }
 
+    if (dev->createOptions.eventThread && !dev->StartEventThread())
+    {
+        DEBUG(PRLog(kPRLogError, "Error starting event thread.\n"));
+        delete dev;
+        return NULL;
+    }
+
     return dev;
 }
 
@@ -96,18 +138,35 @@ PRResult PRDevice::Reset(uint32_t resetFlags)
 {
     int i;
 
-    // Initialize buffer pointers
-    collected_bytes_rd_addr = 0;
-    collected_bytes_wr_addr = 0;
-    num_collected_bytes = 0;
+    // The receive side belongs to the event thread while it is running.
+    if (!eventThreadRunning)
+    {
+        // Initialize buffer pointers
+        num_collected_words = 0;
+        num_partial_bytes = 0;
+        last_collected_bytes = 0;
+        last_collected_time = 0;
+
+        // Make sure the data queues are empty.
+        unrequestedWords.clear();
+        unrequestedTimes.clear();
+        unrequestedWordsHead = 0;
+        eventRing.Clear();
+        queuedDMDEvent = false;
+        heldDMDEvent = false;
+    }
+    {
+        std::lock_guard<std::recursive_mutex> lock(writeMutex);
+        numPreparedWriteWords = 0;
+    }
 
-    // Make sure the data queues are empty.
-    while (!unrequestedDataQueue.empty()) unrequestedDataQueue.pop();
-    while (!requestedDataQueue.empty()) requestedDataQueue.pop();
-    num_collected_bytes = 0;
-    numPreparedWriteWords = 0;
+    // Without a readback everything is written, as if the device held nothing useful.
+    bool reconcile = (resetFlags & kPRResetFlagUpdateDevice) && (resetFlags & kPRResetFlagReconcile) &&
+                     ReadDeviceTables() == kPRSuccess;
+    bool keepBatch = reconcile && switchRulesBatchOpen;
 
     if (machineType != kPRMachineCustom && machineType != kPRMachinePDB) DriverLoadMachineTypeDefaults(machineType, resetFlags);
+    readbackDriverWords.clear();
 
     // Disable dmd events if updating the device.
 #if 0
@@ -119,8 +178,12 @@ PRResult PRDevice::Reset(uint32_t resetFlags)
     }
 #endif
 
-    // Make sure the free list is empty.
-    while (!freeSwitchRuleIndexes.empty()) freeSwitchRuleIndexes.pop();
+    // Make sure the free list is empty, and drop any open batch unless it takes the reconciled rules.
+    switchRulePool.Clear();
+    switchRulesBatchOpen = keepBatch;
+    batchLinkedSwitchRules.clear();
+    batchPrimarySwitchRules.clear();
+    memset(switchRuleBatchFlags, 0, sizeof(switchRuleBatchFlags));
 
 	memset(switchRules, 0x00, sizeof(PRSwitchRuleInternal) * maxSwitchRules);
 
@@ -139,154 +202,593 @@ PRResult PRDevice::Reset(uint32_t resetFlags)
         if (switchRule->switchNum >= kPRSwitchNeverDebounceFirst &&
             (switchRule->eventType == kPREventTypeSwitchClosedDebounced ||
              switchRule->eventType == kPREventTypeSwitchOpenDebounced))
-            freeSwitchRuleIndexes.push(ruleIndex);
+            switchRulePool.Add(ruleIndex);
     }
 
-    // Create empty switch rule for clearing the rules in the device.
-    PRSwitchRule emptySwitchRule;
-    memset(&emptySwitchRule, 0x00, sizeof(PRSwitchRule));
-
-    for (i = 0; i < kPRSwitchCount; i++)
+    // Send a blank rule for each switch and event type to the device if necessary.
+    if (reconcile)
+        return ReconcileSwitchRules();
+    if (resetFlags & kPRResetFlagUpdateDevice)
     {
-        // Send blank rule for each event type to Device if necessary
-        if (resetFlags & kPRResetFlagUpdateDevice)
+        const vector<uint32_t> &image = EmptySwitchRulesImage();
+        for (i = 0; i < maxSwitchRules; i++)
         {
-            SwitchUpdateRule(i, kPREventTypeSwitchOpenDebounced, &emptySwitchRule, NULL, 0, false);
-            SwitchUpdateRule(i, kPREventTypeSwitchClosedDebounced, &emptySwitchRule, NULL, 0, false);
-            SwitchUpdateRule(i, kPREventTypeSwitchOpenNondebounced, &emptySwitchRule, NULL, 0, false);
-            SwitchUpdateRule(i, kPREventTypeSwitchClosedNondebounced, &emptySwitchRule, NULL, 0, false);
+            memcpy(deviceSwitchRules[i], &image[i * switchRuleBurstWords + 1], sizeof(deviceSwitchRules[i]));
+            deviceSwitchRuleKnown[i] = true;
         }
+        return PrepareWireWords(&image[0], (int32_t)image.size(), switchRuleBurstWords);
     }
 
+    // Whatever the device holds, it wasn't written by this handle.
+    memset(deviceSwitchRuleKnown, 0, sizeof(deviceSwitchRuleKnown));
     return kPRSuccess;
 }
 
-int PRDevice::GetEvents(PREvent *events, int maxEvents)
+PRResult PRDevice::ReadDeviceTables()
 {
-    if (SortReturningData() != kPRSuccess)
+    const int32_t ruleWords = maxSwitchRules << P_ROC_SWITCH_RULE_NUM_TO_ADDR_SHIFT;
+    const int32_t driverWords = kPRDriverCount << P_ROC_DRIVER_CONFIG_TABLE_DRIVER_NUM_SHIFT;
+    const int32_t wordsPerRead = 1024;
+    vector<uint32_t> ruleWordsRead(ruleWords);
+    readbackDriverWords.resize(driverWords);
+
+    // Send every request before waiting, so the reads follow each other without a round trip in between.
+    vector<int32_t> tickets;
+    for (int32_t addr = 0; addr < ruleWords; addr += wordsPerRead)
+        tickets.push_back(ReadDataAsync(P_ROC_BUS_STATE_CHANGE_PROC_SELECT, addr, wordsPerRead, &ruleWordsRead[addr], NULL, NULL));
+    tickets.push_back(ReadDataAsync(P_ROC_BUS_DRIVER_CTRL_SELECT, P_ROC_DRIVER_CONFIG_TABLE_DECODE << P_ROC_DRIVER_CTRL_DECODE_SHIFT,
+                                    driverWords, &readbackDriverWords[0], NULL, NULL));
+    FlushWriteData();
+
+    PRResult res = kPRSuccess;
+    for (size_t i = 0; i < tickets.size(); i++)
     {
-        PRSetLastErrorText("GetEvents ERROR: Error in CollectReadData");
-	    return -1;
+        if (tickets[i] < 0 || (res == kPRSuccess && WaitForRead(tickets[i], 100*1000) != 1))
+            res = kPRFailure;
+        if (res != kPRSuccess && tickets[i] >= 0)
+            CancelRead(tickets[i]);
+    }
+    if (res != kPRSuccess)
+    {
+        DEBUG(PRLog(kPRLogWarning, "Reading back the switch rules and drivers failed; writing all of them.\n"));
+        readbackDriverWords.clear();
+        return kPRFailure;
     }
 
-    // The unrequestedDataQueue only has unrequested switch event data.  Pop
-    // events out 1 at a time, interpret them, and populate the outgoing list with them.
-    int i;
-    for (i = 0; (i < maxEvents) && !unrequestedDataQueue.empty(); i++)
+    for (int32_t i = 0; i < maxSwitchRules; i++)
+    {
+        for (int32_t j = 0; j < switchRuleBurstWords - 1; j++)
+            deviceSwitchRules[i][j] = PRWireWord(ruleWordsRead[(i << P_ROC_SWITCH_RULE_NUM_TO_ADDR_SHIFT) + j]);
+        deviceSwitchRuleKnown[i] = true;
+    }
+    return kPRSuccess;
+}
+
+PRResult PRDevice::ReconcileSwitchRules()
+{
+    const vector<uint32_t> &image = EmptySwitchRulesImage();
+    vector<uint32_t> bursts;
+    int numChanged = 0;
+    for (uint16_t i = 0; i < maxSwitchRules; i++)
     {
-        uint32_t event_data = unrequestedDataQueue.front();
-        unrequestedDataQueue.pop();
+        const uint32_t *burst = &image[i * switchRuleBurstWords];
+        if (memcmp(deviceSwitchRules[i], &burst[1], sizeof(deviceSwitchRules[i])) == 0)
+            continue;
+        numChanged++;
+        if (switchRulesBatchOpen)
+        {
+            // Rules set again before the commit are compared with what the device holds.  Pool
+            // rules the device may still follow aren't handed out until then.
+            WriteSwitchRule(i, switchRulePool.IsMember(i), false);
+            if (switchRulePool.IsMember(i))
+                switchRulePool.Hold(i);
+            continue;
+        }
+        memcpy(deviceSwitchRules[i], &burst[1], sizeof(deviceSwitchRules[i]));
+        bursts.insert(bursts.end(), burst, burst + switchRuleBurstWords);
+    }
+    DEBUG(PRLog(kPRLogInfo, "Reconciled switch rules: %d of %d differ from the defaults.\n", numChanged, maxSwitchRules));
+    if (bursts.empty())
+        return kPRSuccess;
+    return PrepareWireWords(&bursts[0], (int32_t)bursts.size(), switchRuleBurstWords);
+}
 
-        int type;
-        bool open, debounced;
+const vector<uint32_t> &PRDevice::EmptySwitchRulesImage()
+{
+    if (emptySwitchRulesImage.empty() || emptySwitchRulesPolarity != driverGlobalConfig.globalPolarity)
+    {
+        PRSwitchRuleInternal emptySwitchRule;
+        memset(&emptySwitchRule, 0x00, sizeof(PRSwitchRuleInternal));
+        emptySwitchRule.driver.polarity = driverGlobalConfig.globalPolarity;
 
-        if (version >= 2) {
-            events[i].value = event_data & P_ROC_V2_EVENT_SWITCH_NUM_MASK;
-            type = (event_data & P_ROC_V2_EVENT_TYPE_MASK) >> P_ROC_V2_EVENT_TYPE_SHIFT;
-            open = (event_data & P_ROC_V2_EVENT_SWITCH_STATE_MASK) >> P_ROC_V2_EVENT_SWITCH_STATE_SHIFT;
-            debounced = (event_data & P_ROC_V2_EVENT_SWITCH_DEBOUNCED_MASK) >> P_ROC_V2_EVENT_SWITCH_DEBOUNCED_SHIFT;
-            events[i].time = (event_data & P_ROC_V2_EVENT_SWITCH_TIMESTAMP_MASK) >> P_ROC_V2_EVENT_SWITCH_TIMESTAMP_SHIFT;
+        emptySwitchRulesImage.resize(maxSwitchRules * switchRuleBurstWords);
+        for (uint16_t i = 0; i < maxSwitchRules; i++)
+        {
+            ParseSwitchRuleIndex(i, &emptySwitchRule.switchNum, &emptySwitchRule.eventType);
+            CreateSwitchUpdateRulesBurst(&emptySwitchRulesImage[i * switchRuleBurstWords], &emptySwitchRule, false);
         }
-        else {
-            type = (event_data & P_ROC_V1_EVENT_TYPE_MASK) >> P_ROC_V1_EVENT_TYPE_SHIFT;
-            events[i].value = event_data & P_ROC_V1_EVENT_SWITCH_NUM_MASK;
-            open = (event_data & P_ROC_V1_EVENT_SWITCH_STATE_MASK) >> P_ROC_V1_EVENT_SWITCH_STATE_SHIFT;
-            debounced = (event_data & P_ROC_V1_EVENT_SWITCH_DEBOUNCED_MASK) >> P_ROC_V1_EVENT_SWITCH_DEBOUNCED_SHIFT;
-            events[i].time = (event_data & P_ROC_V1_EVENT_SWITCH_TIMESTAMP_MASK) >> P_ROC_V1_EVENT_SWITCH_TIMESTAMP_SHIFT;
+        emptySwitchRulesPolarity = driverGlobalConfig.globalPolarity;
+    }
+    return emptySwitchRulesImage;
+}
+
+PRResult PRDevice::BeginGetEvents()
+{
+    if (writeFlushPolicy.flushOnGetEvents)
+        RequestFlush();
+
+    if (eventThreadRunning)
+    {
+        if (eventThreadError.exchange(false))
+        {
+            PRSetLastErrorText("GetEvents ERROR: Error in CollectReadData");
+            return kPRFailure;
         }
 
+        // Drain before popping; anything pushed after this point signals again.
+        wakeupPending = false;
+        eventWakeup.Drain();
+        return kPRSuccess;
+    }
+
+    if (SortReturningData() != kPRSuccess)
+    {
+        PRSetLastErrorText("GetEvents ERROR: Error in CollectReadData");
+        return kPRFailure;
+    }
+    return kPRSuccess;
+}
+
+void PRDevice::EndGetEvents()
+{
+    if (eventThreadRunning && eventRing.Size() > 0)
+        NotifyEvents(); // The caller didn't take everything.
+}
+
+int PRDevice::GetEvents(PREvent *events, int maxEvents)
+{
+    if (BeginGetEvents() != kPRSuccess)
+        return -1;
+
+    int numEvents = eventRing.Pop(events, maxEvents);
+    EndGetEvents();
+    return numEvents;
+}
+
+int PRDevice::GetEventsEx(PREventEx *events, int maxEvents)
+{
+    if (BeginGetEvents() != kPRSuccess)
+        return -1;
+
+    int numEvents = eventRing.Pop(events, maxEvents);
+    EndGetEvents();
+    return numEvents;
+}
+
+int PRDevice::GetEventsSoA(PREventType *types, uint32_t *values, uint32_t *times, int maxEvents)
+{
+    if (BeginGetEvents() != kPRSuccess)
+        return -1;
+
+    int numEvents = eventRing.PopSoA(types, values, times, maxEvents);
+    EndGetEvents();
+    return numEvents;
+}
+
+void PRDevice::ConsumeUnrequestedWords(int32_t numWords)
+{
+    unrequestedWordsHead += numWords;
+    if (unrequestedWordsHead == unrequestedWords.size())
+    {
+        // Keeps the capacity, so a steady stream of events doesn't allocate.
+        unrequestedWords.clear();
+        unrequestedTimes.clear();
+        unrequestedWordsHead = 0;
+    }
+    else if (unrequestedWordsHead >= unrequestedWords.size() / 2)
+    {
+        unrequestedWords.erase(unrequestedWords.begin(), unrequestedWords.begin() + unrequestedWordsHead);
+        unrequestedTimes.erase(unrequestedTimes.begin(), unrequestedTimes.begin() + unrequestedWordsHead);
+        unrequestedWordsHead = 0;
+    }
+}
 
-        //fprintf(stderr, "\nLibpinproc: event type: %d", type);
-        switch (type)
+void PRDevice::TimeEvent(PREventEx *event, uint64_t receiveTime)
+{
+    event->deviceTime = eventClock.Update(event->type, event->time, receiveTime);
+    event->hostReceiveTime = receiveTime;
+    event->hostTime = eventClock.ToHostTime(event->deviceTime);
+    if (event->hostTime > receiveTime)
+        event->hostTime = receiveTime; // The estimate hasn't caught up with a faster link yet.
+}
+
+int32_t PRDevice::ProcessEvents(PREventEx *events, int32_t numEvents)
+{
+    const uint64_t *receiveTimes = &unrequestedTimes[unrequestedWordsHead];
+    int32_t numKept = 0;
+    for (int32_t i = 0; i < numEvents; i++)
+    {
+        TimeEvent(&events[i], receiveTimes[i]);
+        if (accelerometer.Enabled() && PRAccelerometer::IsAxisType(events[i].type) && !accelerometer.Process(&events[i]))
+            continue;
+        switchStates.Apply(events[i].type, events[i].value, events[i].time);
+        if (!eventHandlers.Dispatch(&events[i]))
+            events[numKept++] = events[i];
+    }
+    eventClock.Publish();
+    return numKept;
+}
+
+void PRDevice::DecodeUnrequestedWords()
+{
+    int32_t numQueued = QueueHeldDMDEvent();
+    while (NumUnrequestedWords() > 0)
+    {
+        uint32_t numFree;
+        PREventEx *span = eventRing.WriteSpan(&numFree);
+        if (numFree == 0)
         {
-            case P_ROC_EVENT_TYPE_SWITCH:
+            if (eventOverflowPolicy != kPREventOverflowDropNewest)
             {
-                if (open)
-                    events[i].type = debounced ? kPREventTypeSwitchOpenDebounced : kPREventTypeSwitchOpenNondebounced;
-                else
-                    events[i].type = debounced ? kPREventTypeSwitchClosedDebounced : kPREventTypeSwitchClosedNondebounced;
-                break;
+                uint32_t numNeeded = (uint32_t)NumUnrequestedWords() < eventRing.Capacity() ? (uint32_t)NumUnrequestedWords() : eventRing.Capacity();
+                eventsDropped += eventRing.DropOldest(numNeeded);
+                continue;
             }
 
-            case P_ROC_EVENT_TYPE_DMD:
-            {
-                events[i].type = kPREventTypeDMDFrameDisplayed;
-                break;
-            }
+            // The rest still updates the switch states and reaches the handlers.
+            PREventEx discarded[64];
+            int32_t numWords = NumUnrequestedWords() < 64 ? NumUnrequestedWords() : 64;
+            decodeEventsEx(&unrequestedWords[unrequestedWordsHead], numWords, discarded);
+            eventsDropped += ProcessEvents(discarded, numWords);
+            ConsumeUnrequestedWords(numWords);
+            continue;
+        }
 
-            case P_ROC_EVENT_TYPE_BURST_SWITCH:
+        int32_t numWords = NumUnrequestedWords() < (int32_t)numFree ? NumUnrequestedWords() : (int32_t)numFree;
+        decodeEventsEx(&unrequestedWords[unrequestedWordsHead], numWords, span);
+        int32_t numKept = ProcessEvents(span, numWords);
+        if (eventOverflowPolicy == kPREventOverflowCoalesceDMD)
+            numKept = CoalesceDMDEvents(span, numKept);
+        eventRing.Commit(numKept);
+        ConsumeUnrequestedWords(numWords);
+        numQueued += numKept;
+    }
+    if (numQueued == 0)
+        return;
+
+    uint32_t size = eventRing.Size();
+    if (size > eventQueueHighWater.load(std::memory_order_relaxed))
+        eventQueueHighWater = size;
+    if (eventThreadRunning)
+        NotifyEvents();
+}
+
+int32_t PRDevice::CoalesceDMDEvents(PREventEx *events, int32_t numEvents)
+{
+    uint32_t position = eventRing.Head();
+    int32_t numKept = 0;
+    for (int32_t i = 0; i < numEvents; i++)
+    {
+        if (events[i].type == kPREventTypeDMDFrameDisplayed)
+        {
+            // Whatever was held back is older than this one either way.
+            if (heldDMDEvent)
             {
-                //fprintf(stderr, "\nBurst event");
-                if (open) events[i].type = kPREventTypeBurstSwitchOpen;
-                else events[i].type = kPREventTypeBurstSwitchClosed;
-                break;
+                eventsCoalesced++;
+                heldDMDEvent = false;
             }
-
-            case P_ROC_EVENT_TYPE_ACCELEROMETER:
+            // The queued event can't be changed under the reader, so hold this one back until
+            // the reader has taken it.
+            if (queuedDMDEvent && eventRing.IsQueued(lastDMDEventPosition))
             {
-                events[i].time = events[i].time >> 2;
-                events[i].value = event_data & 0x00003FFF;
-                int accel_type = (event_data & 0x00030000) >> 16;
-                switch (accel_type)
-                {
-                    case 0:
-                    {
-                        events[i].type = kPREventTypeAccelerometerX;
-                        break;
-                    }
-                    case 1:
-                    {
-                        events[i].type = kPREventTypeAccelerometerY;
-                        break;
-                    }
-                    case 2:
-                    {
-                        events[i].type = kPREventTypeAccelerometerZ;
-                        break;
-                    }
-                    case 3:
-                    {
-                        events[i].type = kPREventTypeAccelerometerIRQ;
-                        break;
-                    }
-                    default: events[i].type = kPREventTypeInvalid;
-                }
-                break;
+                heldDMDEventData = events[i];
+                heldDMDEvent = true;
+                continue;
             }
+            queuedDMDEvent = true;
+            lastDMDEventPosition = position + numKept;
+        }
+        events[numKept++] = events[i];
+    }
+    return numKept;
+}
+
+int32_t PRDevice::QueueHeldDMDEvent()
+{
+    if (!heldDMDEvent || (queuedDMDEvent && eventRing.IsQueued(lastDMDEventPosition)))
+        return 0;
+    lastDMDEventPosition = eventRing.Head();
+    queuedDMDEvent = true;
+    heldDMDEvent = false;
+    if (!eventRing.PushDroppingOldest(heldDMDEventData))
+        eventsDropped++;
+    return 1;
+}
+
+PRResult PRDevice::GetEventQueueStats(PREventQueueStats *stats)
+{
+    stats->capacity = eventRing.Capacity();
+    stats->size = eventRing.Size();
+    stats->highWater = eventQueueHighWater;
+    stats->dropped = eventsDropped;
+    stats->coalesced = eventsCoalesced;
+    return kPRSuccess;
+}
+
+PRResult PRDevice::ResetEventQueueStats()
+{
+    eventQueueHighWater = eventRing.Size();
+    eventsDropped = 0;
+    eventsCoalesced = 0;
+    return kPRSuccess;
+}
+
+PRResult PRDevice::AccelSetConfig(const PRAccelConfig *config)
+{
+    accelerometer.SetConfig(config);
+    return kPRSuccess;
+}
+
+PRResult PRDevice::AccelGetConfig(PRAccelConfig *config)
+{
+    accelerometer.GetConfig(config);
+    return kPRSuccess;
+}
+
+PRResult PRDevice::AccelSetLevel()
+{
+    accelerometer.SetLevel();
+    return kPRSuccess;
+}
+
+int PRDevice::AccelGetSamples(PRAccelSample *samples, int maxSamples)
+{
+    // Samples don't wake up the reader, so leave the event descriptor to GetEvents().
+    if (!eventThreadRunning && SortReturningData() != kPRSuccess)
+    {
+        PRSetLastErrorText("AccelGetSamples ERROR: Error in CollectReadData");
+        return -1;
+    }
+    return accelerometer.GetSamples(samples, maxSamples);
+}
+
+PRResult PRDevice::SetEventHandler(PREventType type, int32_t switchNum, PREventHandler handler, void *context)
+{
+    return eventHandlers.Set(type, switchNum, handler, context);
+}
+
+PRResult PRDevice::GetClockEstimate(PRClockEstimate *estimate)
+{
+    eventClock.GetEstimate(estimate);
+    return kPRSuccess;
+}
+
+void PRDevice::SetEventDecoder()
+{
+    if (version >= 2)
+    {
+        decodeEventsEx = PRDecodeEvents<PREventFormatV2>;
+        eventClock.Reset(PREventFormatV2::timestampWrapMilliseconds);
+    }
+    else
+    {
+        decodeEventsEx = PRDecodeEvents<PREventFormatV1>;
+        eventClock.Reset(PREventFormatV1::timestampWrapMilliseconds);
+    }
+}
+
+PRResult PRDevice::StartEventThread()
+{
+    if (eventThreadRunning)
+        return kPRSuccess;
+
+    // Not fatal; GetEventDescriptor() will just report it's unavailable.
+    if (!eventWakeup.IsOpen() && eventWakeup.Open() != kPRSuccess)
+        DEBUG(PRLog(kPRLogWarning, "No event descriptor available.\n"));
+
+    eventThreadStop = false;
+    eventThreadError = false;
+    eventThreadRunning = true;
+    try
+    {
+        eventThread = std::thread(&PRDevice::EventThreadLoop, this);
+    }
+    catch (...)
+    {
+        eventThreadRunning = false;
+        PRSetLastErrorText("Unable to create event thread.");
+        return kPRFailure;
+    }
+    DEBUG(PRLog(kPRLogInfo, "Event thread started.\n"));
+    return kPRSuccess;
+}
+
+PRResult PRDevice::StopEventThread()
+{
+    if (!eventThreadRunning)
+        return kPRSuccess;
+
+    eventThreadStop = true;
+    eventThread.join();
+    eventThreadRunning = false;
+    DEBUG(PRLog(kPRLogInfo, "Event thread stopped.\n"));
+    return kPRSuccess;
+}
+
+void PRDevice::EventThreadLoop()
+{
+    while (!eventThreadStop)
+    {
+        if (SortReturningData() != kPRSuccess)
+        {
+            eventThreadError = true;
+            NotifyEvents();
+            PRSleep(10); // Don't spin on a device that has gone away.
+            continue;
+        }
 
-            default: events[i].type = kPREventTypeInvalid;
+        if (last_collected_bytes == 0)
+            PRSleep(1); // Nothing arrived; give the device a moment.
+    }
+}
+
+void PRDevice::NotifyEvents()
+{
+    if (eventWakeup.IsOpen() && !wakeupPending.exchange(true))
+        eventWakeup.Signal();
+}
+
+int PRDevice::GetEventDescriptor()
+{
+    if (!eventThreadRunning || !eventWakeup.IsOpen())
+    {
+        PRSetLastErrorText("The event descriptor requires the event thread; see PRStartEventThread().");
+        return -1;
+    }
+    return eventWakeup.GetDescriptor();
+}
+
+int PRDevice::WaitForEvents(int32_t timeoutMicroseconds)
+{
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+        std::chrono::microseconds(timeoutMicroseconds < 0 ? 0 : timeoutMicroseconds);
 
+    if (eventThreadRunning && eventWakeup.IsOpen())
+    {
+        if (eventRing.Size() > 0 || eventThreadError)
+            return 1;
+        return eventWakeup.Wait(timeoutMicroseconds);
+    }
+
+    // No descriptor to block on.  Check every millisecond instead of making the caller
+    // poll PRGetEvents() on a coarser interval.
+    while (true)
+    {
+        if (eventThreadRunning)
+        {
+            if (eventRing.Size() > 0 || eventThreadError)
+                return 1;
+        }
+        else
+        {
+            if (SortReturningData() != kPRSuccess)
+                return -1;
+            if (eventRing.Size() > 0)
+                return 1;
         }
+        if (timeoutMicroseconds >= 0 && std::chrono::steady_clock::now() >= deadline)
+            return 0;
+        PRSleep(1);
     }
-    return i;
 }
 
 PRResult PRDevice::ManagerUpdateConfig(PRManagerConfig *managerConfig)
 {
     const int burstWords = 2;
-    uint32_t burst[burstWords];
     DEBUG(PRLog(kPRLogInfo, "Setting Manager Config Register\n"));
     this->managerConfig = *managerConfig;
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    uint32_t *burst = ReserveWriteWords(burstWords);
+    if (burst == NULL)
+        return kPRFailure;
     CreateManagerUpdateConfigBurst(burst, managerConfig);
-    return PrepareWriteData(burst, burstWords);
+    return kPRSuccess;
 }
 
 PRResult PRDevice::DriverUpdateGlobalConfig(PRDriverGlobalConfig *driverGlobalConfig)
 {
     const int burstWords = 4;
-    uint32_t burst[burstWords];
 
     DEBUG(PRLog(kPRLogInfo, "Installing driver globals\n"));
 
     this->driverGlobalConfig = *driverGlobalConfig;
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    uint32_t *burst = ReserveWriteWords(burstWords);
+    if (burst == NULL)
+        return kPRFailure;
     CreateDriverUpdateGlobalConfigBurst(burst, driverGlobalConfig);
     CreateWatchdogConfigBurst(burst+2, driverGlobalConfig->watchdogExpired,
                                        driverGlobalConfig->watchdogEnable,
                                        driverGlobalConfig->watchdogResetTime);
 
-    DEBUG(PRLog(kPRLogVerbose, "Driver Global words: %x %x\n", burst[0], burst[1]));
-    DEBUG(PRLog(kPRLogVerbose, "Watchdog words: %x %x\n", burst[2], burst[3]));
-    return PrepareWriteData(burst, burstWords);
+    DEBUG(PRLog(kPRLogVerbose, "Driver Global words: %x %x\n", PRWireWord(burst[0]), PRWireWord(burst[1])));
+    DEBUG(PRLog(kPRLogVerbose, "Watchdog words: %x %x\n", PRWireWord(burst[2]), PRWireWord(burst[3])));
+    return kPRSuccess;
+}
+
+static bool PRDriverStateNumLess(const PRDriverState *a, const PRDriverState *b)
+{
+    return a->driverNum < b->driverNum;
+}
+
+PRResult PRDevice::DriverUpdateStates(const PRDriverState *driverStates, int numStates)
+{
+    const int driverWords = 2; // Data words of each driver's burst.
+    int i;
+
+    if (numStates < 0)
+    {
+        PRSetLastErrorText("Cannot update %d drivers.", numStates);
+        return kPRFailure;
+    }
+
+    // Check them all before changing anything.
+    vector<const PRDriverState *> sorted(numStates);
+    for (i = 0; i < numStates; i++)
+    {
+        if (driverStates[i].driverNum >= kPRDriverCount)
+        {
+            PRSetLastErrorText("Refusing to update driver #%d; there are only %d drivers.", driverStates[i].driverNum, kPRDriverCount);
+            return kPRFailure;
+        }
+        if (driverStates[i].polarity != drivers[driverStates[i].driverNum].polarity && machineType != kPRMachineCustom && machineType != kPRMachinePDB)
+        {
+            PRSetLastErrorText("Refusing to update driver #%d; polarity differs on non-custom machine.", driverStates[i].driverNum);
+            return kPRFailure;
+        }
+        sorted[i] = &driverStates[i];
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), PRDriverStateNumLess);
+
+    // Later updates of the same driver replace earlier ones.
+    vector<const PRDriverState *> latest;
+    for (i = 0; i < numStates; i++)
+    {
+        if (!latest.empty() && latest.back()->driverNum == sorted[i]->driverNum)
+            latest.back() = sorted[i];
+        else
+            latest.push_back(sorted[i]);
+    }
+
+    // Each run of consecutive drivers covers consecutive addresses of the driver table, so
+    // one header can write the whole run.  A run of all the drivers still fits in one transfer.
+    // drivers[] only takes the states of runs that were staged.
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    size_t first = 0;
+    while (first < latest.size())
+    {
+        size_t last = first;
+        while (last + 1 < latest.size() && latest[last + 1]->driverNum == latest[last]->driverNum + 1)
+            last++;
+        int32_t numDrivers = (int32_t)(last - first + 1);
+
+        uint32_t *burst = ReserveWriteWords(1 + numDrivers * driverWords);
+        if (burst == NULL)
+            return kPRFailure;
+        for (i = 0; i < numDrivers; i++)
+        {
+            uint32_t words[1 + driverWords];
+            PRDriverState driver = *latest[first + i];
+            CreateDriverUpdateBurst(words, &driver);
+            if (i == 0)
+                burst[0] = PRWireWord((PRWireWord(words[0]) & ~P_ROC_HEADER_LENGTH_MASK) | ((numDrivers * driverWords) << P_ROC_HEADER_LENGTH_SHIFT));
+            memcpy(&burst[1 + i * driverWords], &words[1], driverWords * sizeof(uint32_t));
+            drivers[driver.driverNum] = driver;
+        }
+        DEBUG(PRLog(kPRLogVerbose, "Updating drivers #%d-%d\n", latest[first]->driverNum, latest[last]->driverNum));
+        first = last + 1;
+    }
+    return kPRSuccess;
 }
 
 PRResult PRDevice::DriverGetGroupConfig(uint8_t groupNum, PRDriverGroupConfig *driverGroupConfig)
@@ -298,14 +800,17 @@ PRResult PRDevice::DriverGetGroupConfig(uint8_t groupNum, PRDriverGroupConfig *d
 PRResult PRDevice::DriverUpdateGroupConfig(PRDriverGroupConfig *driverGroupConfig)
 {
     const int burstWords = 2;
-    uint32_t burst[burstWords];
 
     driverGroups[driverGroupConfig->groupNum] = *driverGroupConfig;
     DEBUG(PRLog(kPRLogInfo, "Installing driver group\n"));
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    uint32_t *burst = ReserveWriteWords(burstWords);
+    if (burst == NULL)
+        return kPRFailure;
     CreateDriverUpdateGroupConfigBurst(burst, driverGroupConfig);
 
-    DEBUG(PRLog(kPRLogVerbose, "Words: %x %x\n", burst[0], burst[1]));
-    return PrepareWriteData(burst, burstWords);
+    DEBUG(PRLog(kPRLogVerbose, "Words: %x %x\n", PRWireWord(burst[0]), PRWireWord(burst[1])));
+    return kPRSuccess;
 }
 
 PRResult PRDevice::DriverGetState(uint8_t driverNum, PRDriverState *driverState)
@@ -317,7 +822,6 @@ PRResult PRDevice::DriverGetState(uint8_t driverNum, PRDriverState *driverState)
 PRResult PRDevice::DriverUpdateState(PRDriverState *driverState)
 {
     const int burstWords = 3;
-    uint32_t burst[burstWords];
 
     // Don't allow Constant Pulse (non-schedule with time = 0) for known high current drivers.
     // Note, the driver numbers depend on the driver group settings from DriverLoadMachineTypeDefaults.
@@ -333,10 +837,25 @@ PRResult PRDevice::DriverUpdateState(PRDriverState *driverState)
 
     drivers[driverState->driverNum] = *driverState;
 
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    if (!readbackDriverWords.empty())
+    {
+        // Reconciling in Reset(): leave a driver alone if the device already has this state.
+        // The update bit only triggers the write and isn't part of the state.
+        uint32_t words[burstWords];
+        const uint32_t *readback = &readbackDriverWords[driverState->driverNum << P_ROC_DRIVER_CONFIG_TABLE_DRIVER_NUM_SHIFT];
+        const uint32_t updateBit = 1 << P_ROC_DRIVER_CONFIG_UPDATE_SHIFT;
+        CreateDriverUpdateBurst(words, &drivers[driverState->driverNum]);
+        if ((PRWireWord(words[1]) & ~updateBit) == (readback[0] & ~updateBit) && PRWireWord(words[2]) == readback[1])
+            return kPRSuccess;
+    }
+    uint32_t *burst = ReserveWriteWords(burstWords);
+    if (burst == NULL)
+        return kPRFailure;
     CreateDriverUpdateBurst(burst, &drivers[driverState->driverNum]);
-    DEBUG(PRLog(kPRLogVerbose, "Words: %x %x %x\n", burst[0], burst[1], burst[2]));
+    DEBUG(PRLog(kPRLogVerbose, "Words: %x %x %x\n", PRWireWord(burst[0]), PRWireWord(burst[1]), PRWireWord(burst[2])));
 
-    return PrepareWriteData(burst, burstWords);
+    return kPRSuccess;
 }
 
 PRResult PRDevice::DriverLoadMachineTypeDefaults(PRMachineType machineType, uint32_t resetFlags)
@@ -442,7 +961,9 @@ PRResult PRDevice::DriverLoadMachineTypeDefaults(PRMachineType machineType, uint
         PRDriverState *driver = &drivers[i];
         memset(driver, 0x00, sizeof(PRDriverState));
         driver->driverNum = i;
-        driver->polarity = mappedDriverGroupPolarity[i/8];
+        // The last drivers have no group; leave them at the cleared polarity.
+        if (i/8 < kPRDriverGroupsMax)
+            driver->polarity = mappedDriverGroupPolarity[i/8];
         DEBUG(PRLog(kPRLogInfo,"\nDriver Polarity for Driver: %d is %x.", i,driver->polarity));
         if (resetFlags & kPRResetFlagUpdateDevice)
             res = DriverUpdateState(driver);
@@ -566,40 +1087,47 @@ PRResult PRDevice::DriverLoadMachineTypeDefaults(PRMachineType machineType, uint
 PRResult PRDevice::DriverAuxSendCommands(PRDriverAuxCommand * commands, uint8_t numCommands, uint8_t startingAddr)
 {
     int32_t k;
-    uint32_t commandBuffer[513];
     uint32_t convertedCommand;
     uint32_t addr;
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    uint32_t *commandBuffer = ReserveWriteWords(numCommands+1);
+
+    if (commandBuffer == NULL)
+        return kPRFailure;
 
     if (chip_id == P_ROC_CHIP_ID)
     {
         addr = (P_ROC_DRIVER_AUX_MEM_DECODE << P_ROC_DRIVER_CTRL_DECODE_SHIFT) | startingAddr;
-        commandBuffer[0] = CreateBurstCommand(P_ROC_BUS_DRIVER_CTRL_SELECT, addr, numCommands);
+        commandBuffer[0] = PRWireWord(CreateBurstCommand(P_ROC_BUS_DRIVER_CTRL_SELECT, addr, numCommands));
     }
     else // chip == P3_ROC_CHIP_ID)
     {
         addr = 0;
-        commandBuffer[0] = CreateBurstCommand(P3_ROC_BUS_AUX_CTRL_SELECT, addr, numCommands);
+        commandBuffer[0] = PRWireWord(CreateBurstCommand(P3_ROC_BUS_AUX_CTRL_SELECT, addr, numCommands));
     }
 
     for (k=0; k<numCommands; k++) {
         convertedCommand = CreateDriverAuxCommand(commands[k]);
-        commandBuffer[k+1] = convertedCommand;
+        commandBuffer[k+1] = PRWireWord(convertedCommand);
     }
 
-    return PrepareWriteData(commandBuffer, numCommands+1);
+    return kPRSuccess;
 
 }
 
 PRResult PRDevice::DriverWatchdogTickle()
 {
     const int burstWords = 2;
-    uint32_t burst[burstWords];
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    uint32_t *burst = ReserveWriteWords(burstWords);
 
+    if (burst == NULL)
+        return kPRFailure;
     CreateWatchdogConfigBurst(burst, driverGlobalConfig.watchdogExpired,
                               driverGlobalConfig.watchdogEnable,
                               driverGlobalConfig.watchdogResetTime);
 
-    return PrepareWriteData(burst, burstWords);
+    return kPRSuccess;
 }
 
 
@@ -611,49 +1139,63 @@ PRSwitchRuleInternal *PRDevice::GetSwitchRuleByIndex(uint16_t index)
 
 PRResult PRDevice::SwitchUpdateConfig(PRSwitchConfig *switchConfig)
 {
-    uint32_t rc;
     const int burstWords = 4;
-    uint32_t burst[burstWords];
 
     this->switchConfig = *switchConfig;
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    uint32_t *burst = ReserveWriteWords(burstWords);
+    if (burst == NULL)
+        return kPRFailure;
     CreateSwitchUpdateConfigBurst(burst, switchConfig);
 
     DEBUG(PRLog(kPRLogInfo, "Configuring Switch Logic\n"));
-    DEBUG(PRLog(kPRLogVerbose, "Words: %x %x\n",burst[0],burst[1]));
+    DEBUG(PRLog(kPRLogVerbose, "Words: %x %x\n",PRWireWord(burst[0]),PRWireWord(burst[1])));
 
-    rc = PrepareWriteData(burst, burstWords);
-    return rc;
+    return kPRSuccess;
 }
 
 PRResult PRDevice::SwitchUpdateRule(uint8_t switchNum, PREventType eventType, PRSwitchRule *rule, PRDriverState *linkedDrivers, int numDrivers, bool_t drive_outputs_now )
 {
     // Updates a single rule with the associated linked driver state changes.
-    const int burstSize = 4;
-    uint32_t burst[burstSize];
+    std::lock_guard<std::recursive_mutex> lock(writeMutex); // Keeps the flush thread away from half written rules.
 
-    // If more the base rule will link to others, ensure free indexes exists for
-    // the links.
-    if (numDrivers > 0 && freeSwitchRuleIndexes.size() < (uint32_t)(numDrivers-1)) // -1 because the first switch rule holds the first driver.
+    PRResult res = kPRSuccess;
+    uint32_t newRuleIndex = CreateSwitchRuleIndex(switchNum, eventType);
+    if (switchRulePool.IsMember(newRuleIndex))
     {
-        PRSetLastErrorText("Not enough free switch rule indexes: %d available, need %d", freeSwitchRuleIndexes.size(), numDrivers);
+        PRSetLastErrorText("Switch rule 0x%x has been donated to the linked rule pool.", newRuleIndex);
         return kPRFailure;
     }
 
-    PRResult res = kPRSuccess;
-    uint32_t newRuleIndex = CreateSwitchRuleIndex(switchNum, eventType);
+    // Rewriting a rule with the drivers it already links to keeps its linked rules, so only
+    // the primary rule can have changed.
+    if (numDrivers > 0 && SwitchRuleChainMatches(newRuleIndex, linkedDrivers, numDrivers))
+    {
+        PRSwitchRuleInternal *sameRule = GetSwitchRuleByIndex(newRuleIndex);
+        sameRule->notifyHost = rule->notifyHost;
+        sameRule->reloadActive = rule->reloadActive;
+        return WriteSwitchRule(newRuleIndex, false, drive_outputs_now);
+    }
 
-    // Because we're redefining the rule chain, we need to remove all previously existing links and return the indexes to the free list.
-    PRSwitchRuleInternal *oldRule = GetSwitchRuleByIndex(newRuleIndex);
+    // If more the base rule will link to others, ensure free indexes exists for
+    // the links.
+    if (numDrivers > 0 && switchRulePool.NumFree() < (uint32_t)(numDrivers-1)) // -1 because the first switch rule holds the first driver.
+    {
+        PRSetLastErrorText("Not enough free switch rule indexes: %d available, need %d", switchRulePool.NumFree(), numDrivers);
+        return kPRFailure;
+    }
 
-    uint16_t oldLinkIndex;
+    // Because we're redefining the rule chain, we need to remove all previously existing links.
+    // They go back to the pool once the new rules are written, so none of them is rewritten
+    // while the device may still follow it.
+    vector<uint16_t> oldLinks;
+    PRSwitchRuleInternal *oldRule = GetSwitchRuleByIndex(newRuleIndex);
     while (oldRule->linkActive)
     {
-	// Save old link index so it can freed after the linked rule is retrieved.
-	oldLinkIndex = oldRule->linkIndex;
+        oldLinks.push_back(oldRule->linkIndex);
         oldRule = GetSwitchRuleByIndex(oldRule->linkIndex);
-        freeSwitchRuleIndexes.push(oldLinkIndex);
 
-        if (freeSwitchRuleIndexes.size() > 128) // Detect a corrupted link-related values before it eats up all of the memory.
+        if (oldLinks.size() > maxSwitchRules) // Detect a corrupted link-related values before it eats up all of the memory.
         {
 			PRSetLastErrorText("Too many free switch rule indicies!");
             return kPRFailure;
@@ -666,7 +1208,8 @@ PRResult PRDevice::SwitchUpdateRule(uint8_t switchNum, PREventType eventType, PR
     // Process each driver who's state should change in response to the switch event.
     if (numDrivers > 0)
     {
-        uint32_t ruleIndex, savedRuleIndex;
+        uint16_t ruleIndex, savedRuleIndex, writeIndex;
+        vector<uint16_t> newLinks;
 
         // Need to program the main rule last just in case drive_outputs_now is true.
         // Otherwise, the hardware could try to access the linked rules before they're
@@ -680,8 +1223,8 @@ PRResult PRDevice::SwitchUpdateRule(uint8_t switchNum, PREventType eventType, PR
         {
             if (numDrivers > 1)
             {
-                ruleIndex = freeSwitchRuleIndexes.front();
-                freeSwitchRuleIndexes.pop();
+                switchRulePool.Allocate(&ruleIndex);
+                newLinks.push_back(ruleIndex);
                 newRule = GetSwitchRuleByIndex(ruleIndex);
                 newRule->driver = linkedDrivers[0];
                 newRule->changeOutput = true;
@@ -694,11 +1237,7 @@ PRResult PRDevice::SwitchUpdateRule(uint8_t switchNum, PREventType eventType, PR
                 }
 
                 savedRuleIndex = ruleIndex;
-                // Set the 3rd param (drive_outputs_now) to false to keep the hardware
-                // from evaluating the state of the rule index and possibly activating the
-                // driver.  The evaluation will happen later when the primary rule is
-                // written.
-                CreateSwitchUpdateRulesBurst(burst, newRule, false);
+                writeIndex = ruleIndex;
             }
             else
             {
@@ -717,24 +1256,25 @@ PRResult PRDevice::SwitchUpdateRule(uint8_t switchNum, PREventType eventType, PR
                     newRule->linkIndex = savedRuleIndex;
                 }
                 else newRule->linkActive = false;
-                CreateSwitchUpdateRulesBurst(burst, newRule, drive_outputs_now);
+                writeIndex = newRuleIndex;
             }
 
-            DEBUG(PRLog(kPRLogVerbose, "Rule Words: %x %x %x %x\n", burst[0],burst[1],burst[2],burst[3]));
-            // Write the rule:
-            res = PrepareWriteData(burst, burstSize);
-            if (res != kPRSuccess)
+            // Write the rule.  For linked rules, set drive_outputs_now to false to keep the
+            // hardware from evaluating the state of the rule index and possibly activating the
+            // driver.  The evaluation will happen later when the primary rule is written.
+            if (WriteSwitchRule(writeIndex, numDrivers > 1, numDrivers > 1 ? false : drive_outputs_now) != kPRSuccess)
             {
                 DEBUG(PRLog(kPRLogError, "Error while writing switch update, attempting to revert switch rule to a safe state..."));
                 newRule = GetSwitchRuleByIndex(newRuleIndex);
                 newRule->changeOutput = false;
                 newRule->linkActive = false;
-                CreateSwitchUpdateRulesBurst(burst, newRule, false);
-                if (PrepareWriteData(burst, burstSize) == kPRSuccess)
+                if (WriteSwitchRule(newRuleIndex, false, false) == kPRSuccess)
                     DEBUG(PRLog(kPRLogError, "Disabled successfully.\n"));
                 else
                     DEBUG(PRLog(kPRLogError, "Failed to disable.\n"));
-                return res;
+                ReleaseSwitchRuleLinks(oldLinks);
+                ReleaseSwitchRuleLinks(newLinks);
+                return kPRFailure;
             }
 
             linkedDrivers--;
@@ -751,144 +1291,584 @@ PRResult PRDevice::SwitchUpdateRule(uint8_t switchNum, PREventType eventType, PR
         newRule->changeOutput = false;
         newRule->linkActive = false;
 
-        CreateSwitchUpdateRulesBurst(burst, newRule, false);
-        DEBUG(PRLog(kPRLogVerbose, "Rule Words: %x %x %x %x\n", burst[0],burst[1],burst[2],burst[3]));
-
         // Write the rule:
-        res = PrepareWriteData(burst, burstSize);
+        res = WriteSwitchRule(newRuleIndex, false, false);
     }
 
+    ReleaseSwitchRuleLinks(oldLinks);
     return res;
 }
 
-PRResult PRDevice::SwitchGetStates( PREventType * switchStates, uint16_t numSwitches )
+void PRDevice::ReleaseSwitchRuleLinks(const vector<uint16_t> &links)
 {
-    uint32_t stateWord, debounceWord;
-    uint8_t i, j;
-    PREventType eventType;
+    // Within a batch the device may still follow the old links until the commit.
+    for (size_t i = 0; i < links.size(); i++)
+        switchRulePool.Release(links[i], switchRulesBatchOpen);
+}
+
+PRResult PRDevice::SwitchRulePoolGetStats(PRSwitchRulePoolStats *stats)
+{
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    switchRulePool.GetStats(stats);
+    return kPRSuccess;
+}
 
-    // Request one state word and one debounce word at a time.  Could make more efficient
-    // use of the USB bus by requesting a burst of state words and then a burst of debounce
-    // words, but doing one word at a time makes it easier to process each switch when the
-    // data returns.  Also, this function shouldn't be called during timing sensitive
-    // situations; so the inefficiencies are acceptable.
-    for (i = 0; i < numSwitches / 32; i++)
+PRResult PRDevice::SwitchRulePoolDonate(uint8_t switchNum, PREventType eventType)
+{
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    if (eventType < kPREventTypeSwitchClosedDebounced || eventType > kPREventTypeSwitchOpenNondebounced)
+    {
+        PRSetLastErrorText("Invalid switch rule event type %d.", eventType);
+        return kPRFailure;
+    }
+    uint16_t index = CreateSwitchRuleIndex(switchNum, eventType);
+    PRSwitchRuleInternal *rule = GetSwitchRuleByIndex(index);
+    if (!switchRulePool.IsMember(index) && (rule->notifyHost || rule->changeOutput || rule->linkActive))
     {
+        PRSetLastErrorText("Switch rule 0x%x is in use and can't be donated.", index);
+        return kPRFailure;
+    }
+    switchRulePool.Add(index);
+    return kPRSuccess;
+}
+
+int PRDevice::SwitchRulePoolCompact()
+{
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    if (switchRulesBatchOpen)
+    {
+        PRSetLastErrorText("Can't compact switch rules while a batch is open.");
+        return -1;
+    }
+
+    // Find the rule that links to each rule in use.
+    const uint16_t notLinked = 0xFFFF;
+    vector<uint16_t> linkedFrom(maxSwitchRules, notLinked);
+    for (uint16_t i = 0; i < maxSwitchRules; i++)
+    {
+        PRSwitchRuleInternal *rule = GetSwitchRuleByIndex(i);
+        if (rule->linkActive && (!switchRulePool.IsMember(i) || switchRulePool.IsUsed(i)))
+            linkedFrom[rule->linkIndex] = i;
+    }
 
-        if (chip_id == P_ROC_CHIP_ID)
+    // Move the highest rule in use to the lowest free one until they meet.
+    int numMoved = 0;
+    for (int32_t from = maxSwitchRules - 1; from >= 0; from--)
+    {
+        if (!switchRulePool.IsUsed(from))
+            continue;
+        // Without a rule linking to it there is nothing to repoint; leave it where it is.
+        if (linkedFrom[from] == notLinked)
+            continue;
+        uint16_t to;
+        if (!switchRulePool.Allocate(&to))
+            break;
+        if (to > from)
         {
-            RequestData(P_ROC_BUS_SWITCH_CTRL_SELECT,
-                        P_ROC_SWITCH_CTRL_STATE_BASE_ADDR + i, 1);
+            switchRulePool.Release(to, false);
+            break;
+        }
 
-            if (combinedVersionRevision < P_ROC_VER_REV_FIXED_SWITCH_STATE_READS) {
-                RequestData(P_ROC_BUS_SWITCH_CTRL_SELECT,
-                            P_ROC_SWITCH_CTRL_OLD_DEBOUNCE_BASE_ADDR + i, 1);
-            }
-            else {
-                RequestData(P_ROC_BUS_SWITCH_CTRL_SELECT,
-                            P_ROC_SWITCH_CTRL_DEBOUNCE_BASE_ADDR + i, 1);
-            }
+        // Copy the update, then repoint the rule that links to it.  Until that single rule is
+        // written the device still follows the old copy, which stays intact.
+        PRSwitchRuleInternal *source = GetSwitchRuleByIndex(from);
+        PRSwitchRuleInternal *dest = GetSwitchRuleByIndex(to);
+        dest->reloadActive = source->reloadActive;
+        dest->notifyHost = source->notifyHost;
+        dest->changeOutput = source->changeOutput;
+        dest->linkActive = source->linkActive;
+        dest->linkIndex = source->linkIndex;
+        dest->driver = source->driver;
+        uint16_t previous = linkedFrom[from];
+        GetSwitchRuleByIndex(previous)->linkIndex = to;
+        if (WriteSwitchRule(to, true, false) != kPRSuccess ||
+            WriteSwitchRule(previous, switchRulePool.IsMember(previous), false) != kPRSuccess)
+        {
+            // Nothing was staged to repoint the link, so the device still follows the old copy.
+            GetSwitchRuleByIndex(previous)->linkIndex = from;
+            dest->changeOutput = false;
+            dest->linkActive = false;
+            switchRulePool.Release(to, false);
+            return -1;
         }
-        else // chip == P3_ROC_CHIP_ID)
+        if (dest->linkActive)
+            linkedFrom[dest->linkIndex] = to;
+        switchRulePool.Release(from, false);
+        source->changeOutput = false;
+        source->linkActive = false;
+        numMoved++;
+    }
+    return numMoved;
+}
+
+/** True if the two driver states program the same driver update. */
+static bool PRSameDriverUpdate(PRDriverState *a, PRDriverState *b)
+{
+    uint32_t aWords[3], bWords[3];
+    CreateDriverUpdateBurst(aWords, a);
+    CreateDriverUpdateBurst(bWords, b);
+    return memcmp(aWords, bWords, sizeof(aWords)) == 0;
+}
+
+bool PRDevice::SwitchRuleChainMatches(uint16_t index, PRDriverState *linkedDrivers, int numDrivers)
+{
+    PRSwitchRuleInternal *rule = GetSwitchRuleByIndex(index);
+    for (int i = 0; i < numDrivers; i++)
+    {
+        bool last = i == numDrivers - 1;
+        if (!rule->changeOutput || rule->linkActive == last || !PRSameDriverUpdate(&rule->driver, &linkedDrivers[i]))
+            return false;
+        if (!last)
+            rule = GetSwitchRuleByIndex(rule->linkIndex);
+    }
+    return true;
+}
+
+PRResult PRDevice::WriteSwitchRule(uint16_t index, bool linked, bool_t drive_outputs_now)
+{
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    if (switchRulesBatchOpen)
+    {
+        if (!switchRuleBatchFlags[index])
+            (linked ? batchLinkedSwitchRules : batchPrimarySwitchRules).push_back(index);
+        switchRuleBatchFlags[index] |= switchRuleBatchChanged | (drive_outputs_now ? switchRuleBatchDriveNow : 0);
+        return kPRSuccess;
+    }
+
+    uint32_t *burst = ReserveWriteWords(switchRuleBurstWords);
+    if (burst == NULL)
+        return kPRFailure;
+    CreateSwitchUpdateRulesBurst(burst, GetSwitchRuleByIndex(index), drive_outputs_now);
+    memcpy(deviceSwitchRules[index], &burst[1], sizeof(deviceSwitchRules[index]));
+    deviceSwitchRuleKnown[index] = true;
+    DEBUG(PRLog(kPRLogVerbose, "Rule Words: %x %x %x %x\n", PRWireWord(burst[0]),PRWireWord(burst[1]),PRWireWord(burst[2]),PRWireWord(burst[3])));
+    return kPRSuccess;
+}
+
+PRResult PRDevice::SwitchRulesBegin()
+{
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    if (switchRulesBatchOpen)
+    {
+        PRSetLastErrorText("A switch rule batch is already open.");
+        return kPRFailure;
+    }
+    switchRulesBatchOpen = true;
+    return kPRSuccess;
+}
+
+void PRDevice::AppendBatchSwitchRules(const vector<uint16_t> &indexes, vector<uint32_t> *bursts)
+{
+    for (size_t i = 0; i < indexes.size(); i++)
+    {
+        uint16_t index = indexes[i];
+        bool driveNow = (switchRuleBatchFlags[index] & switchRuleBatchDriveNow) != 0;
+        uint32_t burst[switchRuleBurstWords];
+        CreateSwitchUpdateRulesBurst(burst, GetSwitchRuleByIndex(index), driveNow);
+        switchRuleBatchFlags[index] = 0;
+
+        // drive_outputs_now asks the device to act, so that rule is sent even if it hasn't changed.
+        if (!driveNow && deviceSwitchRuleKnown[index] && memcmp(deviceSwitchRules[index], &burst[1], sizeof(deviceSwitchRules[index])) == 0)
+            continue;
+        memcpy(deviceSwitchRules[index], &burst[1], sizeof(deviceSwitchRules[index]));
+        deviceSwitchRuleKnown[index] = true;
+        bursts->insert(bursts->end(), burst, burst + switchRuleBurstWords);
+    }
+}
+
+PRResult PRDevice::SwitchRulesCommit()
+{
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    if (!switchRulesBatchOpen)
+    {
+        PRSetLastErrorText("No switch rule batch is open.");
+        return kPRFailure;
+    }
+    switchRulesBatchOpen = false;
+
+    // Linked rules only ever come from indexes the device isn't using, so writing them all
+    // before any primary rule keeps every chain the device can follow complete.
+    vector<uint32_t> bursts;
+    AppendBatchSwitchRules(batchLinkedSwitchRules, &bursts);
+    AppendBatchSwitchRules(batchPrimarySwitchRules, &bursts);
+
+    PRResult res = kPRSuccess;
+    if (!bursts.empty())
+        res = PrepareWireWords(&bursts[0], (int32_t)bursts.size(), switchRuleBurstWords);
+    if (res != kPRSuccess)
+    {
+        // Some of them may not have been sent, so don't trust what was recorded for any.
+        for (size_t i = 0; i < batchLinkedSwitchRules.size(); i++)
+            deviceSwitchRuleKnown[batchLinkedSwitchRules[i]] = false;
+        for (size_t i = 0; i < batchPrimarySwitchRules.size(); i++)
+            deviceSwitchRuleKnown[batchPrimarySwitchRules[i]] = false;
+    }
+    batchLinkedSwitchRules.clear();
+    batchPrimarySwitchRules.clear();
+
+    // The device has stopped following links released during the batch.
+    switchRulePool.ReturnReleased();
+    return res;
+}
+
+PRResult PRDevice::MachineImageSave(const char *path)
+{
+    uint32_t burst[4];
+    int i;
+
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    if (switchRulesBatchOpen)
+    {
+        PRSetLastErrorText("Can't save a machine image while a switch rule batch is open.");
+        return kPRFailure;
+    }
+
+    PRMachineImageState *state = new PRMachineImageState;
+    state->driverGlobalConfig = driverGlobalConfig;
+    memcpy(state->driverGroups, driverGroups, sizeof(state->driverGroups));
+    memcpy(state->drivers, drivers, sizeof(state->drivers));
+    state->switchConfig = switchConfig;
+    memcpy(state->switchRules, switchRules, sizeof(state->switchRules));
+    state->switchRulePool = switchRulePool;
+
+    // The bursts configuring the machine call by call would send.  Group 0 shares its address
+    // with the driver globals, so the groups go first and the globals win.
+    PRBurstJoiner joiner(maxWriteWords - 1);
+    for (i = 0; i < maxDriverGroups; i++)
+    {
+        CreateDriverUpdateGroupConfigBurst(burst, &driverGroups[i]);
+        joiner.Append(burst, 2);
+    }
+    CreateDriverUpdateGlobalConfigBurst(burst, &driverGlobalConfig);
+    CreateWatchdogConfigBurst(burst+2, driverGlobalConfig.watchdogExpired,
+                              driverGlobalConfig.watchdogEnable,
+                              driverGlobalConfig.watchdogResetTime);
+    joiner.Append(burst, 4);
+    for (i = 0; i < maxDrivers; i++)
+    {
+        CreateDriverUpdateBurst(burst, &drivers[i]);
+        joiner.Append(burst, 3);
+    }
+    CreateSwitchUpdateConfigBurst(burst, &switchConfig);
+    joiner.Append(burst, 4);
+
+    // Linked rules go first, so the device never follows a link to a rule that is yet to be written.
+    for (int linked = 1; linked >= 0; linked--)
+    {
+        for (i = 0; i < maxSwitchRules; i++)
         {
-            RequestData(P_ROC_BUS_SWITCH_CTRL_SELECT,
-                        P3_ROC_SWITCH_CTRL_STATE_BASE_ADDR + i, 1);
+            if (switchRulePool.IsUsed(i) != (linked == 1))
+                continue;
+            CreateSwitchUpdateRulesBurst(burst, &switchRules[i], false);
+            joiner.Append(burst, switchRuleBurstWords);
+        }
+    }
+
+    PRResult res = PRWriteMachineImage(path, machineType, state, joiner.Words(), joiner.NumBursts());
+    delete state;
+    return res;
+}
+
+PRResult PRDevice::MachineImageLoad(const char *path)
+{
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    if (switchRulesBatchOpen)
+    {
+        PRSetLastErrorText("Can't load a machine image while a switch rule batch is open.");
+        return kPRFailure;
+    }
 
-            RequestData(P_ROC_BUS_SWITCH_CTRL_SELECT,
-                        P3_ROC_SWITCH_CTRL_DEBOUNCE_BASE_ADDR + i, 1);
+    PRMachineImageState *state = new PRMachineImageState;
+    vector<uint32_t> words;
+    PRResult res = PRReadMachineImage(path, machineType, maxWriteWords, state, &words);
+    if (res == kPRSuccess)
+        res = PrepareWireBursts(words.empty() ? NULL : &words[0], (int32_t)words.size());
+    if (res != kPRSuccess)
+    {
+        // Some of the image may be staged already, so nothing is known about the rules anymore.
+        memset(deviceSwitchRuleKnown, 0, sizeof(deviceSwitchRuleKnown));
+        delete state;
+        return kPRFailure;
+    }
+
+    driverGlobalConfig = state->driverGlobalConfig;
+    memcpy(driverGroups, state->driverGroups, sizeof(driverGroups));
+    memcpy(drivers, state->drivers, sizeof(drivers));
+    switchConfig = state->switchConfig;
+    memcpy(switchRules, state->switchRules, sizeof(switchRules));
+    switchRulePool = state->switchRulePool;
+    delete state;
+
+    for (uint16_t i = 0; i < maxSwitchRules; i++)
+    {
+        uint32_t burst[switchRuleBurstWords];
+        CreateSwitchUpdateRulesBurst(burst, &switchRules[i], false);
+        memcpy(deviceSwitchRules[i], &burst[1], sizeof(deviceSwitchRules[i]));
+        deviceSwitchRuleKnown[i] = true;
+    }
+    DEBUG(PRLog(kPRLogInfo, "Loaded machine image %s: %d words.\n", path, (int)words.size()));
+    return kPRSuccess;
+}
+
+void PRDevice::GetSwitchStateAddrs(uint32_t *stateAddr, uint32_t *debounceAddr)
+{
+    if (chip_id == P_ROC_CHIP_ID)
+    {
+        *stateAddr = P_ROC_SWITCH_CTRL_STATE_BASE_ADDR;
+        if (combinedVersionRevision < P_ROC_VER_REV_FIXED_SWITCH_STATE_READS)
+            *debounceAddr = P_ROC_SWITCH_CTRL_OLD_DEBOUNCE_BASE_ADDR;
+        else
+            *debounceAddr = P_ROC_SWITCH_CTRL_DEBOUNCE_BASE_ADDR;
+    }
+    else // chip == P3_ROC_CHIP_ID)
+    {
+        *stateAddr = P3_ROC_SWITCH_CTRL_STATE_BASE_ADDR;
+        *debounceAddr = P3_ROC_SWITCH_CTRL_DEBOUNCE_BASE_ADDR;
+    }
+}
+
+void PRDevice::DecodeSwitchStates(const uint32_t *stateWords, const uint32_t *debounceWords, PREventType *switchStates, uint16_t numSwitches)
+{
+    uint32_t stateWord, debounceWord;
+    int32_t i, j;
+    PREventType eventType;
+    const int32_t numGroups = numSwitches / 32;
+
+    // Process the returning words.
+    for (i = 0; i < numGroups; i++)
+    {
+        stateWord = stateWords[i];
+        debounceWord = debounceWords[i];
+
+        // Loop through each bit of the words, combining them into an eventType
+        for (j = 0; j < 32; j++)
+        {
+            // Only process the number of switches requested via numSwitches
+            if ((i * 32) + j < numSwitches)
+            {
+                if (stateWord >> j & 1)
+                    if (debounceWord >> j & 1) eventType = kPREventTypeSwitchOpenDebounced;
+                    else eventType = kPREventTypeSwitchOpenNondebounced;
+                else if (debounceWord >> j & 1) eventType = kPREventTypeSwitchClosedDebounced;
+                else eventType = kPREventTypeSwitchClosedNondebounced;
+                switchStates[(i * 32) + j] = eventType;
+            }
         }
     }
+}
 
-    // Expect 4 words for each 32 switches.  The state and debounce words,
-    // and the address words for both.
-    uint16_t numWords = 4 * (numSwitches / 32);
+PRResult PRDevice::SwitchGetStates( PREventType * switchStates, uint16_t numSwitches )
+{
+    const int32_t numGroups = numSwitches / 32;
+    vector<uint32_t> stateWords(numGroups), debounceWords(numGroups);
+    int32_t tickets[2] = { -1, -1 };
+    PRResult res = kPRSuccess;
+
+    if (numGroups == 0)
+        return kPRSuccess;
 
-    i = 0; // Reset i so it can be used to prevent an infinite loop below
+    // Each table is read in one burst, both in flight together.  The request seeds the known
+    // switch states from whichever thread receives the answers.
+    if (RequestSwitchStates(numSwitches, NULL, NULL, &stateWords[0], &debounceWords[0], tickets) != kPRSuccess)
+        return kPRFailure;
 
-    // Wait for data to return.  Give it 10 loops before giving up.
-    while (requestedDataQueue.size() < numWords && i++ < 10)
+    for (int t = 0; t < 2 && res == kPRSuccess; t++)
     {
-        PRSleep (10); // 10 milliseconds should be plenty of time.
-		if (SortReturningData() != kPRSuccess)
-		{
-			return kPRFailure;
+        if (WaitForRead(tickets[t], 100*1000) != 1)
+        {
+            PRSetLastErrorText("Timed out waiting for switch states.");
+            res = kPRFailure;
         }
     }
 
-    // Make sure all of the requested words are available before processing them.
-    // Too many words is just as bad as not enough words.
-    // If too many come back, can they be trusted?
-    if (requestedDataQueue.size() == numWords)
+    if (res != kPRSuccess)
     {
-        // Process the returning words.
-        for (i = 0; i < numSwitches / 32; i++)
+        // The buffers are about to go away; make sure nothing writes into them later.
+        std::lock_guard<std::mutex> lock(switchStatesRequestsMutex);
+        for (int t = 0; t < 2; t++)
+            CancelRead(tickets[t]);
+        for (list<PRSwitchStatesRequest>::iterator it = switchStatesRequests.begin(); it != switchStatesRequests.end(); ++it)
         {
-            requestedDataQueue.pop(); // Ignore address word.  TODO: Verify this address word.
-            stateWord = requestedDataQueue.front(); // This is the switch state word.
-            requestedDataQueue.pop();
-            requestedDataQueue.pop(); // Ignore address word.  TODO: Verify this address word.
-            debounceWord = requestedDataQueue.front(); // This is the debounce word.
-            requestedDataQueue.pop();
-
-            // Loop through each bit of the words, combining them into an eventType
-            for (j = 0; j < 32; j++)
+            if (it->stateTicket == tickets[0])
             {
-                // Only process the number of switches requested via numSwitches
-                if ((i * 32) + j < numSwitches)
-                {
-                    if (stateWord >> j & 1)
-                        if (debounceWord >> j & 1) eventType = kPREventTypeSwitchOpenDebounced;
-                        else eventType = kPREventTypeSwitchOpenNondebounced;
-                    else if (debounceWord >> j & 1) eventType = kPREventTypeSwitchClosedDebounced;
-                    else eventType = kPREventTypeSwitchClosedNondebounced;
-                    switchStates[(i * 32) + j] = eventType;
-                }
+                switchStatesRequests.erase(it);
+                break;
             }
         }
-        return kPRSuccess;
+        return kPRFailure;
     }
-    else
+
+    DecodeSwitchStates(&stateWords[0], &debounceWords[0], switchStates, numSwitches);
+    return kPRSuccess;
+}
+
+PRResult PRDevice::SwitchGetStatesAsync(uint16_t numSwitches, PRSwitchStatesCallback callback, void *context)
+{
+    if (numSwitches < 32 || callback == NULL)
     {
-        PRSetLastErrorText("Switch response length does not match.");
+        PRSetLastErrorText("PRSwitchGetStatesAsync() needs a callback and at least 32 switches.");
         return kPRFailure;
     }
+    return RequestSwitchStates(numSwitches, callback, context, NULL, NULL, NULL);
+}
+
+PRResult PRDevice::RequestSwitchStates(uint16_t numSwitches, PRSwitchStatesCallback callback, void *context, uint32_t *stateBuffer, uint32_t *debounceBuffer, int32_t *tickets)
+{
+    uint32_t stateAddr, debounceAddr;
+    const int32_t numGroups = numSwitches / 32;
+
+    GetSwitchStateAddrs(&stateAddr, &debounceAddr);
+
+    // Held until both tickets are recorded, so SwitchStatesReadDone() can always find the request.
+    std::lock_guard<std::mutex> lock(switchStatesRequestsMutex);
+    DropExpiredSwitchStatesRequests();
+    switchStatesRequests.push_back(PRSwitchStatesRequest());
+    PRSwitchStatesRequest *request = &switchStatesRequests.back();
+    request->numSwitches = numSwitches;
+    request->stateDone = false;
+    request->debounceDone = false;
+    request->stateWords.resize(numGroups);
+    request->debounceWords.resize(numGroups);
+    request->callback = callback;
+    request->context = context;
+    request->startTime = std::chrono::steady_clock::now();
+
+    request->stateTicket = ReadDataAsync(P_ROC_BUS_SWITCH_CTRL_SELECT, stateAddr, numGroups, stateBuffer, SwitchStatesReadDone, this);
+    request->debounceTicket = -1;
+    if (request->stateTicket >= 0)
+        request->debounceTicket = ReadDataAsync(P_ROC_BUS_SWITCH_CTRL_SELECT, debounceAddr, numGroups, debounceBuffer, SwitchStatesReadDone, this);
+    if (request->debounceTicket >= 0)
+    {
+        if (tickets != NULL)
+        {
+            tickets[0] = request->stateTicket;
+            tickets[1] = request->debounceTicket;
+        }
+        return kPRSuccess;
+    }
+
+    if (request->stateTicket >= 0)
+        CancelRead(request->stateTicket);
+    switchStatesRequests.pop_back();
+    return kPRFailure;
+}
+
+void PRDevice::DropExpiredSwitchStatesRequests()
+{
+    std::chrono::steady_clock::time_point expired = std::chrono::steady_clock::now() - std::chrono::milliseconds(switchStatesRequestLifetime);
+    list<PRSwitchStatesRequest>::iterator it = switchStatesRequests.begin();
+    while (it != switchStatesRequests.end())
+    {
+        if (it->startTime < expired)
+        {
+            DEBUG(PRLog(kPRLogWarning, "Giving up on switch states requested %dms ago.\n", switchStatesRequestLifetime));
+            CancelRead(it->stateTicket);
+            CancelRead(it->debounceTicket);
+            it = switchStatesRequests.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+void PRDevice::SwitchStatesReadDone(void *context, int32_t ticket, uint32_t, uint32_t, const uint32_t *data, int32_t numWords)
+{
+    PRDevice *device = (PRDevice *)context;
+    PRSwitchStatesRequest request;
+
+    {
+        std::lock_guard<std::mutex> lock(device->switchStatesRequestsMutex);
+        list<PRSwitchStatesRequest>::iterator it = device->switchStatesRequests.begin();
+        while (it != device->switchStatesRequests.end() && it->stateTicket != ticket && it->debounceTicket != ticket)
+            ++it;
+        if (it == device->switchStatesRequests.end())
+            return; // Given up on already.
+
+        bool isState = it->stateTicket == ticket;
+        vector<uint32_t> &words = isState ? it->stateWords : it->debounceWords;
+        if (numWords != (int32_t)words.size())
+            return;
+        memcpy(&words[0], data, numWords * sizeof(uint32_t));
+        if (isState)
+            it->stateDone = true;
+        else
+            it->debounceDone = true;
+        if (!it->stateDone || !it->debounceDone)
+            return;
+
+        request = *it;
+        device->switchStatesRequests.erase(it);
+    }
+
+    device->switchStates.Seed(&request.stateWords[0], &request.debounceWords[0], (request.numSwitches / 32) * 32);
+    if (request.callback == NULL)
+        return;
+
+    // Unlocked, so the callback may ask for the states again.
+    vector<PREventType> states(request.numSwitches);
+    device->DecodeSwitchStates(&request.stateWords[0], &request.debounceWords[0], &states[0], request.numSwitches);
+    request.callback(request.context, &states[0], request.numSwitches);
+}
+
+PRResult PRDevice::SwitchGetStateBitmap(PRSwitchStateBitmap *bitmap)
+{
+    switchStates.GetBitmap(bitmap);
+    return kPRSuccess;
+}
+
+int PRDevice::SwitchGetState(uint16_t switchNum, bool_t debounced)
+{
+    if (switchNum >= kPRSwitchCount)
+        return -1;
+    return switchStates.IsOpen(switchNum, debounced);
+}
+
+uint32_t PRDevice::SwitchGetLastChangeTime(uint16_t switchNum, bool_t debounced)
+{
+    if (switchNum >= kPRSwitchCount)
+        return 0;
+    return switchStates.LastChangeTime(switchNum, debounced);
 }
 
 int32_t PRDevice::DMDUpdateConfig(PRDMDConfig *dmdConfig)
 {
-    uint32_t rc;
     const int burstWords = 7;
-    uint32_t burst[burstWords];
 
     this->dmdConfig = *dmdConfig;
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    uint32_t *burst = ReserveWriteWords(burstWords);
+    if (burst == NULL)
+        return kPRFailure;
     CreateDMDUpdateConfigBurst(burst, dmdConfig);
 
     DEBUG(PRLog(kPRLogInfo, "Configuring DMD\n"));
-    DEBUG(PRLog(kPRLogVerbose, "Words: %x %x %x %x %x %x %x\n",burst[0],burst[1],burst[2],burst[3],
-                burst[4],burst[5],burst[6]));
+    DEBUG(PRLog(kPRLogVerbose, "Words: %x %x %x %x %x %x %x\n",PRWireWord(burst[0]),PRWireWord(burst[1]),PRWireWord(burst[2]),PRWireWord(burst[3]),
+                PRWireWord(burst[4]),PRWireWord(burst[5]),PRWireWord(burst[6])));
 
-    rc = PrepareWriteData(burst, burstWords);
-    return rc;
+    return kPRSuccess;
 }
 
 
 PRResult PRDevice::DMDDraw(uint8_t * dots)
 {
-    int32_t k; //i,x,y,j,k,m;
+    //int32_t i,x,y,j,k,m;
     //uint8_t color;
     uint16_t words_per_sub_frame = (dmdConfig.numColumns*dmdConfig.numRows) / 32;
     uint16_t words_per_frame = words_per_sub_frame * dmdConfig.numSubFrames;
-    uint32_t dmd_command_buffer[1024];
+    uint32_t * dmd_command_buffer;
     uint32_t * p_dmd_frame_buffer_words;
 
     p_dmd_frame_buffer_words = (uint32_t *)dots;
 
-    dmd_command_buffer[0] = CreateBurstCommand(P_ROC_BUS_DMD_SELECT, P_ROC_DMD_DOT_TABLE_BASE_ADDR, words_per_frame);
-    for (k=0; k<words_per_frame; k++) {
-        dmd_command_buffer[k+1] = p_dmd_frame_buffer_words[k];
-    }
+    // Build the frame straight into the staging buffer.
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    dmd_command_buffer = ReserveWriteWords(words_per_frame+1);
+    if (dmd_command_buffer == NULL)
+        return kPRFailure;
+    dmd_command_buffer[0] = PRWireWord(CreateBurstCommand(P_ROC_BUS_DMD_SELECT, P_ROC_DMD_DOT_TABLE_BASE_ADDR, words_per_frame));
+    PREncodeWordsBE(p_dmd_frame_buffer_words, (uint8_t *)(dmd_command_buffer + 1), words_per_frame);
 
-    return PrepareWriteData(dmd_command_buffer, words_per_frame+1);
+    return kPRSuccess;
 
     // The following code prints out the init lines for the 4 Xilinx BlockRAMs
     // in the FPGA.  It's used to make an image for the P-ROC to display on power-up.
@@ -936,7 +1916,7 @@ PRResult PRDevice::PRJTAGDriveOutputs(PRJTAGOutputs * jtagOutputs, bool_t toggle
 
     if (toggleClk) CreateJTAGLatchOutputsBurst( burst, jtagOutputs );
     else CreateJTAGForceOutputsBurst( burst, jtagOutputs );
-    return WriteData(burst, burstSize);
+    return WriteWireData((uint8_t *)burst, burstSize);
 }
 
 PRResult PRDevice::PRJTAGWriteTDOMemory(uint16_t tableOffset, uint16_t numWords, uint32_t * tdoData)
@@ -959,7 +1939,7 @@ PRResult PRDevice::PRJTAGShiftTDOData(uint16_t numBits, bool_t dataBlockComplete
     uint32_t burst[burstSize];
 
     CreateJTAGShiftTDODataBurst( burst, numBits, dataBlockComplete );
-    return WriteData(burst, burstSize);
+    return WriteWireData((uint8_t *)burst, burstSize);
 }
 
 PRResult PRDevice::PRJTAGReadTDIMemory(uint16_t tableOffset, uint16_t numWords, uint32_t * tdiData)
@@ -984,7 +1964,20 @@ PRResult PRDevice::PRJTAGGetStatus(PRJTAGStatus * status)
 PRResult PRDevice::Open()
 {
     uint32_t temp_word;
-    PRResult res = PRHardwareOpen();
+    transport = PRTransportForOptions(&createOptions);
+    if (transport == NULL)
+    {
+        PRSetLastErrorText("Unknown transport type %d.", createOptions.transport);
+        return kPRFailure;
+    }
+    if (createOptions.captureFile != NULL)
+    {
+        wireCapture = new PRWireCapture;
+        if (wireCapture->Open(createOptions.captureFile) != kPRSuccess)
+            return kPRFailure;
+    }
+    transportState = transport->open(machineType, &createOptions);
+    PRResult res = transportState != NULL ? kPRSuccess : kPRFailure;
     if (res == kPRSuccess)
     {
         // Try to verify the P-ROC IS in the FPGA before initializing the FPGA's FTDI interface
@@ -1050,8 +2043,11 @@ PRResult PRDevice::Open()
 
 PRResult PRDevice::Close()
 {
-    // TODO: Add protection against closing a not-open ftdic.
-    PRHardwareClose();
+    if (transportState != NULL)
+        transport->close(transportState);
+    transportState = NULL;
+    delete wireCapture;
+    wireCapture = NULL;
     return kPRSuccess;
 }
 
@@ -1063,66 +2059,40 @@ PRMachineType PRDevice::GetReadMachineType()
 PRResult PRDevice::VerifyChipID()
 {
     PRResult rc;
-    const int bufferWords = 5;
+    const int bufferWords = 4;
     uint32_t buffer[bufferWords] = {0};
-    //uint32_t temp_word;
-    uint32_t max_count, i;
-    const uint32_t max_count_limit = 10;
+    uint32_t i;
 
     //std::cout << "Requesting FPGA Chip ID: ";
-    rc = RequestData(P_ROC_MANAGER_SELECT, P_ROC_REG_CHIP_ID_ADDR, 4);
-
-    max_count = 0;
-    // Wait for data to return.  Give it 10 loops before giving up.
-    while (requestedDataQueue.size() < 5 && max_count++ < max_count_limit)
-    {
-        PRSleep (10); // 10 milliseconds should be plenty of time.
-		if (SortReturningData() != kPRSuccess)
-			return kPRFailure;
-    }
-
-    if (max_count != max_count_limit+1) {
-
-        if (requestedDataQueue.size() == 5) {
-            for (i = 0; i < bufferWords; i++) {
-                buffer[i] = requestedDataQueue.front();
-                requestedDataQueue.pop(); // Ignore address word.  TODO: Verify the address.
-            }
-            if (buffer[1] != P_ROC_CHIP_ID && buffer[1] != P3_ROC_CHIP_ID)
-            {
-                DEBUG(PRLog(kPRLogError, "Error in VerifyID(): Dumping buffer\n"));
-                for (i = 0; i < bufferWords; i++)
-                    DEBUG(PRLog(kPRLogError, "buffer[%d]: 0x%x\n", i, buffer[i]));
-                PRSetLastErrorText("Chip ID does not match.");
-                rc = kPRFailure;
-            }
-            else rc = kPRSuccess;
-            //std::cout << rc << " words read.  \n"
-            DEBUG(PRLog(kPRLogError, "FPGA Chip ID: 0x%x\n", buffer[1]));
-            chip_id = buffer[1];
-            revision = buffer[2] & 0xffff;
-            version = buffer[2] >> 16;
-            CalcCombinedVerRevision();
-            DEBUG(PRLog(kPRLogError, "FPGA Chip Version/Rev: %d.%d\n", version, revision));
-            DEBUG(PRLog(kPRLogInfo, "Watchdog Settings: 0x%x\n", buffer[3]));
-            DEBUG(PRLog(kPRLogInfo, "Switches: 0x%x\n", buffer[4]));
-
-            if (IsStern(buffer[4])) readMachineType = kPRMachineSternWhitestar; // Choose SAM or Whitestar, doesn't matter.
-            else readMachineType = kPRMachineWPC; // Choose WPC or WPC95, doesn't matter.
-        }
-        else {
-            DEBUG(PRLog(kPRLogError, "Error reading Chip IP and Version. Read %d words instead of 5. The first 2 were: 0x%x and 0x%x.\n", requestedDataQueue.size(), buffer[0], buffer[1]));
-            PRSetLastErrorText("Error reading Chip IP and Version. Read %d words instead of 5. The first 2 were: 0x%x and 0x%x.", requestedDataQueue.size(), buffer[0], buffer[1]);
-            rc = kPRFailure;
-        }
-    }
-    else
+    if (ReadDataRaw(P_ROC_MANAGER_SELECT, P_ROC_REG_CHIP_ID_ADDR, bufferWords, buffer) != kPRSuccess)
     {
         // Return failure without logging; calling function must log.
         DEBUG(PRLog(kPRLogError, "Verify Chip ID took too long to receive data\n"));
         PRSetLastErrorText("Verify Chip ID took too long to receive data");
+        return kPRFailure;
+    }
+
+    if (buffer[0] != P_ROC_CHIP_ID && buffer[0] != P3_ROC_CHIP_ID)
+    {
+        DEBUG(PRLog(kPRLogError, "Error in VerifyID(): Dumping buffer\n"));
+        for (i = 0; i < bufferWords; i++)
+            DEBUG(PRLog(kPRLogError, "buffer[%d]: 0x%x\n", i, buffer[i]));
+        PRSetLastErrorText("Chip ID does not match.");
         rc = kPRFailure;
     }
+    else rc = kPRSuccess;
+    DEBUG(PRLog(kPRLogError, "FPGA Chip ID: 0x%x\n", buffer[0]));
+    chip_id = buffer[0];
+    revision = buffer[1] & 0xffff;
+    version = buffer[1] >> 16;
+    CalcCombinedVerRevision();
+    SetEventDecoder();
+    DEBUG(PRLog(kPRLogError, "FPGA Chip Version/Rev: %d.%d\n", version, revision));
+    DEBUG(PRLog(kPRLogInfo, "Watchdog Settings: 0x%x\n", buffer[2]));
+    DEBUG(PRLog(kPRLogInfo, "Switches: 0x%x\n", buffer[3]));
+
+    if (IsStern(buffer[3])) readMachineType = kPRMachineSternWhitestar; // Choose SAM or Whitestar, doesn't matter.
+    else readMachineType = kPRMachineWPC; // Choose WPC or WPC95, doesn't matter.
     return (rc);
 }
 
@@ -1132,12 +2102,15 @@ PRResult PRDevice::RequestData(uint32_t module_select, uint32_t start_addr, int3
     return WriteData(&requestWord, 1);
 }
 
-PRResult PRDevice::PrepareWriteData(uint32_t * words, int32_t numWords)
+uint32_t *PRDevice::ReserveWriteWords(int32_t numWords)
 {
+    uint32_t *words;
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+
     if (numWords > maxWriteWords)
     {
         PRSetLastErrorText("%d words Exceeds write capabilities.  Restrict write requests to %d words.", numWords, maxWriteWords);
-        return kPRFailure;
+        return NULL;
     }
 
     // If there are already some words prepared to be written and the addition of the new
@@ -1145,47 +2118,458 @@ PRResult PRDevice::PrepareWriteData(uint32_t * words, int32_t numWords)
     if (numPreparedWriteWords + numWords > maxWriteWords)
     {
         if (FlushWriteData() == kPRFailure)
-            return kPRFailure;
+            return NULL;
     }
 
-    memcpy(preparedWriteWords + numPreparedWriteWords, words, numWords * 4);
+    words = preparedWriteWords + numPreparedWriteWords;
     numPreparedWriteWords += numWords;
 
+    if (flushThreadRunning)
+    {
+        // Start the latency clock with the first word, and wake the flush thread when it
+        // has something new to do.  It can't flush until the caller lets go of writeMutex,
+        // by which time the reserved words have been filled in.
+        bool first = numPreparedWriteWords == numWords;
+        if (first)
+            oldestPreparedWriteTime = std::chrono::steady_clock::now();
+        if ((first && writeFlushPolicy.maxLatencyMicroseconds > 0) ||
+            (writeFlushPolicy.maxPendingWords > 0 && numPreparedWriteWords >= writeFlushPolicy.maxPendingWords))
+            flushCond.notify_one();
+    }
+    return words;
+}
+
+PRResult PRDevice::PrepareWriteData(uint32_t * words, int32_t numWords)
+{
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    uint32_t *staged = ReserveWriteWords(numWords);
+    if (staged == NULL)
+        return kPRFailure;
+
+    PREncodeWordsBE(words, (uint8_t *)staged, numWords);
+    return kPRSuccess;
+}
+
+PRResult PRDevice::PrepareWireBursts(const uint32_t *words, int32_t numWords)
+{
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    while (numWords > 0)
+    {
+        // Take as many whole bursts as fit in what is left of the staging buffer, or at
+        // least one, which then starts a new transfer.
+        int32_t roomWords = maxWriteWords - numPreparedWriteWords;
+        int32_t chunkWords = 0;
+        while (chunkWords < numWords)
+        {
+            int32_t burstWords = 1 + ((PRWireWord(words[chunkWords]) & P_ROC_HEADER_LENGTH_MASK) >> P_ROC_HEADER_LENGTH_SHIFT);
+            if (chunkWords > 0 && chunkWords + burstWords > roomWords)
+                break;
+            chunkWords += burstWords;
+            if (chunkWords > roomWords)
+                break;
+        }
+
+        uint32_t *staged = ReserveWriteWords(chunkWords);
+        if (staged == NULL)
+            return kPRFailure;
+        memcpy(staged, words, chunkWords * sizeof(uint32_t));
+        words += chunkWords;
+        numWords -= chunkWords;
+    }
+    return kPRSuccess;
+}
+
+PRResult PRDevice::PrepareWireWords(const uint32_t *words, int32_t numWords, int32_t unitWords)
+{
+    const int32_t maxChunkWords = maxWriteWords - maxWriteWords % unitWords;
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    while (numWords > 0)
+    {
+        // Top up what is already staged before starting a new transfer.
+        int32_t roomWords = maxWriteWords - numPreparedWriteWords;
+        int32_t chunkWords = roomWords - roomWords % unitWords;
+        if (chunkWords == 0)
+            chunkWords = maxChunkWords;
+        if (chunkWords > numWords)
+            chunkWords = numWords;
+
+        uint32_t *staged = ReserveWriteWords(chunkWords);
+        if (staged == NULL)
+            return kPRFailure;
+        memcpy(staged, words, chunkWords * sizeof(uint32_t));
+        words += chunkWords;
+        numWords -= chunkWords;
+    }
+    return kPRSuccess;
+}
+
+PRResult PRDevice::PreparePDBCommand(uint8_t boardAddr, PRLEDRegisterType reg, uint8_t data)
+{
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    uint32_t *burst = ReserveWriteWords(2);
+    if (burst == NULL)
+        return kPRFailure;
+
+    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, boardAddr, reg, data, burst);
     return kPRSuccess;
 }
 
 PRResult PRDevice::FlushWriteData()
 {
-    PRResult res;
-    res = WriteData(preparedWriteWords, numPreparedWriteWords);
+    PRResult res = kPRSuccess;
+    std::unique_lock<std::recursive_mutex> lock(writeMutex);
+
+    if (flushThreadError.exchange(false))
+    {
+        PRSetLastErrorText("Error in background write flush.");
+        res = kPRFailure;
+    }
+    if (numPreparedWriteWords == 0)
+        return res;
+
+    // Send the staged words from the other buffer so more can be staged while they go out.
+    // Taking transportWriteMutex first waits for the previous flush, which may still be
+    // sending that buffer.
+    std::lock_guard<std::mutex> writeLock(transportWriteMutex);
+    uint32_t *words = preparedWriteWords;
+    int32_t numWords = numPreparedWriteWords;
+    preparedWriteWords = (words == writeBuffers[0]) ? writeBuffers[1] : writeBuffers[0];
     numPreparedWriteWords = 0; // Reset word counter
+    flushRequested = false;
+    lock.unlock();
+
+    // The staged words are already in wire order; no conversion needed.
+    if (SendWireData((uint8_t *)words, numWords) != kPRSuccess)
+        res = kPRFailure;
     return res;
 }
 
-PRResult PRDevice::WriteData(uint32_t * words, int32_t numWords)
+void PRDevice::RequestFlush()
 {
-    int32_t j,k;
-//  int32_t item;
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    if (flushThreadRunning)
+    {
+        flushRequested = true;
+        flushCond.notify_one();
+    }
+    else
+        FlushWriteData();
+}
 
-    if (numWords == 0)
-        return kPRSuccess;
+PRResult PRDevice::SetWriteFlushPolicy(const PRWriteFlushPolicy *policy)
+{
+    if (policy->maxPendingWords < 0 || policy->maxPendingWords > maxWriteWords || policy->maxLatencyMicroseconds < 0)
+    {
+        PRSetLastErrorText("Invalid write flush policy: maxPendingWords must be 0-%d and maxLatencyMicroseconds at least 0.", maxWriteWords);
+        return kPRFailure;
+    }
+
+    bool needThread = policy->maxPendingWords > 0 || policy->maxLatencyMicroseconds > 0;
+    if (!needThread)
+        StopFlushThread();
+    {
+        std::lock_guard<std::recursive_mutex> lock(writeMutex);
+        writeFlushPolicy = *policy;
+        flushCond.notify_one(); // Let a running flush thread pick up the new limits.
+    }
+    if (needThread && !flushThreadRunning)
+    {
+        flushThreadStop = false;
+        flushThreadRunning = true;
+        flushThread = std::thread(&PRDevice::FlushThreadLoop, this);
+    }
+    return kPRSuccess;
+}
+
+PRResult PRDevice::GetWriteFlushPolicy(PRWriteFlushPolicy *policy)
+{
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    *policy = writeFlushPolicy;
+    return kPRSuccess;
+}
+
+PRResult PRDevice::SetLinkParams(const PRLinkParams *params)
+{
+    if (transportState == NULL || transport->setLinkParams == NULL)
+    {
+        PRSetLastErrorText("This transport has no link settings.");
+        return kPRFailure;
+    }
+
+    if (PRCheckLinkParams(params) != kPRSuccess)
+        return kPRFailure;
+
+    // Nothing may be reading or writing while the driver changes the link underneath it.
+    std::lock_guard<std::mutex> writeLock(transportWriteMutex);
+    std::lock_guard<std::mutex> readLock(transportReadMutex);
+    if (transport->setLinkParams(transportState, params) != kPRSuccess)
+        return kPRFailure;
+
+    if (params->latencyTimer != 0) linkParams.latencyTimer = params->latencyTimer;
+    if (params->readChunkSize != 0) linkParams.readChunkSize = params->readChunkSize;
+    if (params->writeChunkSize != 0) linkParams.writeChunkSize = params->writeChunkSize;
+    if (params->baudRate != 0) linkParams.baudRate = params->baudRate;
+    return kPRSuccess;
+}
+
+PRResult PRDevice::GetLinkParams(PRLinkParams *params)
+{
+    if (transportState == NULL || transport->setLinkParams == NULL)
+    {
+        PRSetLastErrorText("This transport has no link settings.");
+        return kPRFailure;
+    }
+    std::lock_guard<std::mutex> writeLock(transportWriteMutex);
+    *params = linkParams;
+    return kPRSuccess;
+}
+
+/** CPU time thread has used so far, in microseconds, or the calling thread's if thread is NULL.  -1 if it can't be read. */
+static int64_t ThreadCPUMicroseconds(std::thread *thread)
+{
+#if defined(_MSC_VER)
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    if (!GetThreadTimes(thread != NULL ? (HANDLE)thread->native_handle() : GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime))
+        return -1;
+    uint64_t kernel = ((uint64_t)kernelTime.dwHighDateTime << 32) | kernelTime.dwLowDateTime;
+    uint64_t user = ((uint64_t)userTime.dwHighDateTime << 32) | userTime.dwLowDateTime;
+    return (int64_t)((kernel + user) / 10); // FILETIME counts 100ns units.
+#elif defined(__APPLE__)
+    mach_port_t port = pthread_mach_thread_np(thread != NULL ? thread->native_handle() : pthread_self());
+    thread_basic_info_data_t info;
+    mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+    if (thread_info(port, THREAD_BASIC_INFO, (thread_info_t)&info, &count) != KERN_SUCCESS)
+        return -1;
+    return ((int64_t)info.user_time.seconds + info.system_time.seconds) * 1000000 +
+           info.user_time.microseconds + info.system_time.microseconds;
+#else
+    clockid_t clock;
+    struct timespec ts;
+    if (pthread_getcpuclockid(thread != NULL ? thread->native_handle() : pthread_self(), &clock) != 0 ||
+        clock_gettime(clock, &ts) != 0)
+        return -1;
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+int64_t PRDevice::LinkCPUMicroseconds()
+{
+    // Only the threads that move data over the link: the caller, and the event thread when it
+    // does the reading.  Whatever else the process runs meanwhile doesn't count.
+    int64_t total = ThreadCPUMicroseconds(NULL);
+    if (total >= 0 && eventThreadRunning)
+    {
+        int64_t eventThreadTime = ThreadCPUMicroseconds(&eventThread);
+        total = eventThreadTime >= 0 ? total + eventThreadTime : -1;
+    }
+    return total;
+}
+
+PRResult PRDevice::MeasureLink(PRLinkMeasurement *m)
+{
+    const int32_t warmupReads = 2;
+    const int32_t timedReads = 16;
+    const int32_t burstReads = 32;
+    const int32_t burstWords = 4;
+    std::vector<int64_t> roundTrips;
+    uint32_t word;
+    int32_t i;
+
+    for (i = 0; i < warmupReads; i++)
+        if (ReadDataRaw(P_ROC_MANAGER_SELECT, P_ROC_REG_CHIP_ID_ADDR, 1, &word) != kPRSuccess)
+            return kPRFailure;
+
+    // Round trip: one register read at a time, the way a caller polling the board sees it.
+    int64_t cpuStart = LinkCPUMicroseconds();
+    for (i = 0; i < timedReads; i++)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (ReadDataRaw(P_ROC_MANAGER_SELECT, P_ROC_REG_CHIP_ID_ADDR, 1, &word) != kPRSuccess)
+            return kPRFailure;
+        roundTrips.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+    int64_t cpuEnd = LinkCPUMicroseconds();
+    if (cpuStart < 0 || cpuEnd < 0)
+    {
+        PRSetLastErrorText("Unable to read thread CPU times.");
+        return kPRFailure;
+    }
+    std::sort(roundTrips.begin(), roundTrips.end());
+    m->roundTripMicroseconds = (int32_t)roundTrips[timedReads / 2];
+    m->cpuMicroseconds = (int32_t)((cpuEnd - cpuStart) / timedReads);
+
+    // Throughput: many reads in flight at once.
+    std::vector<uint32_t> words(burstReads * burstWords);
+    std::vector<int32_t> tickets;
+    PRResult res = kPRSuccess;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (i = 0; i < burstReads && res == kPRSuccess; i++)
+    {
+        int32_t ticket = ReadDataAsync(P_ROC_MANAGER_SELECT, P_ROC_REG_CHIP_ID_ADDR, burstWords, &words[i * burstWords], NULL, NULL);
+        if (ticket < 0)
+            res = kPRFailure;
+        else
+            tickets.push_back(ticket);
+    }
+    for (i = 0; i < (int32_t)tickets.size() && res == kPRSuccess; i++)
+        if (WaitForRead(tickets[i], 1000*1000) != 1)
+            res = kPRFailure;
+    int64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    if (res != kPRSuccess)
+    {
+        for (i = 0; i < (int32_t)tickets.size(); i++)
+            CancelRead(tickets[i]);
+        PRSetLastErrorText("Timed out measuring link throughput.");
+        return kPRFailure;
+    }
+    m->wordsPerSecond = (int32_t)((int64_t)burstReads * burstWords * 1000000 / (elapsed > 0 ? elapsed : 1));
+    return kPRSuccess;
+}
+
+PRResult PRDevice::CalibrateLink(PRLinkGoal goal, int32_t maxRoundTripMicroseconds, PRLinkMeasurement *chosen)
+{
+    // The latency timer matters most: it bounds how long a short response can sit in the
+    // FTDI chip.  The read chunk size sets how much work each USB read does on the host.
+    // The write chunk size is left alone: timing it would mean writing to the board, and the
+    // handful of words sent by register reads says nothing about bulk writes.
+    static const int32_t latencyTimers[] = { 1, 2, 4, 8, 16 };
+    static const int32_t readChunkSizes[] = { 512, 4096, 16384 };
+    const int32_t numLatencyTimers = sizeof(latencyTimers) / sizeof(latencyTimers[0]);
+    const int32_t numReadChunkSizes = sizeof(readChunkSizes) / sizeof(readChunkSizes[0]);
+    PRLinkParams original;
+    PRLinkMeasurement best;
+    bool found = false;
+    int32_t bestRoundTrip = -1;
+
+    if (goal != kPRLinkGoalLowestLatency && goal != kPRLinkGoalLowestCPU)
+    {
+        PRSetLastErrorText("Unknown link goal %d.", goal);
+        return kPRFailure;
+    }
+    if (GetLinkParams(&original) != kPRSuccess)
+        return kPRFailure;
+
+    for (int32_t i = 0; i < numLatencyTimers; i++)
+    {
+        for (int32_t j = 0; j < numReadChunkSizes; j++)
+        {
+            PRLinkMeasurement m;
+            m.params = original;
+            m.params.latencyTimer = latencyTimers[i];
+            m.params.readChunkSize = readChunkSizes[j];
+            if (SetLinkParams(&m.params) != kPRSuccess || MeasureLink(&m) != kPRSuccess)
+            {
+                SetLinkParams(&original);
+                return kPRFailure;
+            }
+            DEBUG(PRLog(kPRLogInfo, "Link latency timer %d, read chunk %d: round trip %dus, %d words/s, %dus CPU\n",
+                        m.params.latencyTimer, m.params.readChunkSize, m.roundTripMicroseconds, m.wordsPerSecond, m.cpuMicroseconds));
+
+            if (bestRoundTrip < 0 || m.roundTripMicroseconds < bestRoundTrip)
+                bestRoundTrip = m.roundTripMicroseconds;
+
+            bool better;
+            if (goal == kPRLinkGoalLowestLatency)
+                better = !found || m.roundTripMicroseconds < best.roundTripMicroseconds ||
+                         (m.roundTripMicroseconds == best.roundTripMicroseconds && m.wordsPerSecond > best.wordsPerSecond);
+            else
+                better = (maxRoundTripMicroseconds <= 0 || m.roundTripMicroseconds <= maxRoundTripMicroseconds) &&
+                         (!found || m.cpuMicroseconds < best.cpuMicroseconds ||
+                          (m.cpuMicroseconds == best.cpuMicroseconds && m.roundTripMicroseconds < best.roundTripMicroseconds));
+            if (better)
+            {
+                best = m;
+                found = true;
+            }
+        }
+    }
+
+    if (!found)
+    {
+        SetLinkParams(&original);
+        PRSetLastErrorText("No link settings met a %dus round trip; the best was %dus.", maxRoundTripMicroseconds, bestRoundTrip);
+        return kPRFailure;
+    }
+    if (SetLinkParams(&best.params) != kPRSuccess)
+        return kPRFailure;
+    if (chosen != NULL)
+        *chosen = best;
+    return kPRSuccess;
+}
+
+void PRDevice::StopFlushThread()
+{
+    if (!flushThreadRunning)
+        return;
+    {
+        std::lock_guard<std::recursive_mutex> lock(writeMutex);
+        flushThreadStop = true;
+        flushCond.notify_one();
+    }
+    flushThread.join();
+    flushThreadRunning = false;
+}
+
+void PRDevice::FlushThreadLoop()
+{
+    std::unique_lock<std::recursive_mutex> lock(writeMutex);
+
+    while (!flushThreadStop)
+    {
+        std::chrono::steady_clock::time_point deadline = oldestPreparedWriteTime +
+            std::chrono::microseconds(writeFlushPolicy.maxLatencyMicroseconds);
 
-    // The 32-bit words coming in are in the same byte order they need to be in the P-ROC.
-    // However, due to Intel endian-ness, simply casting the words to 4 bytes changes the
-    // byte order.  So, the conversion to bytes is done here manually to preserve the byte
-    // order.  Might want to add a parameter for endian-ness at some point to make it
-    // work on big endian architectures.
-    for (j = 0; j < numWords; j++) {
-        uint32_t temp_word = words[j];
-        for (k = 3; k >= 0; k--)
+        if (numPreparedWriteWords > 0 &&
+            (flushRequested ||
+             (writeFlushPolicy.maxPendingWords > 0 && numPreparedWriteWords >= writeFlushPolicy.maxPendingWords) ||
+             (writeFlushPolicy.maxLatencyMicroseconds > 0 && std::chrono::steady_clock::now() >= deadline)))
         {
-            wr_buffer[(j*4)+k] = (uint8_t)(temp_word & 0x000000ff);
-            temp_word = temp_word >> 8;
+            lock.unlock();
+            if (FlushWriteData() != kPRSuccess)
+            {
+                DEBUG(PRLog(kPRLogError, "Background write flush failed.\n"));
+                flushThreadError = true; // Reported by the next PRFlushWriteData().
+            }
+            lock.lock();
+            continue;
         }
+
+        if (numPreparedWriteWords > 0 && writeFlushPolicy.maxLatencyMicroseconds > 0)
+            flushCond.wait_until(lock, deadline);
+        else
+            flushCond.wait(lock);
     }
+}
+
+PRResult PRDevice::WriteData(uint32_t * words, int32_t numWords)
+{
+    if (numWords == 0)
+        return kPRSuccess;
+
+    // The 32-bit words coming in are in host byte order, but the P-ROC expects each word
+    // most significant byte first.
+    std::lock_guard<std::mutex> lock(transportWriteMutex);
+    PREncodeWordsBE(words, wr_buffer, numWords);
+    return SendWireData(wr_buffer, numWords);
+}
+
+PRResult PRDevice::WriteWireData(uint8_t * bytes, int32_t numWords)
+{
+    std::lock_guard<std::mutex> lock(transportWriteMutex);
+    return SendWireData(bytes, numWords);
+}
+
+PRResult PRDevice::SendWireData(uint8_t * bytes, int32_t numWords)
+{
+    if (numWords == 0)
+        return kPRSuccess;
 
     int bytesToWrite = numWords * 4;
-    int bytesWritten = PRHardwareWrite(wr_buffer, bytesToWrite);
+    if (wireCapture != NULL)
+        wireCapture->Record(kPRCaptureTransmitted, bytes, bytesToWrite);
+    int bytesWritten = transport->write(transportState, bytes, bytesToWrite);
 
     if (bytesWritten != bytesToWrite)
     {
@@ -1200,15 +2584,14 @@ PRResult PRDevice::WriteData(uint32_t * words, int32_t numWords)
 
 PRResult PRDevice::WriteDataRawUnbuffered(uint32_t moduleSelect, uint32_t startingAddr, int32_t numWriteWords, uint32_t * writeBuffer)
 {
-	PRResult res;
-    uint32_t * buffer;
+    std::lock_guard<std::recursive_mutex> lock(writeMutex);
+    uint32_t * buffer = ReserveWriteWords(numWriteWords + 1);
 
-    buffer = (uint32_t *)malloc((numWriteWords * 4) + 4);
-    buffer[0] = CreateBurstCommand(moduleSelect, startingAddr, numWriteWords);
-    memcpy(buffer+1, writeBuffer, numWriteWords * 4);
-    res = PrepareWriteData(buffer, numWriteWords + 1);
-    free (buffer);
-	return res;
+    if (buffer == NULL)
+        return kPRFailure;
+    buffer[0] = PRWireWord(CreateBurstCommand(moduleSelect, startingAddr, numWriteWords));
+    PREncodeWordsBE(writeBuffer, (uint8_t *)(buffer + 1), numWriteWords);
+	return kPRSuccess;
 }
 
 PRResult PRDevice::WriteDataRaw(uint32_t moduleSelect, uint32_t startingAddr, int32_t numWriteWords, uint32_t * writeBuffer)
@@ -1226,117 +2609,231 @@ PRResult PRDevice::WriteDataRaw(uint32_t moduleSelect, uint32_t startingAddr, in
 
 PRResult PRDevice::ReadDataRaw(uint32_t moduleSelect, uint32_t startingAddr, int32_t numReadWords, uint32_t * readBuffer)
 {
-    int32_t i;
+    int32_t ticket = ReadDataAsync(moduleSelect, startingAddr, numReadWords, readBuffer, NULL, NULL);
+    if (ticket < 0)
+        return kPRFailure;
+
+    int rc = WaitForRead(ticket, 100*1000);
+    if (rc != 1)
+    {
+        CancelRead(ticket);
+        if (rc == 0)
+            PRSetLastErrorText("Timed out reading %d words from module %d address 0x%x.", numReadWords, moduleSelect, startingAddr);
+        return kPRFailure;
+    }
+    return kPRSuccess;
+}
+
+int32_t PRDevice::ReadDataAsync(uint32_t moduleSelect, uint32_t startingAddr, int32_t numReadWords, uint32_t * readBuffer, PRReadCallback callback, void *context)
+{
+    PRPendingRead read;
 
-    // Send out the request.
-    RequestData(moduleSelect, startingAddr, numReadWords);
+    if (numReadWords < 1 || numReadWords > (int32_t)(P_ROC_HEADER_LENGTH_MASK >> P_ROC_HEADER_LENGTH_SHIFT))
+    {
+        PRSetLastErrorText("Cannot read %d words at once.", numReadWords);
+        return -1;
+    }
 
-    i = 0; // Reset i so it can be used to prevent an infinite loop below
+    read.header = CreateRegRequestWord(moduleSelect, startingAddr, numReadWords);
+    read.buffer = readBuffer;
+    read.callback = callback;
+    read.context = context;
+    read.cancelled = false;
 
-    // Wait for data to return.  Give it 10 loops before giving up.
-    // Expect numReadWords + 1 word with the address.
-    while (requestedDataQueue.size() < (uint32_t)((numReadWords + 1)) && i++ < 10)
+    // Register the read before sending the request; the event thread may see the answer
+    // before RequestData() even returns.
     {
-        PRSleep (10); // 10 milliseconds should be plenty of time.
-		if (SortReturningData() != kPRSuccess)
-			return kPRFailure;
+        std::lock_guard<std::mutex> lock(pendingReadsMutex);
+        DropExpiredReads();
+        read.ticket = nextReadTicket;
+        nextReadTicket = (nextReadTicket == INT32_MAX) ? 1 : nextReadTicket + 1;
+        pendingReads.push_back(read);
     }
 
-    // Make sure all of the requested words are available before processing them.
-    // Too many words is just as bad as not enough words.
-    // If too many come back, can they be trusted?
-    if (requestedDataQueue.size() == (uint32_t)(numReadWords + 1))
+    if (RequestData(moduleSelect, startingAddr, numReadWords) != kPRSuccess)
     {
-        requestedDataQueue.pop(); // Ignore address word.  TODO: Verify the address.
-        for (i = 0; i < numReadWords; i++)
+        // Nothing was sent, so no response will need absorbing.
+        std::lock_guard<std::mutex> lock(pendingReadsMutex);
+        for (size_t i = 0; i < pendingReads.size(); i++)
         {
-            readBuffer[i] =  requestedDataQueue.front();
-            requestedDataQueue.pop();
+            if (pendingReads[i].ticket == read.ticket)
+            {
+                pendingReads.erase(pendingReads.begin() + i);
+                break;
+            }
         }
-        return kPRSuccess;
+        return -1;
     }
-    else
+    return read.ticket;
+}
+
+bool PRDevice::IsReadPending(int32_t ticket)
+{
+    // Called with pendingReadsMutex held.
+    for (size_t i = 0; i < pendingReads.size(); i++)
+        if (pendingReads[i].ticket == ticket && !pendingReads[i].cancelled)
+            return true;
+    return false;
+}
+
+void PRDevice::DropExpiredReads()
+{
+    std::chrono::steady_clock::time_point expired = std::chrono::steady_clock::now() - std::chrono::milliseconds(cancelledReadLifetime);
+    for (size_t i = 0; i < pendingReads.size(); )
     {
-        PRSetLastErrorText("Response length did not match.");
-        return kPRFailure;
+        if (pendingReads[i].cancelled && pendingReads[i].cancelTime < expired)
+            pendingReads.erase(pendingReads.begin() + i);
+        else
+            i++;
     }
 }
 
-
-int32_t PRDevice::ReadData(uint32_t *buffer, int32_t num_words)
+int PRDevice::WaitForRead(int32_t ticket, int32_t timeoutMicroseconds)
 {
-    int32_t rc,i,j;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+        std::chrono::microseconds(timeoutMicroseconds > 0 ? timeoutMicroseconds : 0);
 
-    // Just like in the write_data method, the bytes are ordered here manually to put
-    // them in the right order.  They are pulled from the collected_bytes_fifo 1 at a time
-    // and stuffed into 32-bit words, high byte to low byte.
-    if ((num_words * 4) <= num_collected_bytes) {
-        for (j=0; j<num_words; j++) {
-            // Initialize buffer position
-            buffer[j] = 0;
-            for (i=0; i<4; i++) {
-                buffer[j] = (collected_bytes_fifo[collected_bytes_rd_addr] << (24-(i*8))) |
-                buffer[j];
-                if (collected_bytes_rd_addr == (FTDI_BUFFER_SIZE-1))
-                    collected_bytes_rd_addr = 0;
-                else
-                    collected_bytes_rd_addr++;
-            }
+    if (eventThreadRunning)
+    {
+        // The event thread does the reading; just wait for it to deliver.
+        std::unique_lock<std::mutex> lock(pendingReadsMutex);
+        while (IsReadPending(ticket))
+        {
+            if (eventThreadError)
+                return -1;
+            if (timeoutMicroseconds < 0)
+                pendingReadsCond.wait(lock);
+            else if (pendingReadsCond.wait_until(lock, deadline) == std::cv_status::timeout)
+                return IsReadPending(ticket) ? 0 : 1;
         }
-        num_collected_bytes -= (num_words * 4);
+        return 1;
+    }
 
-        rc = num_words;
+    while (true)
+    {
+        if (SortReturningData() != kPRSuccess)
+            return -1;
+        {
+            std::lock_guard<std::mutex> lock(pendingReadsMutex);
+            if (!IsReadPending(ticket))
+                return 1;
+        }
+        if (timeoutMicroseconds >= 0 && std::chrono::steady_clock::now() >= deadline)
+            return 0;
+        if (last_collected_bytes == 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(100)); // Nothing arrived; don't spin on the bus.
     }
-    else {
-        PRSetLastErrorText("Read length did not match.");
-        rc = 0;
+}
+
+PRResult PRDevice::CancelRead(int32_t ticket)
+{
+    std::lock_guard<std::mutex> lock(pendingReadsMutex);
+    DropExpiredReads();
+    for (size_t i = 0; i < pendingReads.size(); i++)
+    {
+        if (pendingReads[i].ticket == ticket && !pendingReads[i].cancelled)
+        {
+            // The request is already on its way.  Keep the entry so its response, if it still
+            // comes, is matched here and not to a later read of the same registers.
+            pendingReads[i].cancelled = true;
+            pendingReads[i].cancelTime = std::chrono::steady_clock::now();
+            pendingReads[i].buffer = NULL;
+            pendingReads[i].callback = NULL;
+            return kPRSuccess;
+        }
     }
-    DEBUG(PRLog(kPRLogVerbose, "Read num bytes: %d\n", rc));
-    return (rc);
+    return kPRFailure;
+}
+
+bool PRDevice::CompleteRead(uint32_t header, const uint32_t *data, int32_t numWords)
+{
+    PRPendingRead read;
+    bool found = false;
+
+    {
+        std::lock_guard<std::mutex> lock(pendingReadsMutex);
+        DropExpiredReads();
+        // The P-ROC answers in order, so the oldest read with this header is the one answered,
+        // even if it has been cancelled since.
+        for (size_t i = 0; i < pendingReads.size(); i++)
+        {
+            if (pendingReads[i].header == header)
+            {
+                read = pendingReads[i];
+                pendingReads.erase(pendingReads.begin() + i);
+                found = true;
+                break;
+            }
+        }
+        // Copy while still locked so a concurrent CancelRead() can't pull the buffer away.
+        if (found && read.buffer != NULL)
+            memcpy(read.buffer, data, numWords * 4);
+    }
+    if (!found)
+        return false;
+    if (read.cancelled)
+        return true;
+
+    if (read.callback != NULL)
+        read.callback(read.context, read.ticket,
+                      (header & P_ROC_MODULE_SELECT_MASK) >> P_ROC_MODULE_SELECT_SHIFT,
+                      (header & P_ROC_REG_ADDR_MASK) >> P_ROC_REG_ADDR_SHIFT, data, numWords);
+
+    std::lock_guard<std::mutex> lock(pendingReadsMutex);
+    pendingReadsCond.notify_all();
+    return true;
 }
 
 PRResult PRDevice::FlushReadBuffer()
 {
     int32_t numBytes,rc=0;
-    //uint32_t rd_buffer[3];
     numBytes = CollectReadData();
     DEBUG(PRLog(kPRLogError, "Flushing Read Buffer: %d bytes trashed\n", numBytes));
 
-    //while (k < numBytes) {
-    //    rc = ReadData(rd_buffer, 1);
-    //    k++;
-    //}
-    collected_bytes_rd_addr = 0;
-    collected_bytes_wr_addr = 0;
-    num_collected_bytes = 0;
+    num_collected_words = 0;
+    num_partial_bytes = 0;
     return rc;
 }
 
 int32_t PRDevice::CollectReadData()
 {
-    int32_t rc,i;
-    rc = PRHardwareRead(collect_buffer, FTDI_BUFFER_SIZE-num_collected_bytes);
-    if (rc < 0)
-        return rc;
-    for (i=0; i<rc; i++) {
-        collected_bytes_fifo[collected_bytes_wr_addr] = collect_buffer[i];
-        if (collected_bytes_wr_addr == (FTDI_BUFFER_SIZE-1))
-            collected_bytes_wr_addr = 0;
-        else
-            collected_bytes_wr_addr++;
+    int32_t rc, numBytes, numWords;
+
+    // Read straight in behind any leftover bytes of a partial word, then convert every
+    // complete word in one pass.
+    int32_t maxBytes = (maxCollectedWords - num_collected_words) * 4 - num_partial_bytes;
+    if (maxBytes > FTDI_BUFFER_SIZE)
+        maxBytes = FTDI_BUFFER_SIZE;
+    if (maxBytes <= 0)
+    {
+        last_collected_bytes = 0;
+        return 0;
     }
-    num_collected_bytes += rc;
-    if (rc > 0)
     {
-        DEBUG(PRLog(kPRLogVerbose, "Collected bytes: %d\n", rc));
+        std::lock_guard<std::mutex> lock(transportReadMutex);
+        rc = transport->read(transportState, collect_buffer + num_partial_bytes, maxBytes);
+        if (wireCapture != NULL)
+            wireCapture->Record(kPRCaptureReceived, collect_buffer + num_partial_bytes, rc);
     }
+    last_collected_bytes = rc;
+    if (rc <= 0)
+        return rc;
+    last_collected_time = PRHostTimeMicroseconds();
+
+    numBytes = num_partial_bytes + rc;
+    numWords = numBytes / 4;
+    PRDecodeWordsBE(collect_buffer, collected_words + num_collected_words, numWords);
+    num_collected_words += numWords;
+    num_partial_bytes = numBytes - (numWords * 4);
+    memmove(collect_buffer, collect_buffer + (numWords * 4), num_partial_bytes);
+
+    DEBUG(PRLog(kPRLogVerbose, "Collected bytes: %d\n", rc));
     return (rc);
 }
 
 PRResult PRDevice::SortReturningData()
 {
-    int32_t num_bytes, num_words;
-    uint32_t rd_buffer[FTDI_BUFFER_SIZE/4];
+    int32_t num_bytes, num_sorted;
 
     num_bytes = CollectReadData();
     if (num_bytes < 0)
@@ -1344,37 +2841,46 @@ PRResult PRDevice::SortReturningData()
         PRSetLastErrorText("Error in CollectReadData: %d", num_bytes);
         return kPRFailure;
     }
-    num_words = num_collected_bytes/4;
 
-    while (num_words >= 2) {
-        ReadData(rd_buffer, 1);
-        DEBUG(PRLog(kPRLogVerbose, "New returning word: 0x%x\n", rd_buffer[0]));
+    num_sorted = SortWords(collected_words, num_collected_words);
+    num_collected_words -= num_sorted;
+    if (num_sorted > 0 && num_collected_words > 0)
+        memmove(collected_words, collected_words + num_sorted, num_collected_words * 4);
+    DecodeUnrequestedWords();
+    return kPRSuccess;
+}
 
-        switch ( (rd_buffer[0] & P_ROC_COMMAND_MASK) >> P_ROC_COMMAND_SHIFT)
+int32_t PRDevice::SortWords(const uint32_t *words, int32_t numWords)
+{
+    int32_t pos = 0;
+
+    while (pos < numWords)
+    {
+        uint32_t header = words[pos];
+        DEBUG(PRLog(kPRLogVerbose, "New returning word: 0x%x\n", header));
+
+        if (((header & P_ROC_COMMAND_MASK) >> P_ROC_COMMAND_SHIFT) == P_ROC_REQUESTED_DATA)
         {
-            case P_ROC_REQUESTED_DATA: {
-                // Push the address word so it can be used to identify the subsequent data.
-                requestedDataQueue.push(rd_buffer[0]);
-                int wordsRead = ReadData(rd_buffer,
-                                         (rd_buffer[0] & P_ROC_HEADER_LENGTH_MASK) >>
-                                         P_ROC_HEADER_LENGTH_SHIFT);
-                for (int i = 0; i < wordsRead; i++)
-                {
-                    DEBUG(PRLog(kPRLogVerbose, "Pushing onto unreq Q 0x%x\n", rd_buffer[i]));
-                    requestedDataQueue.push(rd_buffer[i]);
-                }
+            int32_t length = (header & P_ROC_HEADER_LENGTH_MASK) >> P_ROC_HEADER_LENGTH_SHIFT;
+            // Leave the response where it is until all of it has arrived.
+            if (numWords - pos < length + 1)
                 break;
-            }
-            case P_ROC_UNREQUESTED_DATA: {
-                ReadData(rd_buffer,1);
-                DEBUG(PRLog(kPRLogVerbose, "Pushing onto unreq Q 0x%x\n", rd_buffer[0]));
-                unrequestedDataQueue.push(rd_buffer[0]);
+
+            if (!CompleteRead(header, words + pos + 1, length))
+                DEBUG(PRLog(kPRLogWarning, "Dropping %d words of unexpected requested data (header 0x%x).\n", length, header));
+            pos += length + 1;
+        }
+        else
+        {
+            if (numWords - pos < 2)
                 break;
-            }
+            DEBUG(PRLog(kPRLogVerbose, "Pushing onto unreq Q 0x%x\n", words[pos + 1]));
+            unrequestedWords.push_back(words[pos + 1]);
+            unrequestedTimes.push_back(last_collected_time);
+            pos += 2;
         }
-        num_words = num_collected_bytes/4;
     }
-    return kPRSuccess;
+    return pos;
 }
 
 int PRDevice::CalcCombinedVerRevision()
@@ -1391,134 +2897,96 @@ int PRDevice::GetVersionInfo(uint16_t *verPtr, uint16_t *revPtr, uint16_t *combi
     return 0;
 }
 
-PRResult PRDevice::PRLEDColor(PRLED * pLED, uint8_t color)
+PRResult PRDevice::SimulatorInjectEvents(const PREvent *events, int numEvents)
 {
-    const int bufferWords = 2;
-    uint32_t buffer[bufferWords];
+    if (transport != &PRSimulatorTransport || transportState == NULL)
+    {
+        PRSetLastErrorText("Events can only be injected into a simulated P-ROC.");
+        return kPRFailure;
+    }
+    return PRSimulatorQueueEvents(transportState, events, numEvents);
+}
 
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->LEDIndex, buffer);
-    PrepareWriteData(buffer, bufferWords);
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->boardAddr, kPRLEDRegisterTypeColor, color, buffer);
+PRResult PRDevice::SimulatorInjectData(const uint32_t *words, int numWords)
+{
+    if (transport != &PRSimulatorTransport || transportState == NULL)
+    {
+        PRSetLastErrorText("Data can only be injected into a simulated P-ROC.");
+        return kPRFailure;
+    }
+    return PRSimulatorQueueWords(transportState, words, numWords);
+}
 
-    return PrepareWriteData(buffer, bufferWords);
+PRResult PRDevice::PRLEDColor(PRLED * pLED, uint8_t color)
+{
+    PreparePDBCommand(pLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->LEDIndex);
+    return PreparePDBCommand(pLED->boardAddr, kPRLEDRegisterTypeColor, color);
 }
 
 PRResult PRDevice::PRLEDFade(PRLED * pLED, uint8_t fadeColor, uint16_t fadeRate)
 {
-    const int bufferWords = 2;
-    uint32_t buffer[bufferWords];
-
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->boardAddr, kPRLEDRegisterTypeFadeRateLow, fadeRate & 0xFF, buffer);
-    PrepareWriteData(buffer, bufferWords);
+    PreparePDBCommand(pLED->boardAddr, kPRLEDRegisterTypeFadeRateLow, fadeRate & 0xFF);
 
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->boardAddr, kPRLEDRegisterTypeFadeRateHigh, (fadeRate >> 8) & 0xFF, buffer);
-    PrepareWriteData(buffer, bufferWords);
+    PreparePDBCommand(pLED->boardAddr, kPRLEDRegisterTypeFadeRateHigh, (fadeRate >> 8) & 0xFF);
 
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->LEDIndex, buffer);
-    PrepareWriteData(buffer, bufferWords);
-
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->boardAddr, kPRLEDRegisterTypeFadeColor, fadeColor, buffer);
-    return PrepareWriteData(buffer, bufferWords);
+    PreparePDBCommand(pLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->LEDIndex);
 
+    return PreparePDBCommand(pLED->boardAddr, kPRLEDRegisterTypeFadeColor, fadeColor);
 }
 
 PRResult PRDevice::PRLEDFadeColor(PRLED * pLED, uint8_t fadeColor)
 {
-    const int bufferWords = 2;
-    uint32_t buffer[bufferWords];
-
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->LEDIndex, buffer);
-    PrepareWriteData(buffer, bufferWords);
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->boardAddr, kPRLEDRegisterTypeFadeColor, fadeColor, buffer);
-    return PrepareWriteData(buffer, bufferWords);
-
+    PreparePDBCommand(pLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->LEDIndex);
+    return PreparePDBCommand(pLED->boardAddr, kPRLEDRegisterTypeFadeColor, fadeColor);
 }
 
 PRResult PRDevice::PRLEDFadeRate(uint8_t boardAddr, uint16_t fadeRate)
 {
-    const int bufferWords = 2;
-    uint32_t buffer[bufferWords];
-
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, boardAddr, kPRLEDRegisterTypeFadeRateLow, fadeRate & 0xFF, buffer);
-    PrepareWriteData(buffer, bufferWords);
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, boardAddr, kPRLEDRegisterTypeFadeRateHigh, (fadeRate >> 8) & 0xFF, buffer);
-    return PrepareWriteData(buffer, bufferWords);
+    PreparePDBCommand(boardAddr, kPRLEDRegisterTypeFadeRateLow, fadeRate & 0xFF);
+    return PreparePDBCommand(boardAddr, kPRLEDRegisterTypeFadeRateHigh, (fadeRate >> 8) & 0xFF);
 }
 
 PRResult PRDevice::PRLEDRGBColor(PRLEDRGB * pLED, uint32_t color)
 {
-    const int bufferWords = 2;
-    uint32_t buffer[bufferWords];
+    PreparePDBCommand(pLED->pRedLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pRedLED->LEDIndex);
+    PreparePDBCommand(pLED->pRedLED->boardAddr, kPRLEDRegisterTypeColor, (color >> 16) & 0xFF);
 
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pRedLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pRedLED->LEDIndex, buffer);
-    PrepareWriteData(buffer, bufferWords);
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pRedLED->boardAddr, kPRLEDRegisterTypeColor, (color >> 16) & 0xFF, buffer);
-    PrepareWriteData(buffer, bufferWords);
+    PreparePDBCommand(pLED->pGreenLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pGreenLED->LEDIndex);
+    PreparePDBCommand(pLED->pGreenLED->boardAddr, kPRLEDRegisterTypeColor, (color >> 8) & 0xFF);
 
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pGreenLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pGreenLED->LEDIndex, buffer);
-    PrepareWriteData(buffer, bufferWords);
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pGreenLED->boardAddr, kPRLEDRegisterTypeColor, (color >> 8) & 0xFF, buffer);
-    PrepareWriteData(buffer, bufferWords);
-
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pBlueLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pBlueLED->LEDIndex, buffer);
-    PrepareWriteData(buffer, bufferWords);
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pBlueLED->boardAddr, kPRLEDRegisterTypeColor, color & 0xFF, buffer);
-    return PrepareWriteData(buffer, bufferWords);
+    PreparePDBCommand(pLED->pBlueLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pBlueLED->LEDIndex);
+    return PreparePDBCommand(pLED->pBlueLED->boardAddr, kPRLEDRegisterTypeColor, color & 0xFF);
 }
 
 PRResult PRDevice::PRLEDRGBFade(PRLEDRGB * pLED, uint32_t fadeColor, uint16_t fadeRate)
 {
-    const int bufferWords = 12;
-    uint32_t buffer[bufferWords];
-
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pRedLED->boardAddr, kPRLEDRegisterTypeFadeRateLow, fadeRate & 0xFF, buffer);
-    PrepareWriteData(buffer, bufferWords);
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pRedLED->boardAddr, kPRLEDRegisterTypeFadeRateHigh, (fadeRate >> 8) & 0xFF, buffer);
-    PrepareWriteData(buffer, bufferWords);
+    PreparePDBCommand(pLED->pRedLED->boardAddr, kPRLEDRegisterTypeFadeRateLow, fadeRate & 0xFF);
+    PreparePDBCommand(pLED->pRedLED->boardAddr, kPRLEDRegisterTypeFadeRateHigh, (fadeRate >> 8) & 0xFF);
 
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pRedLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pRedLED->LEDIndex, buffer);
-    PrepareWriteData(buffer, bufferWords);
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pRedLED->boardAddr, kPRLEDRegisterTypeFadeColor, (fadeColor >> 16) & 0xFF, buffer);
-    PrepareWriteData(buffer, bufferWords);
+    PreparePDBCommand(pLED->pRedLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pRedLED->LEDIndex);
+    PreparePDBCommand(pLED->pRedLED->boardAddr, kPRLEDRegisterTypeFadeColor, (fadeColor >> 16) & 0xFF);
 
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pBlueLED->boardAddr, kPRLEDRegisterTypeFadeRateLow, fadeRate & 0xFF, buffer);
-    PrepareWriteData(buffer, bufferWords);
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pBlueLED->boardAddr, kPRLEDRegisterTypeFadeRateHigh, (fadeRate >> 8) & 0xFF, buffer);
-    PrepareWriteData(buffer, bufferWords);
+    PreparePDBCommand(pLED->pBlueLED->boardAddr, kPRLEDRegisterTypeFadeRateLow, fadeRate & 0xFF);
+    PreparePDBCommand(pLED->pBlueLED->boardAddr, kPRLEDRegisterTypeFadeRateHigh, (fadeRate >> 8) & 0xFF);
 
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pGreenLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pGreenLED->LEDIndex, buffer);
-    PrepareWriteData(buffer, bufferWords);
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pGreenLED->boardAddr, kPRLEDRegisterTypeFadeColor, (fadeColor >> 8) & 0xFF, buffer);
-    PrepareWriteData(buffer, bufferWords);
+    PreparePDBCommand(pLED->pGreenLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pGreenLED->LEDIndex);
+    PreparePDBCommand(pLED->pGreenLED->boardAddr, kPRLEDRegisterTypeFadeColor, (fadeColor >> 8) & 0xFF);
 
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pGreenLED->boardAddr, kPRLEDRegisterTypeFadeRateLow, fadeRate & 0xFF, buffer);
-    PrepareWriteData(buffer, bufferWords);
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pGreenLED->boardAddr, kPRLEDRegisterTypeFadeRateHigh, (fadeRate >> 8) & 0xFF, buffer);
-    PrepareWriteData(buffer, bufferWords);
+    PreparePDBCommand(pLED->pGreenLED->boardAddr, kPRLEDRegisterTypeFadeRateLow, fadeRate & 0xFF);
+    PreparePDBCommand(pLED->pGreenLED->boardAddr, kPRLEDRegisterTypeFadeRateHigh, (fadeRate >> 8) & 0xFF);
 
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pBlueLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pBlueLED->LEDIndex, buffer);
-    PrepareWriteData(buffer, bufferWords);
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pBlueLED->boardAddr, kPRLEDRegisterTypeFadeColor, fadeColor & 0xFF, buffer);
-    return PrepareWriteData(buffer, bufferWords);
+    PreparePDBCommand(pLED->pBlueLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pBlueLED->LEDIndex);
+    return PreparePDBCommand(pLED->pBlueLED->boardAddr, kPRLEDRegisterTypeFadeColor, fadeColor & 0xFF);
 }
 
 PRResult PRDevice::PRLEDRGBFadeColor(PRLEDRGB * pLED, uint32_t fadeColor)
 {
-    const int bufferWords = 2;
-    uint32_t buffer[bufferWords];
-
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pRedLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pRedLED->LEDIndex, buffer);
-    PrepareWriteData(buffer, bufferWords);
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pRedLED->boardAddr, kPRLEDRegisterTypeFadeColor, (fadeColor >> 16) & 0xFF, buffer);
-    PrepareWriteData(buffer, bufferWords);
+    PreparePDBCommand(pLED->pRedLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pRedLED->LEDIndex);
+    PreparePDBCommand(pLED->pRedLED->boardAddr, kPRLEDRegisterTypeFadeColor, (fadeColor >> 16) & 0xFF);
 
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pGreenLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pGreenLED->LEDIndex, buffer);
-    PrepareWriteData(buffer, bufferWords);
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pGreenLED->boardAddr, kPRLEDRegisterTypeFadeColor, (fadeColor >> 8) & 0xFF, buffer);
-    PrepareWriteData(buffer, bufferWords);
+    PreparePDBCommand(pLED->pGreenLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pGreenLED->LEDIndex);
+    PreparePDBCommand(pLED->pGreenLED->boardAddr, kPRLEDRegisterTypeFadeColor, (fadeColor >> 8) & 0xFF);
 
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pBlueLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pBlueLED->LEDIndex, buffer);
-    PrepareWriteData(buffer, bufferWords);
-    FillPDBCommand(P_ROC_DRIVER_PDB_WRITE_COMMAND, pLED->pBlueLED->boardAddr, kPRLEDRegisterTypeFadeColor, fadeColor & 0xFF, buffer);
-    return PrepareWriteData(buffer, bufferWords);
+    PreparePDBCommand(pLED->pBlueLED->boardAddr, kPRLEDRegisterTypeLEDIndex, pLED->pBlueLED->LEDIndex);
+    return PreparePDBCommand(pLED->pBlueLED->boardAddr, kPRLEDRegisterTypeFadeColor, fadeColor & 0xFF);
 }
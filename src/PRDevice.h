@@ -36,32 +36,102 @@
 #include "pinproc.h"
 #include "PRCommon.h"
 #include "PRHardware.h"
+#include "PRTransport.h"
+#include "PREventRing.h"
+#include "PREventDecoder.h"
+#include "PRSwitchStates.h"
+#include "PREventClock.h"
+#include "PREventHandlers.h"
+#include "PRAccelerometer.h"
+#include "PRSwitchRulePool.h"
+#include "PRCapture.h"
+#include "PRWakeup.h"
 #include <queue>
+#include <list>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 
 using namespace std;
 
 #define maxDriverGroups (26)
 #define maxDrivers (256)
 #define maxSwitchRules (256<<2) // 8 bits of switchNum indicies plus bits for debounced and state.
+#define switchRuleBurstWords (4) // Words CreateSwitchUpdateRulesBurst() writes for one rule.
+#define switchRuleBatchChanged (1) // switchRuleBatchFlags: changed in the open batch.
+#define switchRuleBatchDriveNow (2) // switchRuleBatchFlags: to be written with drive_outputs_now.
 #define maxWriteWords (1536) // Hardware supports 2048 word bursts, but restrict to 1536 for margin.
+#define cancelledReadLifetime (1000) // Milliseconds a cancelled read waits for its response before it is assumed lost.
+#define switchStatesRequestLifetime (1000) // Milliseconds a PRSwitchGetStatesAsync() call waits for both answers before it is given up.
+#define maxCollectedWords (FTDI_BUFFER_SIZE/2) // Room for a full read on top of a partly received 2048 word response.
+
+/** A register read that has been sent to the P-ROC and not answered yet. */
+struct PRPendingRead {
+    int32_t ticket;
+    uint32_t header; /**< The request word.  The P-ROC echoes it in front of the data. */
+    uint32_t *buffer; /**< Where the data is copied; may be NULL. */
+    PRReadCallback callback; /**< May be NULL. */
+    void *context;
+    bool cancelled; /**< Left behind by CancelRead() to absorb the response if it still arrives.  buffer and callback are NULL. */
+    std::chrono::steady_clock::time_point cancelTime;
+};
+
+/** A PRSwitchGetStates() or PRSwitchGetStatesAsync() call waiting for its reads. */
+struct PRSwitchStatesRequest {
+    uint16_t numSwitches;
+    int32_t stateTicket;
+    int32_t debounceTicket;
+    bool stateDone; /**< The state read was answered and stateWords filled in. */
+    bool debounceDone;
+    vector<uint32_t> stateWords;
+    vector<uint32_t> debounceWords;
+    PRSwitchStatesCallback callback; /**< NULL for PRSwitchGetStates(), which only needs switchStates seeded. */
+    void *context;
+    std::chrono::steady_clock::time_point startTime;
+};
 
 class PRDevice
 {
 public:
-    static PRDevice *Create(PRMachineType machineType);
+    static PRDevice *Create(PRMachineType machineType, const PRCreateOptions *options);
     ~PRDevice();
     PRResult Reset(uint32_t resetFlags);
 protected:
-    PRDevice(PRMachineType machineType);
+    PRDevice(PRMachineType machineType, const PRCreateOptions *options);
 
 public:
     // public libpinproc API:
     int GetEvents(PREvent *events, int maxEvents);
+    int GetEventsSoA(PREventType *types, uint32_t *values, uint32_t *times, int maxEvents);
+    int GetEventsEx(PREventEx *events, int maxEvents);
+    PRResult GetClockEstimate(PRClockEstimate *estimate);
+    PRResult SetEventHandler(PREventType type, int32_t switchNum, PREventHandler handler, void *context);
+    PRResult GetEventQueueStats(PREventQueueStats *stats);
+    PRResult ResetEventQueueStats();
+    PRResult AccelSetConfig(const PRAccelConfig *config);
+    PRResult AccelGetConfig(PRAccelConfig *config);
+    PRResult AccelSetLevel();
+    int AccelGetSamples(PRAccelSample *samples, int maxSamples);
+    PRResult StartEventThread();
+    PRResult StopEventThread();
+    int GetEventDescriptor();
+    int WaitForEvents(int32_t timeoutMicroseconds);
 
     PRResult FlushWriteData();
+    PRResult SetWriteFlushPolicy(const PRWriteFlushPolicy *policy);
+    PRResult GetWriteFlushPolicy(PRWriteFlushPolicy *policy);
     PRResult WriteDataRaw(uint32_t moduleSelect, uint32_t startingAddr, int32_t numWriteWords, uint32_t * buffer);
     PRResult WriteDataRawUnbuffered(uint32_t moduleSelect, uint32_t startingAddr, int32_t numWriteWords, uint32_t * buffer);
     PRResult ReadDataRaw(uint32_t moduleSelect, uint32_t startingAddr, int32_t numReadWords, uint32_t * readBuffer);
+    int32_t ReadDataAsync(uint32_t moduleSelect, uint32_t startingAddr, int32_t numReadWords, uint32_t * readBuffer, PRReadCallback callback, void *context);
+    int WaitForRead(int32_t ticket, int32_t timeoutMicroseconds);
+    PRResult CancelRead(int32_t ticket);
+    PRResult SetLinkParams(const PRLinkParams *params);
+    PRResult GetLinkParams(PRLinkParams *params);
+    PRResult CalibrateLink(PRLinkGoal goal, int32_t maxRoundTripMicroseconds, PRLinkMeasurement *chosen);
 
     PRResult ManagerUpdateConfig(PRManagerConfig *managerConfig);
 
@@ -70,13 +140,25 @@ public:
     PRResult DriverUpdateGroupConfig(PRDriverGroupConfig *driverGroupConfig);
     PRResult DriverGetState(uint8_t driverNum, PRDriverState *driverState);
     PRResult DriverUpdateState(PRDriverState *driverState);
+    PRResult DriverUpdateStates(const PRDriverState *driverStates, int numStates);
     PRResult DriverLoadMachineTypeDefaults(PRMachineType machineType, uint32_t resetFlags = kPRResetFlagDefault);
     PRResult DriverAuxSendCommands( PRDriverAuxCommand *commands, uint8_t numCommands, uint8_t startingAddr);
     PRResult DriverWatchdogTickle();
 
     PRResult SwitchUpdateConfig(PRSwitchConfig *switchConfig);
     PRResult SwitchUpdateRule(uint8_t switchNum, PREventType eventType, PRSwitchRule *rule, PRDriverState *linkedDrivers, int numDrivers, bool_t drive_outputs_now);
+    PRResult SwitchRulesBegin();
+    PRResult SwitchRulesCommit();
+    PRResult SwitchRulePoolGetStats(PRSwitchRulePoolStats *stats);
+    PRResult SwitchRulePoolDonate(uint8_t switchNum, PREventType eventType);
+    int SwitchRulePoolCompact();
+    PRResult MachineImageSave(const char *path);
+    PRResult MachineImageLoad(const char *path);
     PRResult SwitchGetStates(PREventType * switchStates, uint16_t numSwitches);
+    PRResult SwitchGetStatesAsync(uint16_t numSwitches, PRSwitchStatesCallback callback, void *context);
+    PRResult SwitchGetStateBitmap(PRSwitchStateBitmap *bitmap);
+    int SwitchGetState(uint16_t switchNum, bool_t debounced);
+    uint32_t SwitchGetLastChangeTime(uint16_t switchNum, bool_t debounced);
 
     PRResult DMDUpdateConfig(PRDMDConfig *dmdConfig);
     PRResult DMDDraw(uint8_t * dots);
@@ -97,6 +179,9 @@ public:
 
     int GetVersionInfo(uint16_t *verPtr, uint16_t *revPtr, uint16_t *combinedPtr);
 
+    PRResult SimulatorInjectEvents(const PREvent *events, int numEvents);
+    PRResult SimulatorInjectData(const uint32_t *words, int numWords);
+
 protected:
 
     // Device I/O
@@ -110,17 +195,49 @@ protected:
     // Raw write and read methods
     //
 
-    /** Schedules data to be written to the P-ROC.  */
+    /**
+     * Reserves numWords words at the end of the write staging buffer, flushing what is already
+     * staged first if they would not fit.  The caller fills them in wire byte order, normally
+     * with one of the Create*Burst() functions.  Returns NULL on failure.
+     */
+    uint32_t *ReserveWriteWords(int32_t numWords);
+
+    /** Schedules data (in host byte order) to be written to the P-ROC.  */
     PRResult PrepareWriteData(uint32_t * buffer, int32_t numWords);
 
-    /** Writes data to the P-ROC immediately. */
-    PRResult WriteData(uint32_t * buffer, int32_t numWords);
+    /**
+     * Schedules bursts already in wire byte order, each unitWords long, copying as many as fit
+     * into the staging buffer at a time.  A burst is never split between two transfers.
+     */
+    PRResult PrepareWireWords(const uint32_t *words, int32_t numWords, int32_t unitWords);
 
     /**
-     * Reads data from the buffer that was previously collected by CollectReadData().
-     * Returns the number of bytes read.
+     * Schedules complete write bursts already in wire byte order, of any length up to
+     * maxWriteWords, filling each transfer with as many whole bursts as fit.
      */
-    int32_t ReadData(uint32_t *buffer, int32_t maxWords);
+    PRResult PrepareWireBursts(const uint32_t *words, int32_t numWords);
+
+    /** Schedules a single PDB command to be written to the P-ROC. */
+    PRResult PreparePDBCommand(uint8_t boardAddr, PRLEDRegisterType reg, uint8_t data);
+
+    /** Writes data (in host byte order) to the P-ROC immediately. */
+    PRResult WriteData(uint32_t * buffer, int32_t numWords);
+
+    /** Writes numWords words that are already in wire byte order to the P-ROC immediately. */
+    PRResult WriteWireData(uint8_t * bytes, int32_t numWords);
+    /** WriteWireData() for callers that already hold transportWriteMutex. */
+    PRResult SendWireData(uint8_t * bytes, int32_t numWords);
+
+    /** Flushes the staged words, on the flush thread if it is running or else right away. */
+    void RequestFlush();
+    /** Body of the flush thread.  Sends staged words whenever writeFlushPolicy says they are due. */
+    void FlushThreadLoop();
+    void StopFlushThread();
+
+    /** Times register reads with the link settings currently applied.  Fills in everything but m->params. */
+    PRResult MeasureLink(PRLinkMeasurement *m);
+    /** CPU time used so far by the calling thread plus the event thread if it is running, in microseconds.  -1 if the OS won't say. */
+    int64_t LinkCPUMicroseconds();
 
     // Collection of methods to get data returning from the P-ROC
     /**
@@ -128,23 +245,98 @@ protected:
      */
     PRResult RequestData(uint32_t module_select, uint32_t start_addr, int32_t num_words);
     /**
-     * Actually reads the data off of the FTDI chip.
+     * Actually reads the data off of the FTDI chip and appends the complete words to collected_words.
      * This is called by SortReturningData() in order to get some data to process.
      */
     int32_t CollectReadData();
     /**
-     * Processes data into unrequestedDataQueue and requestedDataQueue.
-     * Calls CollectReadData() to obtain the data and then uses ReadData() to read it out.
+     * Processes data into eventRing and the pending reads.
+     * Calls CollectReadData() to obtain the data, SortWords() to sort it and
+     * DecodeUnrequestedWords() to queue the events.
      */
     PRResult SortReturningData();
+    /**
+     * Sorts a span of received words into unrequestedWords, and hands requested data to the
+     * pending read whose header it echoes.  Stops at the first response that has not completely
+     * arrived yet.  Returns the number of words consumed.
+     */
+    int32_t SortWords(const uint32_t *words, int32_t numWords);
+    /** Completes the oldest pending read with the given header.  Returns false if there is none. */
+    bool CompleteRead(uint32_t header, const uint32_t *data, int32_t numWords);
+    bool IsReadPending(int32_t ticket);
+    /** Forgets cancelled reads whose response has been missing for cancelledReadLifetime.  Called with pendingReadsMutex held. */
+    void DropExpiredReads();
     /**
      * Empties out the read buffer.
-     * Calls CollectReadData() and then ReadData() until it's empty.
+     * Calls CollectReadData() and throws away everything collected so far.
      */
     PRResult FlushReadBuffer();
+    /** Picks the decodeEventsEx function matching the firmware version. */
+    void SetEventDecoder();
+    /** Common start of the GetEvents() variants: flushes if asked to and collects new data. */
+    PRResult BeginGetEvents();
+    /** Common end of the GetEvents() variants. */
+    void EndGetEvents();
+    int32_t NumUnrequestedWords() { return (int32_t)(unrequestedWords.size() - unrequestedWordsHead); }
+    /** Drops the first numWords words of unrequestedWords once they have been decoded. */
+    void ConsumeUnrequestedWords(int32_t numWords);
+    /** Fills in the extended times of an event received at receiveTime, updating eventClock. */
+    void TimeEvent(PREventEx *event, uint64_t receiveTime);
+    /**
+     * Passes events just decoded from the head of unrequestedWords through eventClock,
+     * accelerometer, switchStates and eventHandlers.  Events taken by the accelerometer or a
+     * handler are removed; returns the number left.
+     */
+    int32_t ProcessEvents(PREventEx *events, int32_t numEvents);
+    /**
+     * Decodes all of unrequestedWords into eventRing, applying eventOverflowPolicy when it is
+     * full.  Wakes up the reader if the event thread is running.
+     */
+    void DecodeUnrequestedWords();
+    /**
+     * Takes DMD frame events out of a batch about to be committed while an earlier one is still
+     * queued, holding back the latest in heldDMDEventData.  Returns the number left.
+     */
+    int32_t CoalesceDMDEvents(PREventEx *events, int32_t numEvents);
+    /** Queues the held back DMD frame event once the reader has taken the one before it.  Returns the number queued. */
+    int32_t QueueHeldDMDEvent();
+
+    /**
+     * Body of the event thread.  Keeps reading from the device, decodes unrequested words
+     * into eventRing and completes pending reads.
+     */
+    void EventThreadLoop();
+    /** Makes eventWakeup readable, unless it already is. */
+    void NotifyEvents();
+
+    vector<uint32_t> unrequestedWords; /**< Words received from the device that were not requested via RequestData(), waiting to be decoded from unrequestedWordsHead on.  Usually switch events.  Only touched by the event thread while it is running. */
+    size_t unrequestedWordsHead;
+    vector<uint64_t> unrequestedTimes; /**< Host time each of unrequestedWords was received at. */
+    PRDecodeEventsExFunction decodeEventsEx; /**< Decoder for this firmware's event words; see SetEventDecoder(). */
+    PREventClock eventClock; /**< Unwraps event times and relates them to host time.  Belongs to whichever thread decodes events. */
+    PREventHandlers eventHandlers;
+    PRAccelerometer accelerometer;
+    PRSwitchStates switchStates; /**< Kept up to date wherever events are decoded. */
+    vector<PRPendingRead> pendingReads; /**< Reads sent with RequestData() and not answered yet, oldest first.  Guarded by pendingReadsMutex. */
+    std::mutex pendingReadsMutex;
+    std::condition_variable pendingReadsCond; /**< Signalled whenever a pending read completes. */
+    int32_t nextReadTicket; /**< Guarded by pendingReadsMutex. */
 
-    queue<uint32_t> unrequestedDataQueue; /**< Queue of words received from the device that were not requested via RequestData().  Usually switch events. */
-    queue<uint32_t> requestedDataQueue; /**< Queue of words received from the device as the result of a call to RequestData(). */
+    std::thread eventThread;
+    std::atomic<bool> eventThreadRunning;
+    std::atomic<bool> eventThreadStop; /**< Set to ask the event thread to exit. */
+    std::atomic<bool> eventThreadError; /**< Set by the event thread when reading from the device fails; reported by the next GetEvents(). */
+    PREventRing eventRing; /**< Decoded events waiting for GetEvents().  Sized once from createOptions.eventQueueSize. */
+    PREventOverflowPolicy eventOverflowPolicy;
+    uint32_t lastDMDEventPosition; /**< Position in eventRing of the last DMD frame event queued, if queuedDMDEvent. */
+    bool queuedDMDEvent;
+    PREventEx heldDMDEventData; /**< The latest DMD frame event kept out of eventRing by CoalesceDMDEvents(), if heldDMDEvent. */
+    bool heldDMDEvent;
+    std::atomic<uint32_t> eventQueueHighWater;
+    std::atomic<uint32_t> eventsDropped;
+    std::atomic<uint32_t> eventsCoalesced;
+    PRWakeup eventWakeup; /**< Readable while eventRing has events (or an error is pending).  Opened with the event thread. */
+    std::atomic<bool> wakeupPending; /**< True once eventWakeup has been signalled and until GetEvents() drains it. */
 
     uint16_t version;
     uint16_t revision;
@@ -155,21 +347,39 @@ protected:
      */
     int CalcCombinedVerRevision();
 
-    uint32_t preparedWriteWords[maxWriteWords];
+    uint32_t writeBuffers[2][maxWriteWords]; /**< Write staging buffers.  Words are kept in wire byte order so a flush can hand them straight to the transport. */
+    uint32_t *preparedWriteWords; /**< The one of writeBuffers being filled; the other may be on its way to the device. */
     int32_t numPreparedWriteWords;
+    std::chrono::steady_clock::time_point oldestPreparedWriteTime; /**< When the first of the staged words was reserved.  Only kept while the flush thread runs. */
+    std::recursive_mutex writeMutex; /**< Guards the staging buffers and writeFlushPolicy.  Held from ReserveWriteWords() until the reserved words are filled in. */
+    std::mutex transportWriteMutex; /**< Serializes transport->write(); always taken after writeMutex when both are needed. */
+    PRWriteFlushPolicy writeFlushPolicy;
+    std::thread flushThread;
+    std::condition_variable_any flushCond; /**< Wakes the flush thread when there is something new to flush or it should exit. */
+    std::atomic<bool> flushThreadRunning;
+    bool flushThreadStop; /**< Guarded by writeMutex. */
+    bool flushRequested; /**< Guarded by writeMutex.  Set by RequestFlush(). */
+    std::atomic<bool> flushThreadError; /**< Set when a background flush fails; reported by the next FlushWriteData(). */
 
-    uint8_t collected_bytes_fifo[FTDI_BUFFER_SIZE];
-    int32_t collected_bytes_rd_addr;
-    int32_t collected_bytes_wr_addr;
-    int32_t num_collected_bytes;
+    uint32_t collected_words[maxCollectedWords]; /**< Received words in host byte order, waiting for SortReturningData(). */
+    int32_t num_collected_words;
+    int32_t num_partial_bytes; /**< Bytes of an incomplete word left at the start of collect_buffer. */
+    int32_t last_collected_bytes; /**< Result of the most recent CollectReadData(). */
+    uint64_t last_collected_time; /**< Host time of the most recent CollectReadData() that returned data. */
 
     uint8_t wr_buffer[16384];
-    uint8_t collect_buffer[FTDI_BUFFER_SIZE];
+    uint8_t collect_buffer[FTDI_BUFFER_SIZE + 4];
     PRMachineType readMachineType;
+    const PRTransport *transport; /**< How this device is reached, chosen by createOptions.transport. */
+    void *transportState; /**< Returned by transport->open(); NULL while closed. */
+    PRWireCapture *wireCapture; /**< Records every transport read and write if createOptions.captureFile was given; otherwise NULL. */
+    std::mutex transportReadMutex; /**< Held around transport->read() so SetLinkParams() can keep the link idle. */
+    PRLinkParams linkParams; /**< Last applied link settings, starting with createOptions.linkParams. */
 
 
     // Local Device State
     PRMachineType machineType;
+    PRCreateOptions createOptions;
     PRManagerConfig managerConfig;
     PRDriverGlobalConfig driverGlobalConfig;
     PRDriverGroupConfig driverGroups[maxDriverGroups];
@@ -178,8 +388,64 @@ protected:
 
     PRSwitchConfig switchConfig;
     PRSwitchRuleInternal switchRules[maxSwitchRules];
-	queue<uint32_t> freeSwitchRuleIndexes; /**< Indexes of available switch rules. */
+    PRSwitchRulePool switchRulePool; /**< Rules available for linked driver updates. */
     PRSwitchRuleInternal *GetSwitchRuleByIndex(uint16_t index);
+
+    /** Addresses of the first switch state and debounce words for this chip and firmware. */
+    void GetSwitchStateAddrs(uint32_t *stateAddr, uint32_t *debounceAddr);
+    /** Fills in switchStates[0..numSwitches) from the words read, for the whole groups of 32 read. */
+    void DecodeSwitchStates(const uint32_t *stateWords, const uint32_t *debounceWords, PREventType *switchStates, uint16_t numSwitches);
+    /**
+     * Queues a PRSwitchStatesRequest and sends its two reads, which also copy into stateBuffer and
+     * debounceBuffer if those aren't NULL.  Fills in tickets[2] if it isn't NULL.
+     */
+    PRResult RequestSwitchStates(uint16_t numSwitches, PRSwitchStatesCallback callback, void *context, uint32_t *stateBuffer, uint32_t *debounceBuffer, int32_t *tickets);
+    /**
+     * PRReadCallback of both reads of a PRSwitchStatesRequest; context is the device.  Once both
+     * have been answered, removes the request, seeds switchStates and passes the states to its
+     * callback.  It runs on the thread sorting the returning data, the only one that applies
+     * switch events, so the seed lands between the events sent before and after the answer.
+     */
+    static void SwitchStatesReadDone(void *context, int32_t ticket, uint32_t, uint32_t, const uint32_t *data, int32_t numWords);
+    /** Cancels the reads of requests still unanswered after switchStatesRequestLifetime and forgets them.  Called with switchStatesRequestsMutex held. */
+    void DropExpiredSwitchStatesRequests();
+    list<PRSwitchStatesRequest> switchStatesRequests; /**< Outstanding PRSwitchGetStates() and PRSwitchGetStatesAsync() calls.  Guarded by switchStatesRequestsMutex. */
+    std::mutex switchStatesRequestsMutex;
+
+    /**
+     * Returns the bursts that write every switch rule as Reset() leaves them, in rule index
+     * order.  Built from switchRules the first time and again whenever the global polarity
+     * the blank rules carry changes.
+     */
+    const vector<uint32_t> &EmptySwitchRulesImage();
+    /** True if the rule at index and the rules it links to already hold exactly these driver updates. */
+    bool SwitchRuleChainMatches(uint16_t index, PRDriverState *linkedDrivers, int numDrivers);
+    /**
+     * Writes switchRules[index] to the device and records it in deviceSwitchRules, or while a
+     * batch is open, marks it to be written by SwitchRulesCommit().  linked tells a rule taken
+     * from switchRulePool from a switch's own rule.
+     */
+    PRResult WriteSwitchRule(uint16_t index, bool linked, bool_t drive_outputs_now);
+    /** Returns linked rules that are no longer followed to switchRulePool, at the commit if a batch is open. */
+    void ReleaseSwitchRuleLinks(const vector<uint16_t> &links);
+    /** Appends the bursts of the batch's rules that differ from deviceSwitchRules, recording them there. */
+    void AppendBatchSwitchRules(const vector<uint16_t> &indexes, vector<uint32_t> *bursts);
+    /**
+     * For #kPRResetFlagReconcile: reads the switch rule table into deviceSwitchRules and the
+     * driver table into readbackDriverWords, a few large reads sent back to back.
+     */
+    PRResult ReadDeviceTables();
+    /** Sends the blank rules that differ from deviceSwitchRules, or leaves them to the open batch. */
+    PRResult ReconcileSwitchRules();
+    vector<uint32_t> readbackDriverWords; /**< Driver table (host order) read by ReadDeviceTables(); only filled while Reset() reconciles, when DriverUpdateState() skips drivers that match it. */
+    vector<uint32_t> emptySwitchRulesImage;
+    bool_t emptySwitchRulesPolarity; /**< Polarity emptySwitchRulesImage was built with. */
+    uint32_t deviceSwitchRules[maxSwitchRules][switchRuleBurstWords - 1]; /**< Data words (wire order) of each rule as last sent to the device, if deviceSwitchRuleKnown. */
+    bool deviceSwitchRuleKnown[maxSwitchRules];
+    bool switchRulesBatchOpen; /**< Between SwitchRulesBegin() and SwitchRulesCommit(). */
+    uint8_t switchRuleBatchFlags[maxSwitchRules]; /**< switchRuleBatch* flags of each rule in the open batch. */
+    vector<uint16_t> batchLinkedSwitchRules; /**< Linked rules changed in the open batch, in the order they were changed. */
+    vector<uint16_t> batchPrimarySwitchRules; /**< Switches' own rules changed in the open batch. */
 };
 
 #endif	/* PINPROC_PRDEVICE_H */
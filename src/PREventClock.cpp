@@ -0,0 +1,179 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PREventClock.cpp
+ *  libpinproc
+ */
+
+#include "PREventClock.h"
+#include <chrono>
+#include <climits>
+#include <cmath>
+
+uint64_t PRHostTimeMicroseconds()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+PREventClock::PREventClock()
+{
+    Reset(1 << 16);
+}
+
+void PREventClock::Reset(uint32_t wrapMilliseconds)
+{
+    this->wrapMilliseconds = wrapMilliseconds;
+    started = false;
+    lastDeviceMilliseconds = 0;
+    lastHostTime = 0;
+    windowStart = 0;
+    windowMinimum = INT64_MAX;
+    windowMinimumTime = 0;
+    lowestMinimum = INT64_MAX;
+    numWindows = 0;
+    windowsHead = 0;
+    intercept = 0;
+    slope = 0;
+    fitOrigin = 0;
+
+    std::lock_guard<std::mutex> lock(estimateMutex);
+    estimate.deviceTime = 0;
+    estimate.offsetMicroseconds = 0;
+    estimate.driftPPM = 0;
+    estimate.numWindows = 0;
+}
+
+uint64_t PREventClock::Update(PREventType type, uint32_t time, uint64_t hostReceiveTime)
+{
+    bool accel = type >= kPREventTypeAccelerometerX && type <= kPREventTypeAccelerometerIRQ;
+    int64_t wrap = wrapMilliseconds;
+    int64_t ms = (accel ? (int64_t)time * 4 : (int64_t)time) % wrap;
+    int64_t deviceMilliseconds = ms;
+
+    if (started)
+    {
+        // Pick the wrap that puts the event closest to where the host clock says the
+        // device's counter is by now.
+        int64_t predicted = (int64_t)lastDeviceMilliseconds + ((int64_t)hostReceiveTime - (int64_t)lastHostTime) / 1000;
+        int64_t n = predicted - ms + wrap / 2;
+        deviceMilliseconds += n > 0 ? (n / wrap) * wrap : 0;
+    }
+    else
+    {
+        started = true;
+        windowStart = deviceMilliseconds * 1000;
+    }
+    lastDeviceMilliseconds = deviceMilliseconds;
+    lastHostTime = hostReceiveTime;
+
+    uint64_t deviceTime = deviceMilliseconds * 1000;
+    if (deviceTime >= windowStart + clockWindowMicroseconds)
+    {
+        CloseWindow();
+        windowStart = deviceTime;
+    }
+    int64_t sample = (int64_t)hostReceiveTime - (int64_t)deviceTime;
+    if (sample < windowMinimum)
+    {
+        windowMinimum = sample;
+        windowMinimumTime = deviceTime;
+    }
+    if (sample < lowestMinimum)
+        lowestMinimum = sample;
+    return deviceTime;
+}
+
+void PREventClock::CloseWindow()
+{
+    if (windowMinimum == INT64_MAX)
+        return;
+
+    int slot = (windowsHead + numWindows) % maxClockWindows;
+    if (numWindows == maxClockWindows)
+        windowsHead = (windowsHead + 1) % maxClockWindows;
+    else
+        numWindows++;
+    windowTimes[slot] = windowMinimumTime;
+    windowMinima[slot] = windowMinimum;
+    windowMinimum = INT64_MAX;
+    Fit();
+}
+
+void PREventClock::Fit()
+{
+    if (numWindows < 2)
+        return;
+
+    // Least squares line through the window minima, relative to the oldest one to keep
+    // the doubles precise.
+    fitOrigin = windowTimes[windowsHead];
+    int64_t yOrigin = windowMinima[windowsHead];
+    double sumX = 0, sumY = 0;
+    for (int i = 0; i < numWindows; i++)
+    {
+        int slot = (windowsHead + i) % maxClockWindows;
+        sumX += (double)(windowTimes[slot] - fitOrigin);
+        sumY += (double)(windowMinima[slot] - yOrigin);
+    }
+    double meanX = sumX / numWindows, meanY = sumY / numWindows;
+    double sumXY = 0, sumXX = 0;
+    for (int i = 0; i < numWindows; i++)
+    {
+        int slot = (windowsHead + i) % maxClockWindows;
+        double dx = (double)(windowTimes[slot] - fitOrigin) - meanX;
+        double dy = (double)(windowMinima[slot] - yOrigin) - meanY;
+        sumXY += dx * dy;
+        sumXX += dx * dx;
+    }
+    slope = sumXX > 0 ? sumXY / sumXX : 0;
+    intercept = (double)yOrigin + meanY - slope * meanX;
+}
+
+uint64_t PREventClock::ToHostTime(uint64_t deviceTime) const
+{
+    if (numWindows < 2)
+        return deviceTime + lowestMinimum;
+    return deviceTime + (int64_t)llround(intercept + slope * ((double)deviceTime - (double)fitOrigin));
+}
+
+void PREventClock::Publish()
+{
+    if (!started)
+        return;
+
+    uint64_t deviceTime = lastDeviceMilliseconds * 1000;
+    std::lock_guard<std::mutex> lock(estimateMutex);
+    estimate.deviceTime = deviceTime;
+    estimate.offsetMicroseconds = (int64_t)(ToHostTime(deviceTime) - deviceTime);
+    estimate.driftPPM = numWindows < 2 ? 0 : slope * 1e6;
+    estimate.numWindows = numWindows;
+}
+
+void PREventClock::GetEstimate(PRClockEstimate *estimate) const
+{
+    std::lock_guard<std::mutex> lock(estimateMutex);
+    *estimate = this->estimate;
+}
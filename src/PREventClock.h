@@ -0,0 +1,112 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PREventClock.h
+ *  libpinproc
+ */
+#ifndef PINPROC_PREVENTCLOCK_H
+#define PINPROC_PREVENTCLOCK_H
+#if !defined(__GNUC__) || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4) || (__GNUC__ >= 4)	// GCC supports "pragma once" correctly since 3.4
+#pragma once
+#endif
+
+#include "pinproc.h"
+#include <mutex>
+
+/** PRGetHostTime(): microseconds of std::chrono::steady_clock, which is CLOCK_MONOTONIC on Linux. */
+uint64_t PRHostTimeMicroseconds();
+
+#define clockWindowMicroseconds (10000000) // Device time covered by one lower envelope sample.
+#define maxClockWindows (32)
+
+/**
+ * Relates the device's event timestamps to host time.
+ *
+ * Event timestamps are a millisecond counter (4ms ticks for the accelerometer) that wraps
+ * every wrapMilliseconds.  Each one is unwrapped to the copy nearest to where the host
+ * clock says it should be, so any gap between events is handled as long as the clocks
+ * haven't drifted apart by half a wrap.
+ *
+ * The host receive time of an event is its device time plus a constant offset, the drift
+ * between the clocks and a USB latency that is never negative.  The smallest difference seen
+ * in every clockWindowMicroseconds of device time is therefore the best sample of offset and
+ * drift in that window, and a straight line fitted through the last maxClockWindows of them
+ * gives the estimate.
+ *
+ * Update(), ToHostTime() and Publish() belong to whichever thread decodes events;
+ * GetEstimate() may be called from any thread.
+ */
+class PREventClock
+{
+public:
+    PREventClock();
+
+    /** Forgets everything seen so far and expects timestamps that wrap every wrapMilliseconds. */
+    void Reset(uint32_t wrapMilliseconds);
+
+    /**
+     * Unwraps the time of one event whose data was received at hostReceiveTime and folds it
+     * into the estimate.  Returns the event's device time in microseconds: the device's counter
+     * with every wrap since the first event added back.
+     */
+    uint64_t Update(PREventType type, uint32_t time, uint64_t hostReceiveTime);
+
+    /** Converts a device time from Update() to host time using the current estimate. */
+    uint64_t ToHostTime(uint64_t deviceTime) const;
+
+    /** Makes the estimate as of the last Update() visible to GetEstimate(). */
+    void Publish();
+
+    void GetEstimate(PRClockEstimate *estimate) const;
+
+protected:
+    void CloseWindow();
+    void Fit();
+
+    uint32_t wrapMilliseconds;
+    bool started;
+    uint64_t lastDeviceMilliseconds;
+    uint64_t lastHostTime;
+
+    uint64_t windowStart; /**< Device time the current window started at. */
+    int64_t windowMinimum; /**< Smallest host receive time - device time in the current window. */
+    uint64_t windowMinimumTime; /**< Device time of windowMinimum. */
+    int64_t lowestMinimum; /**< Smallest host receive time - device time so far; the offset until there are two windows to fit. */
+    uint64_t windowTimes[maxClockWindows]; /**< Minima of the closed windows, oldest first from windowsHead. */
+    int64_t windowMinima[maxClockWindows];
+    int numWindows;
+    int windowsHead;
+
+    // offset(deviceTime) = intercept + slope * (deviceTime - fitOrigin)
+    double intercept;
+    double slope;
+    uint64_t fitOrigin;
+
+    mutable std::mutex estimateMutex;
+    PRClockEstimate estimate; /**< Published copy of the estimate. */
+};
+
+#endif	/* PINPROC_PREVENTCLOCK_H */
@@ -0,0 +1,125 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PREventDecoder.h
+ *  libpinproc
+ */
+#ifndef PINPROC_PREVENTDECODER_H
+#define PINPROC_PREVENTDECODER_H
+#if !defined(__GNUC__) || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4) || (__GNUC__ >= 4)	// GCC supports "pragma once" correctly since 3.4
+#pragma once
+#endif
+
+#include "pinproc.h"
+#include "PRHardware.h"
+
+/**
+ * Bulk decoding of unrequested event words.
+ * The layout of an event word depends on the firmware generation, so the decoder is a
+ * template over a format description and each PRDevice picks the instantiation matching
+ * its firmware once, after reading the chip ID.  Within a batch there is then no version
+ * check and no nested switch; the event type comes from a table indexed by the type,
+ * state and debounce bits.  Accelerometer words use their own value and timestamp fields
+ * and are handled with selects rather than a branch.
+ */
+
+/** Event word layout of version 1 firmware. */
+struct PREventFormatV1 {
+    static const uint32_t typeMask = P_ROC_V1_EVENT_TYPE_MASK;
+    static const uint32_t typeShift = P_ROC_V1_EVENT_TYPE_SHIFT;
+    static const uint32_t switchNumMask = P_ROC_V1_EVENT_SWITCH_NUM_MASK;
+    static const uint32_t stateMask = P_ROC_V1_EVENT_SWITCH_STATE_MASK;
+    static const uint32_t stateShift = P_ROC_V1_EVENT_SWITCH_STATE_SHIFT;
+    static const uint32_t debouncedMask = P_ROC_V1_EVENT_SWITCH_DEBOUNCED_MASK;
+    static const uint32_t debouncedShift = P_ROC_V1_EVENT_SWITCH_DEBOUNCED_SHIFT;
+    static const uint32_t timestampMask = P_ROC_V1_EVENT_SWITCH_TIMESTAMP_MASK;
+    static const uint32_t timestampShift = P_ROC_V1_EVENT_SWITCH_TIMESTAMP_SHIFT;
+    static const uint32_t accelTimestampShift = P_ROC_V1_EVENT_SWITCH_TIMESTAMP_SHIFT + 2; // Accelerometer times count 4ms ticks.
+    static const uint32_t timestampWrapMilliseconds = 1 << 20;
+};
+
+/** Event word layout of version 2 and later firmware. */
+struct PREventFormatV2 {
+    static const uint32_t typeMask = P_ROC_V2_EVENT_TYPE_MASK;
+    static const uint32_t typeShift = P_ROC_V2_EVENT_TYPE_SHIFT;
+    static const uint32_t switchNumMask = P_ROC_V2_EVENT_SWITCH_NUM_MASK;
+    static const uint32_t stateMask = P_ROC_V2_EVENT_SWITCH_STATE_MASK;
+    static const uint32_t stateShift = P_ROC_V2_EVENT_SWITCH_STATE_SHIFT;
+    static const uint32_t debouncedMask = P_ROC_V2_EVENT_SWITCH_DEBOUNCED_MASK;
+    static const uint32_t debouncedShift = P_ROC_V2_EVENT_SWITCH_DEBOUNCED_SHIFT;
+    static const uint32_t timestampMask = P_ROC_V2_EVENT_SWITCH_TIMESTAMP_MASK;
+    static const uint32_t timestampShift = P_ROC_V2_EVENT_SWITCH_TIMESTAMP_SHIFT;
+    static const uint32_t accelTimestampShift = P_ROC_V2_EVENT_ACCEL_TIMESTAMP_SHIFT;
+    static const uint32_t timestampWrapMilliseconds = 1 << 16;
+};
+
+const uint32_t P_ROC_EVENT_ACCEL_VALUE_MASK = 0x00003FFF;
+const uint32_t P_ROC_EVENT_ACCEL_AXIS_MASK  = 0x00030000;
+const uint32_t P_ROC_EVENT_ACCEL_AXIS_SHIFT = 16;
+
+/** Event type by (type << 2) | (open << 1) | debounced.  The accelerometer rows are never used. */
+static const PREventType PREventTypeTable[16] = {
+    kPREventTypeSwitchClosedNondebounced, kPREventTypeSwitchClosedDebounced,
+    kPREventTypeSwitchOpenNondebounced, kPREventTypeSwitchOpenDebounced,
+    kPREventTypeDMDFrameDisplayed, kPREventTypeDMDFrameDisplayed,
+    kPREventTypeDMDFrameDisplayed, kPREventTypeDMDFrameDisplayed,
+    kPREventTypeBurstSwitchClosed, kPREventTypeBurstSwitchClosed,
+    kPREventTypeBurstSwitchOpen, kPREventTypeBurstSwitchOpen,
+    kPREventTypeInvalid, kPREventTypeInvalid, kPREventTypeInvalid, kPREventTypeInvalid,
+};
+
+/** Accelerometer event type by axis. */
+static const PREventType PRAccelEventTypeTable[4] = {
+    kPREventTypeAccelerometerX, kPREventTypeAccelerometerY,
+    kPREventTypeAccelerometerZ, kPREventTypeAccelerometerIRQ,
+};
+
+template <class Format>
+static inline void PRDecodeEventWord(uint32_t word, PREventType *type, uint32_t *value, uint32_t *time)
+{
+    uint32_t kind = (word & Format::typeMask) >> Format::typeShift;
+    uint32_t flags = (((word & Format::stateMask) >> Format::stateShift) << 1) |
+                     ((word & Format::debouncedMask) >> Format::debouncedShift);
+    bool accel = kind == P_ROC_EVENT_TYPE_ACCELEROMETER;
+
+    *type = accel ? PRAccelEventTypeTable[(word & P_ROC_EVENT_ACCEL_AXIS_MASK) >> P_ROC_EVENT_ACCEL_AXIS_SHIFT]
+                  : PREventTypeTable[(kind << 2) | flags];
+    *value = word & (accel ? P_ROC_EVENT_ACCEL_VALUE_MASK : Format::switchNumMask);
+    *time = accel ? word >> Format::accelTimestampShift
+                  : (word & Format::timestampMask) >> Format::timestampShift;
+}
+
+/** Decodes numWords event words into events.  The extended times are left alone. */
+template <class Format>
+void PRDecodeEvents(const uint32_t *words, int numWords, PREventEx *events)
+{
+    for (int i = 0; i < numWords; i++)
+        PRDecodeEventWord<Format>(words[i], &events[i].type, &events[i].value, &events[i].time);
+}
+
+typedef void (*PRDecodeEventsExFunction)(const uint32_t *words, int numWords, PREventEx *events);
+
+#endif	/* PINPROC_PREVENTDECODER_H */
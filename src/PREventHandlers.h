@@ -0,0 +1,118 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PREventHandlers.h
+ *  libpinproc
+ */
+#ifndef PINPROC_PREVENTHANDLERS_H
+#define PINPROC_PREVENTHANDLERS_H
+#if !defined(__GNUC__) || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4) || (__GNUC__ >= 4)	// GCC supports "pragma once" correctly since 3.4
+#pragma once
+#endif
+
+#include "pinproc.h"
+#include "PRCommon.h"
+#include <string.h>
+#include <atomic>
+#include <mutex>
+
+#define numEventHandlerTypes (kPREventTypeAccelerometerTilt + 1)
+
+/**
+ * Handlers registered with PRSetEventHandler(), in a table indexed by event type and switch
+ * number so dispatching an event is one lookup.  The last column of each row holds the
+ * handler for any switch.  Handlers are called with the mutex held, so once Set() returns on
+ * another thread the old handler has finished; it is recursive so handlers may call Set().
+ */
+class PREventHandlers
+{
+public:
+    PREventHandlers() : numHandlers(0)
+    {
+        memset(entries, 0, sizeof(entries));
+    }
+
+    PRResult Set(PREventType type, int32_t switchNum, PREventHandler handler, void *context)
+    {
+        if (type <= kPREventTypeInvalid || type >= numEventHandlerTypes)
+        {
+            PRSetLastErrorText("Invalid event type %d.", type);
+            return kPRFailure;
+        }
+        if (switchNum != kPREventHandlerAnySwitch && (!IsSwitchType(type) || switchNum < 0 || switchNum >= kPRSwitchCount))
+        {
+            PRSetLastErrorText("Invalid switch %d for event type %d.", switchNum, type);
+            return kPRFailure;
+        }
+
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        Entry &entry = entries[type][switchNum == kPREventHandlerAnySwitch ? kPRSwitchCount : switchNum];
+        if (entry.handler && !handler)
+            numHandlers--;
+        else if (!entry.handler && handler)
+            numHandlers++;
+        entry.handler = handler;
+        entry.context = handler ? context : NULL;
+        return kPRSuccess;
+    }
+
+    /** Calls the handler registered for event, if there is one.  Returns true if it was handled. */
+    bool Dispatch(const PREventEx *event)
+    {
+        if (numHandlers.load(std::memory_order_acquire) == 0)
+            return false;
+        if (event->type <= kPREventTypeInvalid || event->type >= numEventHandlerTypes)
+            return false;
+
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        const Entry *row = entries[event->type];
+        const Entry *entry = &row[kPRSwitchCount];
+        if (IsSwitchType(event->type) && event->value < kPRSwitchCount && row[event->value].handler)
+            entry = &row[event->value];
+        if (!entry->handler)
+            return false;
+        entry->handler(entry->context, event);
+        return true;
+    }
+
+protected:
+    static bool IsSwitchType(PREventType type)
+    {
+        return (type >= kPREventTypeSwitchClosedDebounced && type <= kPREventTypeSwitchOpenNondebounced) ||
+               type == kPREventTypeBurstSwitchOpen || type == kPREventTypeBurstSwitchClosed;
+    }
+
+    struct Entry {
+        PREventHandler handler;
+        void *context;
+    };
+
+    Entry entries[numEventHandlerTypes][kPRSwitchCount + 1];
+    std::atomic<int> numHandlers;
+    std::recursive_mutex mutex;
+};
+
+#endif	/* PINPROC_PREVENTHANDLERS_H */
@@ -0,0 +1,201 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PREventRing.h
+ *  libpinproc
+ */
+#ifndef PINPROC_PREVENTRING_H
+#define PINPROC_PREVENTRING_H
+#if !defined(__GNUC__) || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4) || (__GNUC__ >= 4)	// GCC supports "pragma once" correctly since 3.4
+#pragma once
+#endif
+
+#include "pinproc.h"
+#include <stddef.h>
+#include <atomic>
+
+#define defaultRingEvents (4096)
+
+/**
+ * Fixed size, lock-free queue.  Safe for exactly one producer thread (the device's event
+ * thread) and one consumer thread (the caller of PRGetEvents()).  head is only written by
+ * the producer.  tail is normally only advanced by the consumer, but the producer may also
+ * advance it to drop the oldest items when the ring is full, so both sides advance it with
+ * a compare-and-swap.  The consumer copies items out before swapping; if the swap fails the
+ * producer may have overwritten what it copied, and it starts over from the new tail.
+ */
+template <class Item>
+class PRRing
+{
+public:
+    PRRing(uint32_t minCapacity) : items(NULL), capacity(0), head(0), tail(0) { Allocate(minCapacity); }
+    ~PRRing() { delete[] items; }
+
+    /** Sets the capacity, rounded up to a power of two, and empties the ring.  Only safe while neither side is running. */
+    void Allocate(uint32_t minCapacity)
+    {
+        uint32_t newCapacity = 16;
+        while (newCapacity < minCapacity && newCapacity < 0x80000000)
+            newCapacity <<= 1;
+        if (newCapacity != capacity)
+        {
+            delete[] items;
+            items = new Item[newCapacity];
+            capacity = newCapacity;
+        }
+        Clear();
+    }
+
+    uint32_t Capacity() const { return capacity; }
+
+    /**
+     * Producer side.  Returns the free slots that follow each other in memory from the head,
+     * storing their number in *count (possibly 0).  Publish what was filled with Commit().
+     */
+    Item *WriteSpan(uint32_t *count)
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        uint32_t numFree = capacity - (h - tail.load(std::memory_order_acquire));
+        uint32_t toEnd = capacity - (h & (capacity - 1));
+        *count = numFree < toEnd ? numFree : toEnd;
+        return &items[h & (capacity - 1)];
+    }
+
+    void Commit(uint32_t count)
+    {
+        head.store(head.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+    /** Producer side.  Queues one item, first dropping the oldest if the ring is full.  Returns false if it had to. */
+    bool PushDroppingOldest(const Item &item)
+    {
+        uint32_t numFree;
+        Item *slot = WriteSpan(&numFree);
+        bool dropped = numFree == 0;
+        if (dropped)
+        {
+            DropOldest(1);
+            slot = WriteSpan(&numFree);
+        }
+        *slot = item;
+        Commit(1);
+        return !dropped;
+    }
+
+    /** Producer side.  Discards up to count of the oldest items and returns the number discarded. */
+    uint32_t DropOldest(uint32_t count)
+    {
+        uint32_t t = tail.load(std::memory_order_acquire);
+        while (true)
+        {
+            uint32_t available = head.load(std::memory_order_relaxed) - t;
+            uint32_t n = count < available ? count : available;
+            if (tail.compare_exchange_weak(t, t + n, std::memory_order_acq_rel))
+                return n;
+        }
+    }
+
+    /** Producer side.  Position the next committed item will have. */
+    uint32_t Head() const { return head.load(std::memory_order_relaxed); }
+
+    /** Producer side.  True if the item at position (from Head()) hasn't been popped or dropped yet. */
+    bool IsQueued(uint32_t position) const
+    {
+        return (int32_t)(position - tail.load(std::memory_order_acquire)) >= 0;
+    }
+
+    /** Consumer side.  Copies out up to maxItems items and returns the number copied. */
+    int Pop(Item *itemsOut, int maxItems)
+    {
+        return PopWith(maxItems, [itemsOut](int i, const Item &item) { itemsOut[i] = item; });
+    }
+
+    uint32_t Size() const
+    {
+        uint32_t t = tail.load(std::memory_order_acquire); // First, so it can't pass the head read after it.
+        return head.load(std::memory_order_acquire) - t;
+    }
+
+    /** Only safe while neither side is running. */
+    void Clear()
+    {
+        head.store(0);
+        tail.store(0);
+    }
+
+protected:
+    /** Consumer side.  Calls copy(i, item) for up to maxItems items, then takes them off the ring. */
+    template <class Copy>
+    int PopWith(int maxItems, Copy copy)
+    {
+        uint32_t t = tail.load(std::memory_order_acquire);
+        while (true)
+        {
+            uint32_t available = head.load(std::memory_order_acquire) - t;
+            int i;
+            for (i = 0; i < maxItems && (uint32_t)i < available; i++)
+                copy(i, items[(t + i) & (capacity - 1)]);
+            if (tail.compare_exchange_strong(t, t + i, std::memory_order_acq_rel))
+                return i;
+        }
+    }
+
+    Item *items;
+    uint32_t capacity;
+    std::atomic<uint32_t> head; /**< Next slot to be written by the producer. */
+    std::atomic<uint32_t> tail; /**< Next slot to be read by the consumer. */
+};
+
+/** The queue of decoded events read by PRGetEvents() and its variants. */
+class PREventRing : public PRRing<PREventEx>
+{
+public:
+    PREventRing() : PRRing<PREventEx>(defaultRingEvents) {}
+
+    using PRRing<PREventEx>::Pop;
+
+    /** Pop() without the extended times. */
+    int Pop(PREvent *eventsOut, int maxEvents)
+    {
+        return PopWith(maxEvents, [eventsOut](int i, const PREventEx &event) {
+            eventsOut[i].type = event.type;
+            eventsOut[i].value = event.value;
+            eventsOut[i].time = event.time;
+        });
+    }
+
+    /** Pop() into separate type, value and time arrays. */
+    int PopSoA(PREventType *types, uint32_t *values, uint32_t *times, int maxEvents)
+    {
+        return PopWith(maxEvents, [types, values, times](int i, const PREventEx &event) {
+            types[i] = event.type;
+            values[i] = event.value;
+            times[i] = event.time;
+        });
+    }
+};
+
+#endif	/* PINPROC_PREVENTRING_H */
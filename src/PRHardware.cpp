@@ -31,6 +31,8 @@
 #include <stdlib.h>
 #include "PRHardware.h"
 #include "PRCommon.h"
+#include "PRTransport.h"
+#include "PRByteOrder.h"
 
 bool_t IsStern (uint32_t hardware_data) {
 //    if ( ((hardware_data & P_ROC_BOARD_VERSION_MASK) >> P_ROC_BOARD_VERSION_SHIFT) == 0x1)
@@ -58,8 +60,8 @@ int32_t CreateManagerUpdateConfigBurst ( uint32_t * burst, PRManagerConfig *mana
     uint32_t addr;
 
     addr = P_ROC_REG_DIPSWITCH_ADDR;
-    burst[0] = CreateBurstCommand (P_ROC_MANAGER_SELECT, addr, 1 );
-    burst[1] = ( (manager_config->reuse_dmd_data_for_aux <<
+    burst[0] = PRWireWord(CreateBurstCommand (P_ROC_MANAGER_SELECT, addr, 1 ));
+    burst[1] = PRWireWord( (manager_config->reuse_dmd_data_for_aux <<
                         P_ROC_MANAGER_REUSE_DMD_DATA_FOR_AUX_SHIFT) |
                  (manager_config->invert_dipswitch_1 <<
                         P_ROC_MANAGER_INVERT_DIPSWITCH_1_SHIFT) );
@@ -73,8 +75,8 @@ int32_t CreateDriverUpdateGlobalConfigBurst ( uint32_t * burst, PRDriverGlobalCo
     addr = 0;
     addr = (P_ROC_DRIVER_CTRL_REG_DECODE << P_ROC_DRIVER_CTRL_DECODE_SHIFT);
 
-    burst[0] = CreateBurstCommand (P_ROC_BUS_DRIVER_CTRL_SELECT, addr, 1 );
-    burst[1] = ( (driver_globals->enableOutputs <<
+    burst[0] = PRWireWord(CreateBurstCommand (P_ROC_BUS_DRIVER_CTRL_SELECT, addr, 1 ));
+    burst[1] = PRWireWord( (driver_globals->enableOutputs <<
                   P_ROC_DRIVER_GLOBAL_ENABLE_DIRECT_OUTPUTS_SHIFT) |
                 (driver_globals->globalPolarity <<
                  P_ROC_DRIVER_GLOBAL_GLOBAL_POLARITY_SHIFT) |
@@ -105,8 +107,8 @@ int32_t CreateDriverUpdateGroupConfigBurst ( uint32_t * burst, PRDriverGroupConf
     addr = (P_ROC_DRIVER_CTRL_REG_DECODE << P_ROC_DRIVER_CTRL_DECODE_SHIFT) |
     driver_group->groupNum;
 
-    burst[0] = CreateBurstCommand (P_ROC_BUS_DRIVER_CTRL_SELECT, addr, 1 );
-    burst[1] = ( (driver_group->slowTime <<
+    burst[0] = PRWireWord(CreateBurstCommand (P_ROC_BUS_DRIVER_CTRL_SELECT, addr, 1 ));
+    burst[1] = PRWireWord( (driver_group->slowTime <<
                   P_ROC_DRIVER_GROUP_SLOW_TIME_SHIFT) |
                 (driver_group->disableStrobeAfter <<
                  P_ROC_DRIVER_GROUP_DISABLE_STROBE_AFTER_SHIFT) |
@@ -132,18 +134,18 @@ int32_t CreateDriverUpdateBurst ( uint32_t * burst, PRDriverState *driver) {
     addr = (P_ROC_DRIVER_CONFIG_TABLE_DECODE << P_ROC_DRIVER_CTRL_DECODE_SHIFT) |
     (driver->driverNum << P_ROC_DRIVER_CONFIG_TABLE_DRIVER_NUM_SHIFT);
 
-    burst[0] = CreateBurstCommand (P_ROC_BUS_DRIVER_CTRL_SELECT, addr, 2 );
-    burst[1] = ( (driver->outputDriveTime << P_ROC_DRIVER_CONFIG_OUTPUT_DRIVE_TIME_SHIFT) |
+    burst[0] = PRWireWord(CreateBurstCommand (P_ROC_BUS_DRIVER_CTRL_SELECT, addr, 2 ));
+    burst[1] = PRWireWord( (driver->outputDriveTime << P_ROC_DRIVER_CONFIG_OUTPUT_DRIVE_TIME_SHIFT) |
                 (driver->polarity << P_ROC_DRIVER_CONFIG_POLARITY_SHIFT) |
                 (driver->state << P_ROC_DRIVER_CONFIG_STATE_SHIFT) |
                 (1 << P_ROC_DRIVER_CONFIG_UPDATE_SHIFT) |
                 (driver->waitForFirstTimeSlot << P_ROC_DRIVER_CONFIG_WAIT_4_1ST_SLOT_SHIFT) |
                 (driver->timeslots << P_ROC_DRIVER_CONFIG_TIMESLOT_SHIFT) );
-    burst[2] = (driver->timeslots >> P_ROC_DRIVER_CONFIG_TIMESLOT_SHIFT) |
+    burst[2] = PRWireWord((driver->timeslots >> P_ROC_DRIVER_CONFIG_TIMESLOT_SHIFT) |
     (driver->patterOnTime << P_ROC_DRIVER_CONFIG_PATTER_ON_TIME_SHIFT) |
     (driver->patterOffTime << P_ROC_DRIVER_CONFIG_PATTER_OFF_TIME_SHIFT) |
     (driver->patterEnable << P_ROC_DRIVER_CONFIG_PATTER_ENABLE_SHIFT) |
-    (driver->futureEnable << P_ROC_DRIVER_CONFIG_FUTURE_ENABLE_SHIFT);
+    (driver->futureEnable << P_ROC_DRIVER_CONFIG_FUTURE_ENABLE_SHIFT));
     return kPRSuccess;
 }
 
@@ -191,8 +193,8 @@ int32_t CreateWatchdogConfigBurst ( uint32_t * burst, bool_t watchdogExpired,
     uint32_t addr;
 
     addr = P_ROC_REG_WATCHDOG_ADDR;
-    burst[0] = CreateBurstCommand (P_ROC_MANAGER_SELECT, addr, 1 );
-    burst[1] = ( (watchdogExpired << P_ROC_MANAGER_WATCHDOG_EXPIRED_SHIFT) |
+    burst[0] = PRWireWord(CreateBurstCommand (P_ROC_MANAGER_SELECT, addr, 1 ));
+    burst[1] = PRWireWord( (watchdogExpired << P_ROC_MANAGER_WATCHDOG_EXPIRED_SHIFT) |
                 (watchdogEnable << P_ROC_MANAGER_WATCHDOG_ENABLE_SHIFT) |
                 (watchdogResetTime << P_ROC_MANAGER_WATCHDOG_RESET_TIME_SHIFT) );
 
@@ -204,8 +206,8 @@ int32_t CreateSwitchUpdateConfigBurst ( uint32_t * burst, PRSwitchConfig *switch
     uint32_t addr;
 
     addr = 0;
-    burst[0] = CreateBurstCommand (P_ROC_BUS_SWITCH_CTRL_SELECT, addr, 1 );
-    burst[1] = (switchConfig->clear << P_ROC_SWITCH_CONFIG_CLEAR_SHIFT) |
+    burst[0] = PRWireWord(CreateBurstCommand (P_ROC_BUS_SWITCH_CTRL_SELECT, addr, 1 ));
+    burst[1] = PRWireWord((switchConfig->clear << P_ROC_SWITCH_CONFIG_CLEAR_SHIFT) |
                (switchConfig->directMatrixScanLoopTime <<
                    P_ROC_SWITCH_CONFIG_MS_PER_DM_SCAN_LOOP_SHIFT) |
                (switchConfig->pulsesBeforeCheckingRX <<
@@ -219,10 +221,10 @@ int32_t CreateSwitchUpdateConfigBurst ( uint32_t * burst, PRSwitchConfig *switch
                (switchConfig->use_column_8 <<
                    P_ROC_SWITCH_CONFIG_USE_COLUMN_8) |
                (switchConfig->use_column_9 <<
-                   P_ROC_SWITCH_CONFIG_USE_COLUMN_9);
-    burst[2] = CreateBurstCommand (P_ROC_BUS_STATE_CHANGE_PROC_SELECT,
-                                   P_ROC_STATE_CHANGE_CONFIG_ADDR, 1 );
-    burst[3] = switchConfig->hostEventsEnable;
+                   P_ROC_SWITCH_CONFIG_USE_COLUMN_9));
+    burst[2] = PRWireWord(CreateBurstCommand (P_ROC_BUS_STATE_CHANGE_PROC_SELECT,
+                                   P_ROC_STATE_CHANGE_CONFIG_ADDR, 1 ));
+    burst[3] = PRWireWord(switchConfig->hostEventsEnable);
 
     return kPRSuccess;
 }
@@ -264,16 +266,16 @@ int32_t CreateSwitchUpdateRulesBurst ( uint32_t * burst, PRSwitchRuleInternal *r
 
     CreateDriverUpdateBurst ( driver_command, &(rule_record->driver));
 
-    burst[0] = CreateBurstCommand (P_ROC_BUS_STATE_CHANGE_PROC_SELECT, addr, 3 );
+    burst[0] = PRWireWord(CreateBurstCommand (P_ROC_BUS_STATE_CHANGE_PROC_SELECT, addr, 3 ));
     burst[1] = driver_command[1];
     burst[2] = driver_command[2];
 
-    burst[3] = (rule_record->changeOutput << P_ROC_SWITCH_RULE_CHANGE_OUTPUT_SHIFT) |
+    burst[3] = PRWireWord((rule_record->changeOutput << P_ROC_SWITCH_RULE_CHANGE_OUTPUT_SHIFT) |
     (rule_record->driver.driverNum << P_ROC_SWITCH_RULE_DRIVER_NUM_SHIFT) |
     (rule_record->linkActive << P_ROC_SWITCH_RULE_LINK_ACTIVE_SHIFT) |
     (rule_record->linkIndex << P_ROC_SWITCH_RULE_LINK_ADDRESS_SHIFT) |
     (rule_record->notifyHost << P_ROC_SWITCH_RULE_NOTIFY_HOST_SHIFT) |
-    (rule_record->reloadActive << P_ROC_SWITCH_RULE_RELOAD_ACTIVE_SHIFT);
+    (rule_record->reloadActive << P_ROC_SWITCH_RULE_RELOAD_ACTIVE_SHIFT));
     return kPRSuccess;
 
 }
@@ -284,31 +286,31 @@ int32_t CreateDMDUpdateConfigBurst ( uint32_t * burst, PRDMDConfig *dmd_config)
     uint32_t i;
 
     addr = 0;
-    burst[0] = CreateBurstCommand (P_ROC_BUS_DMD_SELECT, addr, 1 );
-    burst[1] = (1 << P_ROC_DMD_ENABLE_SHIFT) |
+    burst[0] = PRWireWord(CreateBurstCommand (P_ROC_BUS_DMD_SELECT, addr, 1 ));
+    burst[1] = PRWireWord((1 << P_ROC_DMD_ENABLE_SHIFT) |
                (dmd_config->enableFrameEvents << P_ROC_DMD_ENABLE_FRAME_EVENTS_SHIFT) |
                (dmd_config->autoIncBufferWrPtr << P_ROC_DMD_AUTO_INC_WR_POINTER_SHIFT) |
                (dmd_config->numFrameBuffers << P_ROC_DMD_NUM_FRAME_BUFFERS_SHIFT) |
                (dmd_config->numSubFrames << P_ROC_DMD_NUM_SUB_FRAMES_SHIFT) |
                (dmd_config->numRows << P_ROC_DMD_NUM_ROWS_SHIFT) |
-               (dmd_config->numColumns << P_ROC_DMD_NUM_COLUMNS_SHIFT);
+               (dmd_config->numColumns << P_ROC_DMD_NUM_COLUMNS_SHIFT));
 
     addr = 8;
-    burst[2] = CreateBurstCommand (P_ROC_BUS_DMD_SELECT, addr, 4 );
+    burst[2] = PRWireWord(CreateBurstCommand (P_ROC_BUS_DMD_SELECT, addr, 4 ));
 
     for (i=0; i<4; i++) {
-        burst[i+3] = (dmd_config->rclkLowCycles[i] << P_ROC_DMD_RCLK_LOW_CYCLES_SHIFT) |
+        burst[i+3] = PRWireWord((dmd_config->rclkLowCycles[i] << P_ROC_DMD_RCLK_LOW_CYCLES_SHIFT) |
         (dmd_config->latchHighCycles[i] << P_ROC_DMD_LATCH_HIGH_CYCLES_SHIFT) |
         (dmd_config->deHighCycles[i] << P_ROC_DMD_DE_HIGH_CYCLES_SHIFT) |
-        (dmd_config->dotclkHalfPeriod[i] << P_ROC_DMD_DOTCLK_HALF_PERIOD_SHIFT);
+        (dmd_config->dotclkHalfPeriod[i] << P_ROC_DMD_DOTCLK_HALF_PERIOD_SHIFT));
     }
     return kPRSuccess;
 }
 
 int32_t CreateJTAGForceOutputsBurst ( uint32_t * burst, PRJTAGOutputs *jtagOutputs) {
-    burst[0] = CreateBurstCommand (P_ROC_BUS_JTAG_SELECT, P_ROC_JTAG_COMMAND_REG_BASE_ADDR, 1 );
+    burst[0] = PRWireWord(CreateBurstCommand (P_ROC_BUS_JTAG_SELECT, P_ROC_JTAG_COMMAND_REG_BASE_ADDR, 1 ));
     burst[1] = 0;
-    burst[1] = 1 << P_ROC_JTAG_CMD_START_SHIFT |
+    burst[1] = PRWireWord(1 << P_ROC_JTAG_CMD_START_SHIFT |
                1 << P_ROC_JTAG_CMD_OE_SHIFT |
                P_ROC_JTAG_CMD_SET_PORTS << P_ROC_JTAG_CMD_CMD_SHIFT |
                jtagOutputs->tckMask << P_ROC_JTAG_TRANSITION_TCK_MASK_SHIFT |
@@ -316,41 +318,41 @@ int32_t CreateJTAGForceOutputsBurst ( uint32_t * burst, PRJTAGOutputs *jtagOutpu
                jtagOutputs->tmsMask << P_ROC_JTAG_TRANSITION_TMS_MASK_SHIFT |
                jtagOutputs->tck << P_ROC_JTAG_TRANSITION_TCK_SHIFT |
                jtagOutputs->tdo << P_ROC_JTAG_TRANSITION_TCK_SHIFT |
-               jtagOutputs->tms << P_ROC_JTAG_TRANSITION_TCK_SHIFT;
+               jtagOutputs->tms << P_ROC_JTAG_TRANSITION_TCK_SHIFT);
     return kPRSuccess;
 
 }
 int32_t CreateJTAGLatchOutputsBurst ( uint32_t * burst, PRJTAGOutputs *jtagOutputs) {
-    burst[0] = CreateBurstCommand (P_ROC_BUS_JTAG_SELECT, P_ROC_JTAG_COMMAND_REG_BASE_ADDR, 1 );
+    burst[0] = PRWireWord(CreateBurstCommand (P_ROC_BUS_JTAG_SELECT, P_ROC_JTAG_COMMAND_REG_BASE_ADDR, 1 ));
     burst[1] = 0;
-    burst[1] = 1 << P_ROC_JTAG_CMD_START_SHIFT |
+    burst[1] = PRWireWord(1 << P_ROC_JTAG_CMD_START_SHIFT |
                1 << P_ROC_JTAG_CMD_OE_SHIFT |
                P_ROC_JTAG_CMD_TRANSITION << P_ROC_JTAG_CMD_CMD_SHIFT |
                jtagOutputs->tdoMask << P_ROC_JTAG_TRANSITION_TDO_MASK_SHIFT |
                jtagOutputs->tmsMask << P_ROC_JTAG_TRANSITION_TMS_MASK_SHIFT |
                jtagOutputs->tdo << P_ROC_JTAG_TRANSITION_TCK_SHIFT |
-               jtagOutputs->tms << P_ROC_JTAG_TRANSITION_TMS_SHIFT;
+               jtagOutputs->tms << P_ROC_JTAG_TRANSITION_TMS_SHIFT);
     return kPRSuccess;
 
 }
 int32_t CreateJTAGShiftTDODataBurst ( uint32_t * burst, uint16_t numBits, bool_t dataBlockComplete) {
-    burst[0] = CreateBurstCommand (P_ROC_BUS_JTAG_SELECT, P_ROC_JTAG_COMMAND_REG_BASE_ADDR, 1 );
+    burst[0] = PRWireWord(CreateBurstCommand (P_ROC_BUS_JTAG_SELECT, P_ROC_JTAG_COMMAND_REG_BASE_ADDR, 1 ));
     burst[1] = 0;
-    burst[1] = 1 << P_ROC_JTAG_CMD_START_SHIFT |
+    burst[1] = PRWireWord(1 << P_ROC_JTAG_CMD_START_SHIFT |
                1 << P_ROC_JTAG_CMD_OE_SHIFT |
                P_ROC_JTAG_CMD_SHIFT << P_ROC_JTAG_CMD_CMD_SHIFT |
                dataBlockComplete << P_ROC_JTAG_SHIFT_EXIT_SHIFT |
-               numBits << P_ROC_JTAG_SHIFT_NUM_BITS_SHIFT;
+               numBits << P_ROC_JTAG_SHIFT_NUM_BITS_SHIFT);
     return kPRSuccess;
 }
 
 void FillPDBCommand(uint8_t command, uint8_t boardAddr, PRLEDRegisterType reg, uint8_t data, uint32_t * buffer)
 {
-    buffer[0] = CreateBurstCommand (P_ROC_BUS_DRIVER_CTRL_SELECT, P_ROC_DRIVER_PDB_ADDR, 1 );
-    buffer[1] = (command << P_ROC_DRIVER_PDB_COMMAND_SHIFT) |
+    buffer[0] = PRWireWord(CreateBurstCommand (P_ROC_BUS_DRIVER_CTRL_SELECT, P_ROC_DRIVER_PDB_ADDR, 1 ));
+    buffer[1] = PRWireWord((command << P_ROC_DRIVER_PDB_COMMAND_SHIFT) |
                 (boardAddr << P_ROC_DRIVER_PDB_BOARD_ADDR_SHIFT) |
                 (reg << P_ROC_DRIVER_PDB_REGISTER_SHIFT) |
-                (data << P_ROC_DRIVER_PDB_DATA_SHIFT);
+                (data << P_ROC_DRIVER_PDB_DATA_SHIFT));
 }
 
 
@@ -362,27 +364,68 @@ void FillPDBCommand(uint8_t command, uint8_t boardAddr, PRLEDRegisterType reg, u
 
 #if defined(__WIN32__) || defined(_WIN32)
 #include "ftd2xx.h"
+#include <string.h>
 
-#define BUF_SIZE 16
-#define MAX_DEVICES 1
+#define MAX_DEVICES 16
 
-// Globals
-static FT_HANDLE ftHandles[MAX_DEVICES];
-static FT_HANDLE ftHandle;
+/** Connection to one P-ROC. */
+struct PRHardwareState {
+    FT_HANDLE ftHandle;
+    PRLinkParams linkParams; /**< Settings currently in effect. */
+};
 
-PRResult PRHardwareOpen()
+static PRResult ApplyLinkParams(PRHardwareState *hw, const PRLinkParams *params)
+{
+    FT_STATUS ftStatus;
+
+    if (PRCheckLinkParams(params) != kPRSuccess)
+        return kPRFailure;
+
+    if (params->baudRate != 0)
+    {
+        if ((ftStatus = FT_SetBaudRate(hw->ftHandle, params->baudRate)) != FT_OK)
+        {
+            PRSetLastErrorText("Error FT_SetBaudRate(%d)", ftStatus);
+            return kPRFailure;
+        }
+        hw->linkParams.baudRate = params->baudRate;
+    }
+    if (params->latencyTimer != 0)
+    {
+        if ((ftStatus = FT_SetLatencyTimer(hw->ftHandle, (UCHAR)params->latencyTimer)) != FT_OK)
+        {
+            PRSetLastErrorText("Error FT_SetLatencyTimer(%d)", ftStatus);
+            return kPRFailure;
+        }
+        hw->linkParams.latencyTimer = params->latencyTimer;
+    }
+    if (params->readChunkSize != 0 || params->writeChunkSize != 0)
+    {
+        ULONG inSize = params->readChunkSize != 0 ? params->readChunkSize : hw->linkParams.readChunkSize;
+        ULONG outSize = params->writeChunkSize != 0 ? params->writeChunkSize : hw->linkParams.writeChunkSize;
+        if ((ftStatus = FT_SetUSBParameters(hw->ftHandle, inSize, outSize)) != FT_OK)
+        {
+            PRSetLastErrorText("Error FT_SetUSBParameters(%d)", ftStatus);
+            return kPRFailure;
+        }
+        hw->linkParams.readChunkSize = inSize;
+        hw->linkParams.writeChunkSize = outSize;
+    }
+    return kPRSuccess;
+}
+
+PRHardwareState *PRHardwareOpen(const PRCreateOptions *options)
 {
-    char 	cBufWrite[BUF_SIZE];
     char * 	pcBufLD[MAX_DEVICES + 1];
     char 	cBufLD[MAX_DEVICES][64];
     FT_STATUS	ftStatus;
+    FT_HANDLE	ftHandle;
     int	iNumDevs = 0;
-    int	i, j;
-    int	iDevicesOpen = 0;
+    int	i;
+    int	iSelected = -1;
 
     for(i = 0; i < MAX_DEVICES; i++) {
         pcBufLD[i] = cBufLD[i];
-        ftHandles[i] = NULL;
     }
     pcBufLD[MAX_DEVICES] = NULL;
 
@@ -391,78 +434,81 @@ PRResult PRHardwareOpen()
     if(ftStatus != FT_OK) {
         PRSetLastErrorText("FT_ListDevices(%d)\n", ftStatus);
         DEBUG(PRLog(kPRLogInfo,"Error: FT_ListDevices(%d)\n", ftStatus));
-        return kPRFailure;
-    }
-
-    for(j = 0; j < BUF_SIZE; j++) {
-        cBufWrite[j] = j;
+        return NULL;
     }
 
+    // Pick the board asked for by serial number, or else by its position in the list.
     for(i = 0; ( (i <MAX_DEVICES) && (i < iNumDevs) ); i++) {
         DEBUG(PRLog(kPRLogInfo,"Device %d Serial Number - %s\n", i, cBufLD[i]));
+        if (iSelected < 0 &&
+            (options->serialNumber[0] != '\0' ? strcmp(options->serialNumber, cBufLD[i]) == 0
+                                              : i == options->deviceIndex))
+            iSelected = i;
     }
 
-    for(i = 0; ( (i <MAX_DEVICES) && (i < iNumDevs) ) ; i++) {
-        /* Setup */
-        if((ftStatus = FT_OpenEx(cBufLD[i], FT_OPEN_BY_SERIAL_NUMBER, &ftHandles[i])) != FT_OK){
-            /*
-                This can fail if the ftdi_sio driver is loaded
-                use lsmod to check this and rmmod ftdi_sio to remove
-                also rmmod usbserial
-            */
-            DEBUG(PRLog(kPRLogInfo,"Error FT_OpenEx(%d), device\n", ftStatus, i));
-            PRSetLastErrorText("Error FT_OpenEx(%d), device\n", ftStatus, i);
-            return kPRFailure;
-        }
-
-        DEBUG(PRLog(kPRLogInfo,"Opened device %s\n", cBufLD[i]));
-        ftHandle = ftHandles[i];
-
-        if((ftStatus = FT_SetBaudRate(ftHandles[i], 1228800)) != FT_OK) {
-            DEBUG(PRLog(kPRLogInfo,"Error FT_SetBaudRate(%d), cBufLD[i] = %s\n", ftStatus, cBufLD[i]));
-        }
-
-        iDevicesOpen++;
+    if (iSelected < 0)
+    {
+        if (options->serialNumber[0] != '\0')
+            PRSetLastErrorText("No FTDI device with serial number %s found.", options->serialNumber);
+        else
+            PRSetLastErrorText("FTDI device #%d not found; %d devices present.", options->deviceIndex, iNumDevs);
+        return NULL;
     }
 
-    if (iDevicesOpen > 0)
-    {
-      FT_ResetDevice(ftHandle);
-      DEBUG(PRLog(kPRLogInfo,"FTDI Device Opened\n"));
-      return kPRSuccess;
+    /* Setup */
+    if((ftStatus = FT_OpenEx(cBufLD[iSelected], FT_OPEN_BY_SERIAL_NUMBER, &ftHandle)) != FT_OK){
+        /*
+            This can fail if the ftdi_sio driver is loaded
+            use lsmod to check this and rmmod ftdi_sio to remove
+            also rmmod usbserial
+        */
+        DEBUG(PRLog(kPRLogInfo,"Error FT_OpenEx(%d), device %d\n", ftStatus, iSelected));
+        PRSetLastErrorText("Error FT_OpenEx(%d), device %d\n", ftStatus, iSelected);
+        return NULL;
     }
-    else
-    {
-        PRSetLastErrorText("No FTDI device found.");
-        return kPRFailure;
+
+    DEBUG(PRLog(kPRLogInfo,"Opened device %s\n", cBufLD[iSelected]));
+
+    PRHardwareState *hw = new PRHardwareState;
+    hw->ftHandle = ftHandle;
+    // The driver's defaults; the baud rate isn't known until it is set.
+    hw->linkParams.latencyTimer = 16;
+    hw->linkParams.readChunkSize = 4096;
+    hw->linkParams.writeChunkSize = 4096;
+    hw->linkParams.baudRate = 0;
+    if (ApplyLinkParams(hw, &options->linkParams) != kPRSuccess) {
+        DEBUG(PRLog(kPRLogInfo,"Error applying link settings to %s: %s\n", cBufLD[iSelected], PRGetLastErrorText()));
     }
+
+    // D2xx already queues transfers internally, so asyncTransfers has no effect here.
+    if (options->asyncTransfers)
+        DEBUG(PRLog(kPRLogInfo,"Asynchronous transfers are not supported by the D2xx driver; using blocking I/O.\n"));
+    FT_ResetDevice(ftHandle);
+    DEBUG(PRLog(kPRLogInfo,"FTDI Device Opened\n"));
+    return hw;
 }
 
-void PRHardwareClose()
+void PRHardwareClose(PRHardwareState *hw)
 {
-    int i;
-
-    for(i = 0; i < MAX_DEVICES; i++) {
-        if(ftHandles[i] != NULL) {
-            FT_Close(ftHandles[i]);
-            ftHandles[i] = NULL;
-            DEBUG(PRLog(kPRLogInfo,"Closed device\n"));
-        }
-    }
+    if (hw == NULL)
+        return;
+    FT_Close(hw->ftHandle);
+    DEBUG(PRLog(kPRLogInfo,"Closed device\n"));
+    delete hw;
 }
 
-int PRHardwareRead(uint8_t *buffer, int maxBytes)
+int PRHardwareRead(PRHardwareState *hw, uint8_t *buffer, int maxBytes)
 {
     FT_STATUS ftStatus;
     DWORD bytesToRead;
     DWORD bytesRead;
     int i;
 
-    ftStatus = FT_GetQueueStatus(ftHandle,&bytesToRead);
+    ftStatus = FT_GetQueueStatus(hw->ftHandle,&bytesToRead);
     if (ftStatus != FT_OK) return 0;
 
     if ((DWORD)maxBytes < bytesToRead) bytesToRead = maxBytes;
-    ftStatus = FT_Read(ftHandle, buffer, bytesToRead, &bytesRead);
+    ftStatus = FT_Read(hw->ftHandle, buffer, bytesToRead, &bytesRead);
     if (ftStatus == FT_OK) {
         DEBUG(PRLog(kPRLogVerbose,"Read %d bytes:\n",bytesRead));
         for (i=0; (DWORD)i<bytesRead; i++) {
@@ -473,14 +519,19 @@ int PRHardwareRead(uint8_t *buffer, int maxBytes)
     else return 0;
 }
 
-int PRHardwareWrite(uint8_t *buffer, int bytes)
+PRResult PRHardwareSetLinkParams(PRHardwareState *hw, const PRLinkParams *params)
+{
+    return ApplyLinkParams(hw, params);
+}
+
+int PRHardwareWrite(PRHardwareState *hw, uint8_t *buffer, int bytes)
 {
     FT_STATUS ftStatus=0;
     DWORD bytesWritten=0;
     int i;
 
     DEBUG(PRLog(kPRLogVerbose,"Writing %d bytes:\n",bytes));
-    ftStatus = FT_Write(ftHandle, buffer, (DWORD)bytes, &bytesWritten);
+    ftStatus = FT_Write(hw->ftHandle, buffer, (DWORD)bytes, &bytesWritten);
     if (ftStatus == FT_OK)
     {
         DEBUG(PRLog(kPRLogVerbose,"Wrote %d bytes:\n",bytesWritten));
@@ -498,54 +549,443 @@ int PRHardwareWrite(uint8_t *buffer, int bytes)
 #else // WIN32
 
 #include <libftdi1/ftdi.h>
+#include <string.h>
+#include <mutex>
+
+/**
+ * Asynchronous transfer engine.
+ * Instead of one blocking ftdi_read_data()/ftdi_write_data() call at a time, several
+ * libusb bulk transfers are kept queued on each endpoint.  Completed reads are stripped
+ * of the FTDI modem status bytes and staged in asyncRxFifo until PRHardwareRead() collects
+ * them.  Completions are reaped without blocking whenever PRHardwareRead() or
+ * PRHardwareWrite() is called.  Those may run on different threads (see the event
+ * thread in PRDevice), so the engine state is guarded by asyncMutex.  libusb may
+ * deliver a callback on either thread; the mutex is never held while handling events.
+ */
+const int32_t ASYNC_READ_TRANSFERS = 4;
+const int32_t ASYNC_WRITE_TRANSFERS = 4;
+const int32_t ASYNC_READ_SIZE = 4096;  // Default transfer sizes; see PRLinkParams.
+const int32_t ASYNC_WRITE_SIZE = 16384;
+const int32_t ASYNC_MAX_TRANSFER_SIZE = 16384; // Transfer buffers are this big so the sizes can change while open.
+const int32_t ASYNC_RX_FIFO_SIZE = ASYNC_MAX_TRANSFER_SIZE * (ASYNC_READ_TRANSFERS + 1) * 2;
+const int32_t ASYNC_WRITE_WAIT_MS = 10;
+const int32_t ASYNC_CLOSE_WAIT_LOOPS = 100;
+
+typedef struct PRAsyncTransfer {
+    PRHardwareState *hw;
+    struct libusb_transfer *transfer;
+    uint8_t *buffer;
+    bool busy;
+} PRAsyncTransfer;
+
+/**
+ * Connection to one P-ROC.  Each has its own ftdi_context, and with it its own libusb
+ * context, so boards opened by different PRDevices never share any I/O state.
+ */
+struct PRHardwareState {
+    ftdi_context ftdic;
+    bool ftdiInitialized;
+
+    std::mutex asyncMutex;
+    bool asyncEnabled;
+    bool asyncClosing;
+    int asyncError;
+    int32_t asyncReadSize;
+    int32_t asyncWriteSize;
+    PRAsyncTransfer asyncReads[ASYNC_READ_TRANSFERS];
+    PRAsyncTransfer asyncWrites[ASYNC_WRITE_TRANSFERS];
+    uint8_t asyncRxFifo[ASYNC_RX_FIFO_SIZE];
+    int32_t asyncRxRdAddr;
+    int32_t asyncRxWrAddr;
+    int32_t asyncRxCount;
+};
+
+static void AsyncRxPush(PRHardwareState *hw, const uint8_t *data, int32_t numBytes)
+{
+    // Space was reserved for the worst case before the transfer was submitted.
+    int32_t firstPart = ASYNC_RX_FIFO_SIZE - hw->asyncRxWrAddr;
+    if (firstPart > numBytes) firstPart = numBytes;
+    memcpy(hw->asyncRxFifo + hw->asyncRxWrAddr, data, firstPart);
+    memcpy(hw->asyncRxFifo, data + firstPart, numBytes - firstPart);
+    hw->asyncRxWrAddr = (hw->asyncRxWrAddr + numBytes) % ASYNC_RX_FIFO_SIZE;
+    hw->asyncRxCount += numBytes;
+}
+
+static int32_t AsyncRxPop(PRHardwareState *hw, uint8_t *data, int32_t maxBytes)
+{
+    int32_t numBytes = hw->asyncRxCount < maxBytes ? hw->asyncRxCount : maxBytes;
+    int32_t firstPart = ASYNC_RX_FIFO_SIZE - hw->asyncRxRdAddr;
+    if (firstPart > numBytes) firstPart = numBytes;
+    memcpy(data, hw->asyncRxFifo + hw->asyncRxRdAddr, firstPart);
+    memcpy(data + firstPart, hw->asyncRxFifo, numBytes - firstPart);
+    hw->asyncRxRdAddr = (hw->asyncRxRdAddr + numBytes) % ASYNC_RX_FIFO_SIZE;
+    hw->asyncRxCount -= numBytes;
+    return numBytes;
+}
+
+static void AsyncSubmitReads(PRHardwareState *hw);
+
+static void LIBUSB_CALL AsyncReadCallback(struct libusb_transfer *transfer)
+{
+    PRAsyncTransfer *asyncTransfer = (PRAsyncTransfer *)transfer->user_data;
+    PRHardwareState *hw = asyncTransfer->hw;
+    std::lock_guard<std::mutex> lock(hw->asyncMutex);
+    asyncTransfer->busy = false;
+
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+    {
+        // Every packet starts with two FTDI modem status bytes which are not P-ROC data.
+        int32_t packetSize = hw->ftdic.max_packet_size;
+        for (int32_t offset = 0; offset < transfer->actual_length; offset += packetSize)
+        {
+            int32_t chunk = transfer->actual_length - offset;
+            if (chunk > packetSize) chunk = packetSize;
+            if (chunk > 2)
+                AsyncRxPush(hw, transfer->buffer + offset + 2, chunk - 2);
+        }
+        AsyncSubmitReads(hw);
+    }
+    else if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+    {
+        hw->asyncError = transfer->status;
+    }
+}
+
+static void LIBUSB_CALL AsyncWriteCallback(struct libusb_transfer *transfer)
+{
+    PRAsyncTransfer *asyncTransfer = (PRAsyncTransfer *)transfer->user_data;
+    PRHardwareState *hw = asyncTransfer->hw;
+    std::lock_guard<std::mutex> lock(hw->asyncMutex);
+    asyncTransfer->busy = false;
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_CANCELLED)
+        hw->asyncError = transfer->status;
+    else if (transfer->status == LIBUSB_TRANSFER_COMPLETED && transfer->actual_length != transfer->length)
+        hw->asyncError = LIBUSB_TRANSFER_ERROR;
+}
+
+// Caller must hold hw->asyncMutex.
+static void AsyncSubmitReads(PRHardwareState *hw)
+{
+    int32_t i, numBusy = 0;
+
+    if (hw->asyncClosing)
+        return;
+
+    for (i = 0; i < ASYNC_READ_TRANSFERS; i++)
+        if (hw->asyncReads[i].busy) numBusy++;
+
+    // Only queue another read if everything already in flight, plus this one, is
+    // guaranteed to fit in the staging FIFO.
+    for (i = 0; i < ASYNC_READ_TRANSFERS; i++)
+    {
+        PRAsyncTransfer *asyncTransfer = &hw->asyncReads[i];
+        if (asyncTransfer->busy)
+            continue;
+        if (ASYNC_RX_FIFO_SIZE - hw->asyncRxCount < ASYNC_MAX_TRANSFER_SIZE * (numBusy + 1))
+            break;
+
+        libusb_fill_bulk_transfer(asyncTransfer->transfer, hw->ftdic.usb_dev, hw->ftdic.out_ep,
+                                  asyncTransfer->buffer, hw->asyncReadSize, AsyncReadCallback,
+                                  asyncTransfer, 0);
+        if (libusb_submit_transfer(asyncTransfer->transfer) < 0)
+        {
+            hw->asyncError = LIBUSB_TRANSFER_ERROR;
+            break;
+        }
+        asyncTransfer->busy = true;
+        numBusy++;
+    }
+}
+
+static void AsyncHandleEvents(PRHardwareState *hw, int32_t timeoutMs)
+{
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = timeoutMs * 1000;
+    libusb_handle_events_timeout_completed(hw->ftdic.usb_ctx, &tv, NULL);
+}
+
+static bool AsyncAnyBusy(PRHardwareState *hw)
+{
+    std::lock_guard<std::mutex> lock(hw->asyncMutex);
+    int32_t i;
+    for (i = 0; i < ASYNC_READ_TRANSFERS; i++)
+        if (hw->asyncReads[i].busy) return true;
+    for (i = 0; i < ASYNC_WRITE_TRANSFERS; i++)
+        if (hw->asyncWrites[i].busy) return true;
+    return false;
+}
+
+static void AsyncFreeTransfers(PRAsyncTransfer *transfers, int32_t numTransfers)
+{
+    for (int32_t i = 0; i < numTransfers; i++)
+    {
+        if (transfers[i].transfer != NULL)
+            libusb_free_transfer(transfers[i].transfer);
+        free(transfers[i].buffer);
+        transfers[i].transfer = NULL;
+        transfers[i].buffer = NULL;
+        transfers[i].busy = false;
+    }
+}
+
+static void AsyncClose(PRHardwareState *hw)
+{
+    int32_t i;
+
+    if (!hw->asyncEnabled)
+        return;
 
-static bool ftdiInitialized;
-static ftdi_context ftdic;
+    {
+        std::lock_guard<std::mutex> lock(hw->asyncMutex);
+        hw->asyncClosing = true;
+        for (i = 0; i < ASYNC_READ_TRANSFERS; i++)
+            if (hw->asyncReads[i].busy) libusb_cancel_transfer(hw->asyncReads[i].transfer);
+        for (i = 0; i < ASYNC_WRITE_TRANSFERS; i++)
+            if (hw->asyncWrites[i].busy) libusb_cancel_transfer(hw->asyncWrites[i].transfer);
+    }
+
+    // Transfers may only be freed once libusb has delivered their completion.
+    for (i = 0; i < ASYNC_CLOSE_WAIT_LOOPS && AsyncAnyBusy(hw); i++)
+        AsyncHandleEvents(hw, ASYNC_WRITE_WAIT_MS);
+    if (AsyncAnyBusy(hw))
+    {
+        DEBUG(PRLog(kPRLogError, "Asynchronous transfers did not complete; leaking them.\n"));
+    }
+    else
+    {
+        AsyncFreeTransfers(hw->asyncReads, ASYNC_READ_TRANSFERS);
+        AsyncFreeTransfers(hw->asyncWrites, ASYNC_WRITE_TRANSFERS);
+    }
+    hw->asyncEnabled = false;
+}
+
+static PRResult AsyncOpen(PRHardwareState *hw)
+{
+    int32_t i;
+
+    hw->asyncClosing = false;
+    hw->asyncError = 0;
+    hw->asyncRxRdAddr = 0;
+    hw->asyncRxWrAddr = 0;
+    hw->asyncRxCount = 0;
+    memset(hw->asyncReads, 0x00, sizeof(hw->asyncReads));
+    memset(hw->asyncWrites, 0x00, sizeof(hw->asyncWrites));
+
+    bool allocated = true;
+    for (i = 0; i < ASYNC_READ_TRANSFERS; i++)
+    {
+        hw->asyncReads[i].hw = hw;
+        hw->asyncReads[i].transfer = libusb_alloc_transfer(0);
+        hw->asyncReads[i].buffer = (uint8_t *)malloc(ASYNC_MAX_TRANSFER_SIZE);
+        allocated = allocated && hw->asyncReads[i].transfer != NULL && hw->asyncReads[i].buffer != NULL;
+    }
+    for (i = 0; i < ASYNC_WRITE_TRANSFERS; i++)
+    {
+        hw->asyncWrites[i].hw = hw;
+        hw->asyncWrites[i].transfer = libusb_alloc_transfer(0);
+        hw->asyncWrites[i].buffer = (uint8_t *)malloc(ASYNC_MAX_TRANSFER_SIZE);
+        allocated = allocated && hw->asyncWrites[i].transfer != NULL && hw->asyncWrites[i].buffer != NULL;
+    }
+    if (!allocated)
+    {
+        AsyncFreeTransfers(hw->asyncReads, ASYNC_READ_TRANSFERS);
+        AsyncFreeTransfers(hw->asyncWrites, ASYNC_WRITE_TRANSFERS);
+        PRSetLastErrorText("Unable to allocate asynchronous USB transfers.");
+        return kPRFailure;
+    }
+
+    hw->asyncEnabled = true;
+    hw->asyncMutex.lock();
+    AsyncSubmitReads(hw);
+    hw->asyncMutex.unlock();
+    if (hw->asyncError != 0)
+    {
+        PRSetLastErrorText("Unable to submit asynchronous USB reads.");
+        AsyncClose(hw);
+        return kPRFailure;
+    }
+    DEBUG(PRLog(kPRLogInfo, "Using %d asynchronous read and %d write transfers\n", ASYNC_READ_TRANSFERS, ASYNC_WRITE_TRANSFERS));
+    return kPRSuccess;
+}
+
+static int AsyncRead(PRHardwareState *hw, uint8_t *buffer, int maxBytes)
+{
+    AsyncHandleEvents(hw, 0);
+
+    std::lock_guard<std::mutex> lock(hw->asyncMutex);
+    int numBytes = AsyncRxPop(hw, buffer, maxBytes);
+    // Draining the FIFO may have made room for reads that couldn't be queued before.
+    AsyncSubmitReads(hw);
+
+    if (hw->asyncError != 0)
+    {
+        PRSetLastErrorText("Asynchronous USB transfer failed: %d", hw->asyncError);
+        return -1;
+    }
+    return numBytes;
+}
+
+static int AsyncWrite(PRHardwareState *hw, uint8_t *buffer, int bytes)
+{
+    int32_t i, waitMs, offset = 0;
+
+    while (offset < bytes)
+    {
+        int32_t chunk = bytes - offset;
+        if (chunk > hw->asyncWriteSize) chunk = hw->asyncWriteSize;
+
+        // Find an idle transfer, reaping completions until one frees up.  Transfers on
+        // the same endpoint complete in submission order, so the stream stays ordered.
+        PRAsyncTransfer *asyncTransfer = NULL;
+        for (waitMs = 0; asyncTransfer == NULL && waitMs <= hw->ftdic.usb_write_timeout; waitMs += ASYNC_WRITE_WAIT_MS)
+        {
+            AsyncHandleEvents(hw, waitMs > 0 ? ASYNC_WRITE_WAIT_MS : 0);
+            hw->asyncMutex.lock();
+            for (i = 0; i < ASYNC_WRITE_TRANSFERS; i++)
+            {
+                if (!hw->asyncWrites[i].busy)
+                {
+                    asyncTransfer = &hw->asyncWrites[i];
+                    break;
+                }
+            }
+            if (asyncTransfer == NULL)
+                hw->asyncMutex.unlock();
+        }
+        if (asyncTransfer == NULL)
+        {
+            PRSetLastErrorText("Timed out waiting for an asynchronous USB write transfer.");
+            return offset;
+        }
+
+        // asyncMutex is held from here until the transfer is marked busy.
+        if (hw->asyncError != 0)
+        {
+            hw->asyncMutex.unlock();
+            PRSetLastErrorText("Asynchronous USB write failed: %d", hw->asyncError);
+            return offset;
+        }
+
+        memcpy(asyncTransfer->buffer, buffer + offset, chunk);
+        libusb_fill_bulk_transfer(asyncTransfer->transfer, hw->ftdic.usb_dev, hw->ftdic.in_ep,
+                                  asyncTransfer->buffer, chunk, AsyncWriteCallback,
+                                  asyncTransfer, hw->ftdic.usb_write_timeout);
+        if (libusb_submit_transfer(asyncTransfer->transfer) < 0)
+        {
+            hw->asyncMutex.unlock();
+            PRSetLastErrorText("Unable to submit asynchronous USB write.");
+            return offset;
+        }
+        asyncTransfer->busy = true;
+        hw->asyncMutex.unlock();
+        offset += chunk;
+    }
+    return offset;
+}
+
+static PRResult ApplyLinkParams(PRHardwareState *hw, const PRLinkParams *params)
+{
+    int rc;
 
+    if (PRCheckLinkParams(params) != kPRSuccess)
+        return kPRFailure;
 
-PRResult PRHardwareOpen()
+    // The FT245 is a FIFO, not a UART, so libftdi has no use for the baud rate.
+    if (params->latencyTimer != 0)
+    {
+        if ((rc = ftdi_set_latency_timer(&hw->ftdic, (unsigned char)params->latencyTimer)) < 0)
+        {
+            PRSetLastErrorText("ftdi_set_latency_timer failed: %d: %s", rc, ftdi_get_error_string(&hw->ftdic));
+            return kPRFailure;
+        }
+    }
+    if (params->readChunkSize != 0)
+    {
+        if ((rc = ftdi_read_data_set_chunksize(&hw->ftdic, params->readChunkSize)) < 0)
+        {
+            PRSetLastErrorText("ftdi_read_data_set_chunksize failed: %d: %s", rc, ftdi_get_error_string(&hw->ftdic));
+            return kPRFailure;
+        }
+    }
+    if (params->writeChunkSize != 0)
+    {
+        if ((rc = ftdi_write_data_set_chunksize(&hw->ftdic, params->writeChunkSize)) < 0)
+        {
+            PRSetLastErrorText("ftdi_write_data_set_chunksize failed: %d: %s", rc, ftdi_get_error_string(&hw->ftdic));
+            return kPRFailure;
+        }
+    }
+
+    // Queued transfers pick up the new sizes as they are resubmitted.
+    std::lock_guard<std::mutex> lock(hw->asyncMutex);
+    if (params->readChunkSize != 0)
+        hw->asyncReadSize = params->readChunkSize < ASYNC_MAX_TRANSFER_SIZE ? params->readChunkSize : ASYNC_MAX_TRANSFER_SIZE;
+    if (params->writeChunkSize != 0)
+        hw->asyncWriteSize = params->writeChunkSize < ASYNC_MAX_TRANSFER_SIZE ? params->writeChunkSize : ASYNC_MAX_TRANSFER_SIZE;
+    return kPRSuccess;
+}
+
+PRHardwareState *PRHardwareOpen(const PRCreateOptions *options)
 {
     int32_t i=0;
     PRResult rc;
     struct ftdi_device_list *devlist, *curdev;
-    char manufacturer[128], description[128];
+    char manufacturer[128], description[128], serial[128];
+    struct libusb_device *selected = NULL;
 
-    ftdiInitialized = false;
+    PRHardwareState *hw = new PRHardwareState;
+    hw->ftdiInitialized = false;
+    hw->asyncEnabled = false;
+    hw->asyncReadSize = ASYNC_READ_SIZE;
+    hw->asyncWriteSize = ASYNC_WRITE_SIZE;
 
     // Open the FTDI device
-    if (ftdi_init(&ftdic) != 0)
+    if (ftdi_init(&hw->ftdic) != 0)
     {
         PRSetLastErrorText("Failed to initialize FTDI.");
-        return kPRFailure;
+        delete hw;
+        return NULL;
     }
 
     // Find all FTDI devices
-    // This is very basic and really only expects to see 1 device.  It needs to be
-    // smarter.  At the very least, it should check some register on the P-ROC versus
+    // It should also check some register on the P-ROC versus
     // an input parameter to ensure the software is set up for the same architecture as
     // the P-ROC (Stern vs WPC).  Otherwise, it's possible to drive the coils the wrong
     // polarity and blow fuses or fry transistors and all other sorts of badness.
 
     // We first enumerate all of the devices:
-    int numDevices = ftdi_usb_find_all(&ftdic, &devlist, FTDI_VENDOR_ID, FTDI_FT245RL_PRODUCT_ID);
-    if (numDevices <=0) numDevices = ftdi_usb_find_all(&ftdic, &devlist, FTDI_VENDOR_ID, FTDI_FT240X_PRODUCT_ID);
+    int numDevices = ftdi_usb_find_all(&hw->ftdic, &devlist, FTDI_VENDOR_ID, FTDI_FT245RL_PRODUCT_ID);
+    if (numDevices <=0) numDevices = ftdi_usb_find_all(&hw->ftdic, &devlist, FTDI_VENDOR_ID, FTDI_FT240X_PRODUCT_ID);
     if (numDevices < 0) {
-        PRSetLastErrorText("ftdi_usb_find_all failed: %d: %s", numDevices, ftdi_get_error_string(&ftdic));
-        ftdi_deinit(&ftdic);
-        return kPRFailure;
+        PRSetLastErrorText("ftdi_usb_find_all failed: %d: %s", numDevices, ftdi_get_error_string(&hw->ftdic));
+        ftdi_deinit(&hw->ftdic);
+        delete hw;
+        return NULL;
     }
     else {
         DEBUG(PRLog(kPRLogInfo, "Number of FTDI devices found: %d\n", numDevices));
 
+        // Pick the board asked for by serial number, or else by its position in the list.
         for (curdev = devlist; curdev != NULL; i++) {
             DEBUG(PRLog(kPRLogInfo, "Checking device %d\n", i));
-            if ((rc = (int32_t)ftdi_usb_get_strings(&ftdic, curdev->dev, manufacturer, 128, description, 128, NULL, 0)) < 0) {
-                DEBUG(PRLog(kPRLogInfo, "  ftdi_usb_get_strings failed: %d: %s\n", rc, ftdi_get_error_string(&ftdic)));
+            serial[0] = '\0';
+            if ((rc = (int32_t)ftdi_usb_get_strings(&hw->ftdic, curdev->dev, manufacturer, 128, description, 128, serial, 128)) < 0) {
+                DEBUG(PRLog(kPRLogInfo, "  ftdi_usb_get_strings failed: %d: %s\n", rc, ftdi_get_error_string(&hw->ftdic)));
             }
             else {
                 DEBUG(PRLog(kPRLogInfo, "  Device #%d:\n", i));
                 DEBUG(PRLog(kPRLogInfo, "  Manufacturer: %s\n", manufacturer));
                 DEBUG(PRLog(kPRLogInfo, "  Description: %s\n", description));
+                DEBUG(PRLog(kPRLogInfo, "  Serial Number: %s\n", serial));
+            }
+            if (selected == NULL &&
+                (options->serialNumber[0] != '\0' ? strcmp(options->serialNumber, serial) == 0
+                                                  : i == options->deviceIndex))
+            {
+                selected = curdev->dev;
+                libusb_ref_device(selected);
             }
             curdev = curdev->next;
         }
@@ -555,49 +995,107 @@ PRResult PRHardwareOpen()
     // Don't need the device list anymore
     ftdi_list_free (&devlist);
 
-    if (((rc = (int32_t)ftdi_usb_open(&ftdic, FTDI_VENDOR_ID, FTDI_FT245RL_PRODUCT_ID)) < 0) && ((rc = (int32_t)ftdi_usb_open(&ftdic, FTDI_VENDOR_ID, FTDI_FT240X_PRODUCT_ID)) < 0))
+    if (selected == NULL)
     {
-        PRSetLastErrorText("Unable to open ftdi device: %d: %s", rc, ftdi_get_error_string(&ftdic));
-        return kPRFailure;
+        if (options->serialNumber[0] != '\0')
+            PRSetLastErrorText("No FTDI device with serial number %s found.", options->serialNumber);
+        else
+            PRSetLastErrorText("FTDI device #%d not found; %d devices present.", options->deviceIndex, numDevices);
+        ftdi_deinit(&hw->ftdic);
+        delete hw;
+        return NULL;
+    }
+
+    rc = (int32_t)ftdi_usb_open_dev(&hw->ftdic, selected);
+    libusb_unref_device(selected);
+    if (rc < 0)
+    {
+        PRSetLastErrorText("Unable to open ftdi device: %d: %s", rc, ftdi_get_error_string(&hw->ftdic));
+        ftdi_deinit(&hw->ftdic);
+        delete hw;
+        return NULL;
     }
     else
     {
-        rc = kPRSuccess;
-        //if (ftdic.type == TYPE_R) {
+        //if (hw->ftdic.type == TYPE_R) {
         if (1) {
             uint32_t chipid;
-            ftdi_read_chipid(&ftdic,&chipid);
+            ftdi_read_chipid(&hw->ftdic,&chipid);
             DEBUG(PRLog(kPRLogInfo, "FTDI chip_id = 0x%x\n", chipid));
-            // Set some defaults:
-            ftdi_read_data_set_chunksize(&ftdic, 4096);
-            ftdi_set_latency_timer(&ftdic, 2); // This helps make reads much faster.  16 appeared to be the default.
-            ftdiInitialized = true;
-            return kPRSuccess;
+            if (ApplyLinkParams(hw, &options->linkParams) != kPRSuccess)
+                DEBUG(PRLog(kPRLogInfo, "Error applying link settings: %s\n", PRGetLastErrorText()));
+            hw->ftdiInitialized = true;
+            if (options->asyncTransfers && AsyncOpen(hw) != kPRSuccess)
+            {
+                PRHardwareClose(hw);
+                return NULL;
+            }
+            return hw;
         }
         else
         {
-            PRSetLastErrorText("FTDI type != TYPE_R: 0x%x", ftdic.type);
-            return kPRFailure;
+            PRSetLastErrorText("FTDI type != TYPE_R: 0x%x", hw->ftdic.type);
+            PRHardwareClose(hw);
+            return NULL;
         }
     }
 }
-void PRHardwareClose()
+void PRHardwareClose(PRHardwareState *hw)
 {
-    if (ftdiInitialized)
+    if (hw == NULL)
+        return;
+    if (hw->ftdiInitialized)
     {
-        ftdi_usb_close(&ftdic);
-        ftdi_deinit(&ftdic);
+        AsyncClose(hw);
+        ftdi_usb_close(&hw->ftdic);
     }
+    ftdi_deinit(&hw->ftdic);
+    delete hw;
 }
-int PRHardwareRead(uint8_t *buffer, int maxBytes)
+int PRHardwareRead(PRHardwareState *hw, uint8_t *buffer, int maxBytes)
 {
-    //return 0;
-    return ftdi_read_data(&ftdic, buffer, maxBytes);
+    if (hw->asyncEnabled)
+        return AsyncRead(hw, buffer, maxBytes);
+    return ftdi_read_data(&hw->ftdic, buffer, maxBytes);
 }
-int PRHardwareWrite(uint8_t *buffer, int bytes)
+PRResult PRHardwareSetLinkParams(PRHardwareState *hw, const PRLinkParams *params)
 {
-    //return 0;
-    return ftdi_write_data(&ftdic, buffer, bytes);
+    return ApplyLinkParams(hw, params);
+}
+int PRHardwareWrite(PRHardwareState *hw, uint8_t *buffer, int bytes)
+{
+    if (hw->asyncEnabled)
+        return AsyncWrite(hw, buffer, bytes);
+    return ftdi_write_data(&hw->ftdic, buffer, bytes);
 }
 
 #endif
+
+// The FTDI drivers above as a PRTransport.
+
+static void *FTDIOpen(PRMachineType, const PRCreateOptions *options)
+{
+    return PRHardwareOpen(options);
+}
+
+static void FTDIClose(void *state)
+{
+    PRHardwareClose((PRHardwareState *)state);
+}
+
+static int FTDIRead(void *state, uint8_t *buffer, int maxBytes)
+{
+    return PRHardwareRead((PRHardwareState *)state, buffer, maxBytes);
+}
+
+static int FTDIWrite(void *state, uint8_t *buffer, int bytes)
+{
+    return PRHardwareWrite((PRHardwareState *)state, buffer, bytes);
+}
+
+static PRResult FTDISetLinkParams(void *state, const PRLinkParams *params)
+{
+    return PRHardwareSetLinkParams((PRHardwareState *)state, params);
+}
+
+const PRTransport PRFTDITransport = { FTDIOpen, FTDIClose, FTDIRead, FTDIWrite, FTDISetLinkParams };
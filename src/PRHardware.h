@@ -321,6 +321,10 @@ typedef struct PRSwitchRuleInternal {
 
 
 bool_t IsStern (uint32_t hardware_data);
+
+// CreateRegRequestWord(), CreateBurstCommand() and CreateDriverAuxCommand() return host order
+// words.  The Create*Burst() functions and FillPDBCommand() store wire order (big-endian) words
+// so they can build their bursts directly in the write staging buffer; see PRWireWord().
 uint32_t CreateRegRequestWord( uint32_t select, uint32_t addr, uint32_t num_words);
 uint32_t CreateBurstCommand ( uint32_t select, uint32_t addr, uint32_t num_words);
 int32_t CreateManagerUpdateConfigBurst ( uint32_t * burst, PRManagerConfig *manager_config);
@@ -347,9 +351,13 @@ int32_t CreateJTAGShiftTDODataBurst ( uint32_t * burst, uint16_t numBits, bool_t
 
 void FillPDBCommand(uint8_t command, uint8_t boardAddr, PRLEDRegisterType reg, uint8_t value, uint32_t * pData);
 
-PRResult PRHardwareOpen();
-void PRHardwareClose();
-int PRHardwareRead(uint8_t *buffer, int maxBytes);
-int PRHardwareWrite(uint8_t *buffer, int bytes);
+/** Connection to one P-ROC.  Defined by the driver-specific code in PRHardware.cpp. */
+struct PRHardwareState;
+
+PRHardwareState *PRHardwareOpen(const PRCreateOptions *options); // Returns NULL on failure.
+void PRHardwareClose(PRHardwareState *hw);
+int PRHardwareRead(PRHardwareState *hw, uint8_t *buffer, int maxBytes);
+int PRHardwareWrite(PRHardwareState *hw, uint8_t *buffer, int bytes);
+PRResult PRHardwareSetLinkParams(PRHardwareState *hw, const PRLinkParams *params);
 
 #endif /* PINPROC_PRHARDWARE_H */
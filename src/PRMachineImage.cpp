@@ -0,0 +1,178 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PRMachineImage.cpp
+ *  libpinproc
+ */
+
+#include "PRMachineImage.h"
+#include "PRCommon.h"
+#include "PRByteOrder.h"
+#include <stdio.h>
+#include <string.h>
+
+static uint32_t BurstDataWords(uint32_t header)
+{
+    return (header & P_ROC_HEADER_LENGTH_MASK) >> P_ROC_HEADER_LENGTH_SHIFT;
+}
+
+static bool IsWriteBurst(uint32_t header)
+{
+    return ((header & P_ROC_COMMAND_MASK) >> P_ROC_COMMAND_SHIFT) == P_ROC_WRITE;
+}
+
+void PRBurstJoiner::Append(const uint32_t *bursts, int32_t numWords)
+{
+    while (numWords > 0)
+    {
+        uint32_t header = PRWireWord(bursts[0]);
+        int32_t dataWords = BurstDataWords(header);
+
+        bool joined = false;
+        if (numBursts > 0)
+        {
+            uint32_t last = PRWireWord(words[lastHeader]);
+            int32_t lastDataWords = BurstDataWords(last);
+            if ((last & P_ROC_MODULE_SELECT_MASK) == (header & P_ROC_MODULE_SELECT_MASK) &&
+                (last & P_ROC_ADDR_MASK) + lastDataWords == (header & P_ROC_ADDR_MASK) &&
+                lastDataWords + dataWords <= maxDataWords)
+            {
+                last = (last & ~P_ROC_HEADER_LENGTH_MASK) | ((lastDataWords + dataWords) << P_ROC_HEADER_LENGTH_SHIFT);
+                words[lastHeader] = PRWireWord(last);
+                joined = true;
+            }
+        }
+        if (!joined)
+        {
+            lastHeader = words.size();
+            words.push_back(bursts[0]);
+            numBursts++;
+        }
+        words.insert(words.end(), bursts + 1, bursts + 1 + dataWords);
+        bursts += 1 + dataWords;
+        numWords -= 1 + dataWords;
+    }
+}
+
+PRResult PRWriteMachineImage(const char *path, PRMachineType machineType, const PRMachineImageState *state, const std::vector<uint32_t> &words, int32_t numBursts)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        PRSetLastErrorText("Unable to create machine image %s.", path);
+        return kPRFailure;
+    }
+
+    PRMachineImageHeader header;
+    memcpy(header.magic, machineImageMagic, sizeof(header.magic));
+    header.version = machineImageVersion;
+    header.headerSize = sizeof(header);
+    header.machineType = machineType;
+    header.stateSize = sizeof(*state);
+    header.numWords = (uint32_t)words.size();
+    header.numBursts = numBursts;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(state, sizeof(*state), 1, file) == 1 &&
+              (words.empty() || fwrite(&words[0], sizeof(uint32_t), words.size(), file) == words.size());
+    if (fclose(file) != 0)
+        ok = false;
+    if (!ok)
+    {
+        PRSetLastErrorText("Unable to write machine image %s.", path);
+        remove(path);
+        return kPRFailure;
+    }
+    return kPRSuccess;
+}
+
+PRResult PRReadMachineImage(const char *path, PRMachineType machineType, int32_t maxBurstWords, PRMachineImageState *state, std::vector<uint32_t> *words)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        PRSetLastErrorText("Unable to open machine image %s.", path);
+        return kPRFailure;
+    }
+
+    PRMachineImageHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, machineImageMagic, sizeof(header.magic)) != 0 || header.headerSize < sizeof(header))
+    {
+        PRSetLastErrorText("%s is not a machine image.", path);
+        fclose(file);
+        return kPRFailure;
+    }
+    if (header.version != machineImageVersion || header.stateSize != sizeof(*state))
+    {
+        PRSetLastErrorText("Machine image %s was saved by a different version of libpinproc.", path);
+        fclose(file);
+        return kPRFailure;
+    }
+    if (header.machineType != (uint32_t)machineType)
+    {
+        PRSetLastErrorText("Machine image %s is for machine type %d, not %d.", path, header.machineType, machineType);
+        fclose(file);
+        return kPRFailure;
+    }
+
+    // Check the counts against the file before trusting them with an allocation.
+    long fileSize = -1;
+    if (fseek(file, 0, SEEK_END) == 0)
+        fileSize = ftell(file);
+    if (fileSize < 0 ||
+        (uint64_t)fileSize < (uint64_t)header.headerSize + header.stateSize + (uint64_t)header.numWords * sizeof(uint32_t))
+    {
+        PRSetLastErrorText("Machine image %s is truncated.", path);
+        fclose(file);
+        return kPRFailure;
+    }
+
+    words->resize(header.numWords);
+    bool ok = fseek(file, header.headerSize, SEEK_SET) == 0 &&
+              fread(state, sizeof(*state), 1, file) == 1 &&
+              (header.numWords == 0 || fread(&(*words)[0], sizeof(uint32_t), header.numWords, file) == header.numWords);
+    fclose(file);
+    if (!ok)
+    {
+        PRSetLastErrorText("Machine image %s is truncated.", path);
+        return kPRFailure;
+    }
+
+    // The bursts are sent as they are, so make sure they are all whole writes.
+    uint32_t i = 0;
+    while (i < header.numWords)
+    {
+        uint32_t burst = PRWireWord((*words)[i]);
+        int32_t dataWords = BurstDataWords(burst);
+        if (!IsWriteBurst(burst) || dataWords == 0 || dataWords + 1 > maxBurstWords || i + 1 + dataWords > header.numWords)
+        {
+            PRSetLastErrorText("Machine image %s has a bad burst at word %d.", path, i);
+            return kPRFailure;
+        }
+        i += 1 + dataWords;
+    }
+    return kPRSuccess;
+}
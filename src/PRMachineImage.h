@@ -0,0 +1,99 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PRMachineImage.h
+ *  libpinproc
+ */
+#ifndef PINPROC_PRMACHINEIMAGE_H
+#define PINPROC_PRMACHINEIMAGE_H
+#if !defined(__GNUC__) || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4) || (__GNUC__ >= 4)	// GCC supports "pragma once" correctly since 3.4
+#pragma once
+#endif
+
+#include "pinproc.h"
+#include "PRHardware.h"
+#include "PRSwitchRulePool.h"
+#include <vector>
+
+#define machineImageMagic "PRMIMAGE"
+#define machineImageVersion (1)
+
+/**
+ * Start of a machine image file (see PRMachineImageSave()).  A #PRMachineImageState follows at
+ * headerSize, then numWords words of write bursts in wire order.
+ */
+typedef struct PRMachineImageHeader {
+    char magic[8];        /**< #machineImageMagic, without the terminating NUL. */
+    uint32_t version;     /**< #machineImageVersion. */
+    uint32_t headerSize;  /**< Offset of the state. */
+    uint32_t machineType; /**< Machine type of the device the image was saved from. */
+    uint32_t stateSize;   /**< sizeof(PRMachineImageState) in the library that saved the image. */
+    uint32_t numWords;    /**< Burst words after the state. */
+    uint32_t numBursts;
+} PRMachineImageHeader;
+
+/** The library's copy of the configuration an image writes, restored when the image is loaded. */
+typedef struct PRMachineImageState {
+    PRDriverGlobalConfig driverGlobalConfig;
+    PRDriverGroupConfig driverGroups[kPRDriverGroupsMax];
+    PRDriverState drivers[kPRDriverCount];
+    PRSwitchConfig switchConfig;
+    PRSwitchRuleInternal switchRules[kPRSwitchRulesCount];
+    PRSwitchRulePool switchRulePool;
+} PRMachineImageState;
+
+/**
+ * Collects write bursts in wire order.  A burst that writes the addresses right after the
+ * previous one in the same module is joined to it, up to maxDataWords data words, so tables
+ * written entry by entry go out under a single header.
+ */
+class PRBurstJoiner
+{
+public:
+    PRBurstJoiner(int32_t maxDataWords) : maxDataWords(maxDataWords), lastHeader(0), numBursts(0) {}
+
+    /** Adds one or more complete write bursts. */
+    void Append(const uint32_t *bursts, int32_t numWords);
+
+    const std::vector<uint32_t> &Words() const { return words; }
+    int32_t NumBursts() const { return numBursts; }
+
+protected:
+    int32_t maxDataWords;
+    std::vector<uint32_t> words;
+    size_t lastHeader; /**< Index in words of the last burst's header, if numBursts > 0. */
+    int32_t numBursts;
+};
+
+/** Writes an image to path, replacing it. */
+PRResult PRWriteMachineImage(const char *path, PRMachineType machineType, const PRMachineImageState *state, const std::vector<uint32_t> &words, int32_t numBursts);
+/**
+ * Reads an image saved for machineType.  Fails unless every burst in it is a write with at
+ * most maxBurstWords words, header included.
+ */
+PRResult PRReadMachineImage(const char *path, PRMachineType machineType, int32_t maxBurstWords, PRMachineImageState *state, std::vector<uint32_t> *words);
+
+#endif	/* PINPROC_PRMACHINEIMAGE_H */
@@ -0,0 +1,357 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PRSimulator.cpp
+ *  libpinproc
+ */
+
+#include "PRSimulator.h"
+#include "PRHardware.h"
+#include "PRCommon.h"
+#include <string.h>
+#include <vector>
+#include <mutex>
+#include <chrono>
+
+/**
+ * Simulated P-ROC.
+ * Words written by the host are parsed the way the FPGA does: a write header followed by
+ * its burst data, or a single read request which is answered with the request word
+ * followed by the register contents.  Every register is backed by a flat array indexed by
+ * the module select and address bits of the header, so reads return whatever was last
+ * written, apart from the identification registers of the manager module.  The switch rule
+ * drive-outputs-now bit is a flag on the write, not part of the rule's address.  Responses and
+ * events are queued as big-endian bytes until read() collects them.
+ */
+const uint32_t SIM_REGISTER_COUNT = P_ROC_ADDR_MASK + 1;
+const size_t SIM_RX_COMPACT_BYTES = 65536;
+
+typedef struct PRSimulatorState {
+    std::mutex mutex;              /**< Writes, reads and injected events may come from different threads. */
+    std::vector<uint32_t> registers;
+    std::vector<uint8_t> rxBytes;  /**< Bytes waiting for read(). */
+    size_t rxOffset;               /**< Next byte of rxBytes to return. */
+    uint8_t partialWord[4];        /**< Bytes of a word split across write() calls. */
+    int numPartialBytes;
+    uint32_t burstAddr;            /**< Address of the next burst data word. */
+    uint32_t burstWordsLeft;       /**< Data words remaining in the current write burst. */
+    bool burstIsDMDFrame;          /**< True if the current burst writes the DMD dot table. */
+    uint32_t dipswitches;          /**< Value read back from P_ROC_REG_DIPSWITCH_ADDR. */
+    uint32_t dmdFrame;             /**< Frame buffer reported by the next DMD frame event. */
+    std::chrono::steady_clock::time_point startTime;
+} PRSimulatorState;
+
+static uint32_t SimAddr(uint32_t select, uint32_t addr)
+{
+    return (select << P_ROC_MODULE_SELECT_SHIFT) | (addr << P_ROC_REG_ADDR_SHIFT);
+}
+
+// The Sim* helpers below expect the caller to hold sim->mutex.
+
+static void SimQueueWord(PRSimulatorState *sim, uint32_t word)
+{
+    uint8_t bytes[4] = { (uint8_t)(word >> 24), (uint8_t)(word >> 16), (uint8_t)(word >> 8), (uint8_t)word };
+    sim->rxBytes.insert(sim->rxBytes.end(), bytes, bytes + 4);
+}
+
+static uint32_t SimTimestamp(PRSimulatorState *sim)
+{
+    return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - sim->startTime).count();
+}
+
+/** Encodes an event as a version 2 P-ROC sends it.  Returns false for types the P-ROC never sends. */
+static bool SimEncodeEvent(const PREvent *event, uint32_t *word)
+{
+    uint32_t time = event->time & (P_ROC_V2_EVENT_SWITCH_TIMESTAMP_MASK >> P_ROC_V2_EVENT_SWITCH_TIMESTAMP_SHIFT);
+    uint32_t open = 0, debounced = 0;
+
+    switch (event->type)
+    {
+        case kPREventTypeSwitchOpenDebounced: open = 1; debounced = 1; break;
+        case kPREventTypeSwitchClosedDebounced: debounced = 1; break;
+        case kPREventTypeSwitchOpenNondebounced: open = 1; break;
+        case kPREventTypeSwitchClosedNondebounced: break;
+
+        case kPREventTypeDMDFrameDisplayed:
+            *word = (P_ROC_EVENT_TYPE_DMD << P_ROC_V2_EVENT_TYPE_SHIFT) |
+                    (event->value & P_ROC_V2_EVENT_SWITCH_NUM_MASK) |
+                    (time << P_ROC_V2_EVENT_SWITCH_TIMESTAMP_SHIFT);
+            return true;
+
+        case kPREventTypeBurstSwitchOpen:
+        case kPREventTypeBurstSwitchClosed:
+            *word = (P_ROC_EVENT_TYPE_BURST_SWITCH << P_ROC_V2_EVENT_TYPE_SHIFT) |
+                    ((event->type == kPREventTypeBurstSwitchOpen) << P_ROC_V2_EVENT_SWITCH_STATE_SHIFT) |
+                    (event->value & P_ROC_V2_EVENT_SWITCH_NUM_MASK) |
+                    (time << P_ROC_V2_EVENT_SWITCH_TIMESTAMP_SHIFT);
+            return true;
+
+        case kPREventTypeAccelerometerX:
+        case kPREventTypeAccelerometerY:
+        case kPREventTypeAccelerometerZ:
+        case kPREventTypeAccelerometerIRQ:
+            // Accelerometer words carry the axis in bits 16-17 and a shorter timestamp above it.
+            *word = (P_ROC_EVENT_TYPE_ACCELEROMETER << P_ROC_V2_EVENT_TYPE_SHIFT) |
+                    (event->value & 0x00003FFF) |
+                    ((uint32_t)(event->type - kPREventTypeAccelerometerX) << 16) |
+                    ((event->time << P_ROC_V2_EVENT_ACCEL_TIMESTAMP_SHIFT) & P_ROC_V2_EVENT_ACCEL_TIMESTAMP_MASK);
+            return true;
+
+        default:
+            return false;
+    }
+
+    *word = (P_ROC_EVENT_TYPE_SWITCH << P_ROC_V2_EVENT_TYPE_SHIFT) |
+            (open << P_ROC_V2_EVENT_SWITCH_STATE_SHIFT) |
+            (debounced << P_ROC_V2_EVENT_SWITCH_DEBOUNCED_SHIFT) |
+            (event->value & P_ROC_V2_EVENT_SWITCH_NUM_MASK) |
+            (time << P_ROC_V2_EVENT_SWITCH_TIMESTAMP_SHIFT);
+    return true;
+}
+
+/** Keeps the switch state and debounce registers read by SwitchGetStates() in step with switch events. */
+static void SimUpdateSwitchState(PRSimulatorState *sim, const PREvent *event)
+{
+    bool open, debounced;
+    switch (event->type)
+    {
+        case kPREventTypeSwitchOpenDebounced: open = true; debounced = true; break;
+        case kPREventTypeSwitchClosedDebounced: open = false; debounced = true; break;
+        case kPREventTypeSwitchOpenNondebounced: open = true; debounced = false; break;
+        case kPREventTypeSwitchClosedNondebounced: open = false; debounced = false; break;
+        default: return;
+    }
+    if (event->value > kPRSwitchPhysicalLast)
+        return;
+
+    uint32_t bit = 1 << (event->value % 32);
+    uint32_t *state = &sim->registers[SimAddr(P_ROC_BUS_SWITCH_CTRL_SELECT, P_ROC_SWITCH_CTRL_STATE_BASE_ADDR + event->value / 32)];
+    uint32_t *debounce = &sim->registers[SimAddr(P_ROC_BUS_SWITCH_CTRL_SELECT, P_ROC_SWITCH_CTRL_DEBOUNCE_BASE_ADDR + event->value / 32)];
+    *state = open ? (*state | bit) : (*state & ~bit);
+    *debounce = debounced ? (*debounce | bit) : (*debounce & ~bit);
+}
+
+static void SimQueueEvent(PRSimulatorState *sim, uint32_t eventWord)
+{
+    SimQueueWord(sim, (P_ROC_UNREQUESTED_DATA << P_ROC_COMMAND_SHIFT) | (1 << P_ROC_HEADER_LENGTH_SHIFT));
+    SimQueueWord(sim, eventWord);
+}
+
+static uint32_t SimReadRegister(PRSimulatorState *sim, uint32_t addr)
+{
+    addr &= P_ROC_ADDR_MASK;
+    if (addr == SimAddr(P_ROC_MANAGER_SELECT, P_ROC_REG_DIPSWITCH_ADDR))
+        return sim->dipswitches;
+    return sim->registers[addr];
+}
+
+static void SimWriteRegister(PRSimulatorState *sim, uint32_t addr, uint32_t value)
+{
+    addr &= P_ROC_ADDR_MASK;
+    if (addr == SimAddr(P_ROC_MANAGER_SELECT, P_ROC_REG_CHIP_ID_ADDR) ||
+        addr == SimAddr(P_ROC_MANAGER_SELECT, P_ROC_REG_VERSION_ADDR))
+        return;
+    sim->registers[addr] = value;
+}
+
+/** Reports a DMD frame as displayed as soon as it has been written, if frame events are enabled. */
+static void SimFrameWritten(PRSimulatorState *sim)
+{
+    uint32_t dmdConfig = sim->registers[SimAddr(P_ROC_BUS_DMD_SELECT, 0)];
+    if (((dmdConfig >> P_ROC_DMD_ENABLE_FRAME_EVENTS_SHIFT) & 1) == 0)
+        return;
+
+    PREvent event;
+    uint32_t eventWord;
+    event.type = kPREventTypeDMDFrameDisplayed;
+    event.value = sim->dmdFrame;
+    event.time = SimTimestamp(sim);
+    SimEncodeEvent(&event, &eventWord);
+    SimQueueEvent(sim, eventWord);
+
+    uint32_t numFrameBuffers = (dmdConfig >> P_ROC_DMD_NUM_FRAME_BUFFERS_SHIFT) & 0x1F;
+    sim->dmdFrame = numFrameBuffers > 0 ? (sim->dmdFrame + 1) % numFrameBuffers : 0;
+}
+
+static void SimProcessWord(PRSimulatorState *sim, uint32_t word)
+{
+    uint32_t i;
+
+    if (sim->burstWordsLeft > 0)
+    {
+        SimWriteRegister(sim, sim->burstAddr++, word);
+        if (--sim->burstWordsLeft == 0 && sim->burstIsDMDFrame)
+            SimFrameWritten(sim);
+        return;
+    }
+
+    // The init patterns are consumed by the FPGA's FTDI interface, not the register bus.
+    if (word == P_ROC_INIT_PATTERN_A || word == P_ROC_INIT_PATTERN_B)
+        return;
+
+    uint32_t numWords = (word & P_ROC_HEADER_LENGTH_MASK) >> P_ROC_HEADER_LENGTH_SHIFT;
+    uint32_t addr = (word & P_ROC_ADDR_MASK) >> P_ROC_ADDR_SHIFT;
+    if (((word & P_ROC_COMMAND_MASK) >> P_ROC_COMMAND_SHIFT) == P_ROC_WRITE)
+    {
+        if ((addr >> P_ROC_MODULE_SELECT_SHIFT) == P_ROC_BUS_STATE_CHANGE_PROC_SELECT)
+            addr &= ~(1 << P_ROC_SWITCH_RULE_DRIVE_OUTPUTS_NOW);
+        sim->burstAddr = addr;
+        sim->burstWordsLeft = numWords;
+        sim->burstIsDMDFrame = addr == SimAddr(P_ROC_BUS_DMD_SELECT, P_ROC_DMD_DOT_TABLE_BASE_ADDR);
+    }
+    else
+    {
+        // The response header is the request word itself.
+        SimQueueWord(sim, word);
+        for (i = 0; i < numWords; i++)
+            SimQueueWord(sim, SimReadRegister(sim, addr + i));
+    }
+}
+
+static void *SimulatorOpen(PRMachineType machineType, const PRCreateOptions *)
+{
+    uint32_t i;
+    PRSimulatorState *sim = new PRSimulatorState;
+
+    sim->registers.assign(SIM_REGISTER_COUNT, 0);
+    sim->rxOffset = 0;
+    sim->numPartialBytes = 0;
+    sim->burstAddr = 0;
+    sim->burstWordsLeft = 0;
+    sim->burstIsDMDFrame = false;
+    sim->dmdFrame = 0;
+    sim->startTime = std::chrono::steady_clock::now();
+
+    sim->registers[SimAddr(P_ROC_MANAGER_SELECT, P_ROC_REG_CHIP_ID_ADDR)] = P_ROC_CHIP_ID;
+    sim->registers[SimAddr(P_ROC_MANAGER_SELECT, P_ROC_REG_VERSION_ADDR)] = (P_ROC_SIMULATOR_VERSION << 16) | P_ROC_SIMULATOR_REVISION;
+
+    // Report the board type the caller asked for so PRCreate()'s machine type check passes.
+    if (machineType == kPRMachineSternWhitestar || machineType == kPRMachineSternSAM)
+        sim->dipswitches = P_ROC_MANUAL_STERN_DETECT_VALUE << P_ROC_MANUAL_STERN_DETECT_SHIFT;
+    else
+        sim->dipswitches = ~(P_ROC_MANUAL_STERN_DETECT_VALUE << P_ROC_MANUAL_STERN_DETECT_SHIFT) & P_ROC_MANUAL_STERN_DETECT_MASK;
+
+    // All switches start out open and debounced.
+    for (i = 0; i <= kPRSwitchPhysicalLast / 32; i++)
+    {
+        sim->registers[SimAddr(P_ROC_BUS_SWITCH_CTRL_SELECT, P_ROC_SWITCH_CTRL_STATE_BASE_ADDR + i)] = 0xFFFFFFFF;
+        sim->registers[SimAddr(P_ROC_BUS_SWITCH_CTRL_SELECT, P_ROC_SWITCH_CTRL_DEBOUNCE_BASE_ADDR + i)] = 0xFFFFFFFF;
+    }
+
+    DEBUG(PRLog(kPRLogInfo, "Opened simulated P-ROC %d.%d\n", P_ROC_SIMULATOR_VERSION, P_ROC_SIMULATOR_REVISION));
+    return sim;
+}
+
+static void SimulatorClose(void *state)
+{
+    delete (PRSimulatorState *)state;
+}
+
+static int SimulatorRead(void *state, uint8_t *buffer, int maxBytes)
+{
+    PRSimulatorState *sim = (PRSimulatorState *)state;
+    std::lock_guard<std::mutex> lock(sim->mutex);
+
+    size_t numBytes = sim->rxBytes.size() - sim->rxOffset;
+    if (numBytes > (size_t)maxBytes)
+        numBytes = maxBytes;
+    if (numBytes > 0)
+        memcpy(buffer, &sim->rxBytes[sim->rxOffset], numBytes);
+    sim->rxOffset += numBytes;
+
+    if (sim->rxOffset == sim->rxBytes.size())
+    {
+        sim->rxBytes.clear();
+        sim->rxOffset = 0;
+    }
+    else if (sim->rxOffset >= SIM_RX_COMPACT_BYTES)
+    {
+        sim->rxBytes.erase(sim->rxBytes.begin(), sim->rxBytes.begin() + sim->rxOffset);
+        sim->rxOffset = 0;
+    }
+    return (int)numBytes;
+}
+
+static int SimulatorWrite(void *state, uint8_t *buffer, int bytes)
+{
+    PRSimulatorState *sim = (PRSimulatorState *)state;
+    std::lock_guard<std::mutex> lock(sim->mutex);
+
+    for (int i = 0; i < bytes; i++)
+    {
+        sim->partialWord[sim->numPartialBytes++] = buffer[i];
+        if (sim->numPartialBytes == 4)
+        {
+            SimProcessWord(sim, ((uint32_t)sim->partialWord[0] << 24) | ((uint32_t)sim->partialWord[1] << 16) |
+                                ((uint32_t)sim->partialWord[2] << 8) | sim->partialWord[3]);
+            sim->numPartialBytes = 0;
+        }
+    }
+    return bytes;
+}
+
+// There is no USB link to tune, but accepting the settings lets PRCalibrateLink() run against the simulator.
+static PRResult SimulatorSetLinkParams(void *, const PRLinkParams *)
+{
+    return kPRSuccess;
+}
+
+const PRTransport PRSimulatorTransport = { SimulatorOpen, SimulatorClose, SimulatorRead, SimulatorWrite, SimulatorSetLinkParams };
+
+PRResult PRSimulatorQueueWords(void *state, const uint32_t *words, int numWords)
+{
+    PRSimulatorState *sim = (PRSimulatorState *)state;
+    std::lock_guard<std::mutex> lock(sim->mutex);
+
+    for (int i = 0; i < numWords; i++)
+        SimQueueWord(sim, words[i]);
+    return kPRSuccess;
+}
+
+PRResult PRSimulatorQueueEvents(void *state, const PREvent *events, int numEvents)
+{
+    PRSimulatorState *sim = (PRSimulatorState *)state;
+    std::lock_guard<std::mutex> lock(sim->mutex);
+    uint32_t eventWord;
+    int i;
+
+    for (i = 0; i < numEvents; i++)
+    {
+        if (!SimEncodeEvent(&events[i], &eventWord))
+        {
+            PRSetLastErrorText("Event type %d can't be simulated.", events[i].type);
+            return kPRFailure;
+        }
+    }
+    for (i = 0; i < numEvents; i++)
+    {
+        SimEncodeEvent(&events[i], &eventWord);
+        SimUpdateSwitchState(sim, &events[i]);
+        SimQueueEvent(sim, eventWord);
+    }
+    return kPRSuccess;
+}
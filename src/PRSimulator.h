@@ -0,0 +1,46 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PRSimulator.h
+ *  libpinproc
+ */
+#ifndef PINPROC_PRSIMULATOR_H
+#define PINPROC_PRSIMULATOR_H
+#if !defined(__GNUC__) || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4) || (__GNUC__ >= 4)	// GCC supports "pragma once" correctly since 3.4
+#pragma once
+#endif
+
+#include "PRTransport.h"
+
+const uint32_t P_ROC_SIMULATOR_VERSION  = 2;
+const uint32_t P_ROC_SIMULATOR_REVISION = 0;
+
+/** Appends raw words to the data the simulated P-ROC with the given transport state returns. */
+PRResult PRSimulatorQueueWords(void *state, const uint32_t *words, int numWords);
+/** Encodes events the way a version 2 P-ROC sends them and appends them to the returned data. */
+PRResult PRSimulatorQueueEvents(void *state, const PREvent *events, int numEvents);
+
+#endif	/* PINPROC_PRSIMULATOR_H */
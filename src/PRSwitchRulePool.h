@@ -0,0 +1,160 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PRSwitchRulePool.h
+ *  libpinproc
+ */
+#ifndef PINPROC_PRSWITCHRULEPOOL_H
+#define PINPROC_PRSWITCHRULEPOOL_H
+#if !defined(__GNUC__) || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4) || (__GNUC__ >= 4)	// GCC supports "pragma once" correctly since 3.4
+#pragma once
+#endif
+
+#include "pinproc.h"
+#include <string.h>
+
+/**
+ * The switch rules available to hold linked driver updates, and which of them are in use.
+ * Every switch has its own four rules, so the pool only holds rules whose switch doesn't need
+ * them: the debounced rules of switches that are never debounced, plus any donated with Add().
+ *
+ * Allocate() hands out the lowest free rule, so links stay packed towards the start of the
+ * pool and Compact() has little to move.  Rules released while the device may still follow
+ * them are held back until ReturnReleased(), so they can't be reused and rewritten under a
+ * link the device hasn't dropped yet.
+ */
+class PRSwitchRulePool
+{
+public:
+    enum SlotState { notInPool = 0, slotFree, slotUsed, slotReleased };
+
+    PRSwitchRulePool() { Clear(); }
+
+    /** Empties the pool. */
+    void Clear()
+    {
+        memset(slots, notInPool, sizeof(slots));
+        numSlots = numUsed = numReleased = 0;
+    }
+
+    /** Makes a rule available for links. */
+    void Add(uint16_t index)
+    {
+        if (slots[index] != notInPool)
+            return;
+        slots[index] = slotFree;
+        numSlots++;
+    }
+
+    bool IsMember(uint16_t index) const { return slots[index] != notInPool; }
+    bool IsUsed(uint16_t index) const { return slots[index] == slotUsed; }
+    uint32_t NumFree() const { return numSlots - numUsed - numReleased; }
+
+    /** Takes the lowest free rule.  Returns false if there is none. */
+    bool Allocate(uint16_t *index)
+    {
+        for (uint32_t i = 0; i < kPRSwitchRulesCount; i++)
+        {
+            if (slots[i] == slotFree)
+            {
+                slots[i] = slotUsed;
+                numUsed++;
+                *index = (uint16_t)i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Gives back a rule from Allocate(), right away or (if deferred) at the next ReturnReleased(). */
+    void Release(uint16_t index, bool deferred)
+    {
+        if (slots[index] != slotUsed)
+            return;
+        numUsed--;
+        if (deferred)
+        {
+            slots[index] = slotReleased;
+            numReleased++;
+        }
+        else
+            slots[index] = slotFree;
+    }
+
+    /** Keeps a free rule from being allocated until the next ReturnReleased(), e.g. because the device may still follow it. */
+    void Hold(uint16_t index)
+    {
+        if (slots[index] != slotFree)
+            return;
+        slots[index] = slotReleased;
+        numReleased++;
+    }
+
+    /** Frees the rules released with deferred set. */
+    void ReturnReleased()
+    {
+        for (uint32_t i = 0; i < kPRSwitchRulesCount && numReleased > 0; i++)
+        {
+            if (slots[i] == slotReleased)
+            {
+                slots[i] = slotFree;
+                numReleased--;
+            }
+        }
+    }
+
+    /** Moves the use of rule from to rule to, which must be free. */
+    void Move(uint16_t from, uint16_t to)
+    {
+        slots[to] = slotUsed;
+        slots[from] = slotFree;
+    }
+
+    void GetStats(PRSwitchRulePoolStats *stats) const
+    {
+        stats->size = numSlots;
+        stats->used = numUsed;
+        stats->free = NumFree();
+        stats->released = numReleased;
+        stats->fragmented = 0;
+        uint32_t freeSoFar = 0;
+        for (uint32_t i = 0; i < kPRSwitchRulesCount; i++)
+        {
+            if (slots[i] == slotFree)
+                freeSoFar++;
+            else if (slots[i] == slotUsed)
+                stats->fragmented = freeSoFar;
+        }
+    }
+
+protected:
+    uint8_t slots[kPRSwitchRulesCount]; /**< SlotState of every switch rule. */
+    uint32_t numSlots;
+    uint32_t numUsed;
+    uint32_t numReleased;
+};
+
+#endif	/* PINPROC_PRSWITCHRULEPOOL_H */
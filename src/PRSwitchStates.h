@@ -0,0 +1,160 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PRSwitchStates.h
+ *  libpinproc
+ */
+#ifndef PINPROC_PRSWITCHSTATES_H
+#define PINPROC_PRSWITCHSTATES_H
+#if !defined(__GNUC__) || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4) || (__GNUC__ >= 4)	// GCC supports "pragma once" correctly since 3.4
+#pragma once
+#endif
+
+#include "pinproc.h"
+#include <atomic>
+
+#define switchStateWords (kPRSwitchCount / 32)
+
+/**
+ * Last known state of every switch, kept up to date from decoded switch events so callers can
+ * check a switch without going to the device.  Apply() and Seed() are only called while sorting
+ * returning data: on the event thread if it is running, otherwise inside the libpinproc call
+ * that collected the data, which the API already allows on one thread at a time.  Updates are
+ * plain loads and stores for that reason, and land in the order the device sent them.  Readable
+ * from any thread; every word is atomic, but a whole-bitmap read may mix words from before and
+ * after an update.
+ */
+class PRSwitchStates
+{
+public:
+    PRSwitchStates() { Clear(); }
+
+    /** Folds a decoded event into the states.  Anything but a switch event is ignored. */
+    void Apply(PREventType type, uint32_t switchNum, uint32_t time)
+    {
+        bool open, debounced;
+        switch (type)
+        {
+            case kPREventTypeSwitchOpenDebounced:      open = true;  debounced = true;  break;
+            case kPREventTypeSwitchClosedDebounced:    open = false; debounced = true;  break;
+            case kPREventTypeSwitchOpenNondebounced:   open = true;  debounced = false; break;
+            case kPREventTypeSwitchClosedNondebounced: open = false; debounced = false; break;
+            default: return;
+        }
+        if (switchNum >= kPRSwitchCount)
+            return;
+
+        // A debounced change means the raw input has settled in the same state, so it
+        // updates the non-debounced state too if that hasn't caught up yet.
+        if (debounced)
+            Set(openDebounced, changeTimesDebounced, switchNum, open, time, true);
+        Set(openNondebounced, changeTimesNondebounced, switchNum, open, time, !debounced);
+        uint32_t bit = 1u << (switchNum & 31);
+        known[switchNum >> 5].store(known[switchNum >> 5].load(std::memory_order_relaxed) | bit, std::memory_order_release);
+    }
+
+    /**
+     * Replaces the states of the first numSwitches switches with the state and debounce registers
+     * read from the device.  A set debounce bit means the state bit is also the debounced state;
+     * a clear one means the input has changed but not settled, so the debounced state is still
+     * the opposite.  Change times are kept.  Called as the answer to the second read is sorted,
+     * before any event sent after it is applied.  Events sent ahead of it may still be applied
+     * afterwards, but they only replay changes the registers already show.
+     */
+    void Seed(const uint32_t *stateWords, const uint32_t *debounceWords, int numSwitches)
+    {
+        for (int i = 0; i < switchStateWords && i * 32 < numSwitches; i++)
+        {
+            uint32_t mask = numSwitches - i * 32 >= 32 ? 0xFFFFFFFF : (1u << (numSwitches - i * 32)) - 1;
+            uint32_t debouncedOpen = ~(stateWords[i] ^ debounceWords[i]);
+            openNondebounced[i].store((openNondebounced[i].load(std::memory_order_relaxed) & ~mask) | (stateWords[i] & mask), std::memory_order_release);
+            openDebounced[i].store((openDebounced[i].load(std::memory_order_relaxed) & ~mask) | (debouncedOpen & mask), std::memory_order_release);
+            known[i].store(known[i].load(std::memory_order_relaxed) | mask, std::memory_order_release);
+        }
+    }
+
+    void GetBitmap(PRSwitchStateBitmap *bitmap) const
+    {
+        for (int i = 0; i < switchStateWords; i++)
+        {
+            bitmap->known[i] = known[i].load(std::memory_order_acquire);
+            bitmap->openNondebounced[i] = openNondebounced[i].load(std::memory_order_acquire);
+            bitmap->openDebounced[i] = openDebounced[i].load(std::memory_order_acquire);
+        }
+    }
+
+    /** 1 if the switch is open, 0 if it is closed, -1 if its state isn't known yet. */
+    int IsOpen(uint32_t switchNum, bool debounced) const
+    {
+        uint32_t bit = 1u << (switchNum & 31);
+        if (!(known[switchNum >> 5].load(std::memory_order_acquire) & bit))
+            return -1;
+        const std::atomic<uint32_t> *words = debounced ? openDebounced : openNondebounced;
+        return (words[switchNum >> 5].load(std::memory_order_acquire) & bit) ? 1 : 0;
+    }
+
+    uint32_t LastChangeTime(uint32_t switchNum, bool debounced) const
+    {
+        return (debounced ? changeTimesDebounced : changeTimesNondebounced)[switchNum].load(std::memory_order_acquire);
+    }
+
+    /** Forgets everything.  Only safe while nothing is updating the states. */
+    void Clear()
+    {
+        for (int i = 0; i < switchStateWords; i++)
+        {
+            known[i] = 0;
+            openNondebounced[i] = 0;
+            openDebounced[i] = 0;
+        }
+        for (int i = 0; i < kPRSwitchCount; i++)
+        {
+            changeTimesNondebounced[i] = 0;
+            changeTimesDebounced[i] = 0;
+        }
+    }
+
+protected:
+    /** Sets one switch's bit in words, recording time if the bit changed or force is set. */
+    static void Set(std::atomic<uint32_t> *words, std::atomic<uint32_t> *times, uint32_t switchNum, bool open, uint32_t time, bool force)
+    {
+        uint32_t bit = 1u << (switchNum & 31);
+        uint32_t word = words[switchNum >> 5].load(std::memory_order_relaxed);
+        uint32_t updated = open ? (word | bit) : (word & ~bit);
+        if (updated == word && !force)
+            return;
+        times[switchNum].store(time, std::memory_order_relaxed);
+        words[switchNum >> 5].store(updated, std::memory_order_release);
+    }
+
+    std::atomic<uint32_t> known[switchStateWords];
+    std::atomic<uint32_t> openNondebounced[switchStateWords];
+    std::atomic<uint32_t> openDebounced[switchStateWords];
+    std::atomic<uint32_t> changeTimesNondebounced[kPRSwitchCount];
+    std::atomic<uint32_t> changeTimesDebounced[kPRSwitchCount];
+};
+
+#endif	/* PINPROC_PRSWITCHSTATES_H */
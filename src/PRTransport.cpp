@@ -0,0 +1,121 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PRTransport.cpp
+ *  libpinproc
+ */
+
+#include <stdlib.h>
+#include "PRTransport.h"
+#include "PRCommon.h"
+
+const PRTransport *PRTransportForOptions(const PRCreateOptions *options)
+{
+    switch (options->transport)
+    {
+        case kPRTransportFTDI: return &PRFTDITransport;
+        case kPRTransportSimulator: return &PRSimulatorTransport;
+        case kPRTransportCustom: return &PRCustomTransport;
+        case kPRTransportReplay: return &PRReplayTransport;
+        default: return NULL;
+    }
+}
+
+PRResult PRCheckLinkParams(const PRLinkParams *params)
+{
+    if (params->latencyTimer < 0 || params->latencyTimer > 255)
+    {
+        PRSetLastErrorText("Latency timer %d is out of range.", params->latencyTimer);
+        return kPRFailure;
+    }
+    if (params->readChunkSize != 0 && (params->readChunkSize < 64 || params->readChunkSize > 65536 || params->readChunkSize % 64 != 0))
+    {
+        PRSetLastErrorText("Read chunk size %d is not a multiple of 64 from 64 to 65536.", params->readChunkSize);
+        return kPRFailure;
+    }
+    if (params->writeChunkSize != 0 && (params->writeChunkSize < 64 || params->writeChunkSize > 65536 || params->writeChunkSize % 64 != 0))
+    {
+        PRSetLastErrorText("Write chunk size %d is not a multiple of 64 from 64 to 65536.", params->writeChunkSize);
+        return kPRFailure;
+    }
+    if (params->baudRate < 0)
+    {
+        PRSetLastErrorText("Baud rate %d is out of range.", params->baudRate);
+        return kPRFailure;
+    }
+    return kPRSuccess;
+}
+
+// Adapts the caller's PRTransportFunctions to PRTransport.
+
+typedef struct PRCustomTransportState {
+    const PRTransportFunctions *functions;
+    void *context;
+} PRCustomTransportState;
+
+static void *CustomOpen(PRMachineType, const PRCreateOptions *options)
+{
+    const PRTransportFunctions *functions = options->customTransport;
+    if (functions == NULL || functions->read == NULL || functions->write == NULL)
+    {
+        PRSetLastErrorText("Custom transport requires read and write functions.");
+        return NULL;
+    }
+    if (functions->open != NULL && functions->open(options->customTransportContext) != kPRSuccess)
+    {
+        PRSetLastErrorText("Custom transport failed to open.");
+        return NULL;
+    }
+
+    PRCustomTransportState *state = new PRCustomTransportState;
+    state->functions = functions;
+    state->context = options->customTransportContext;
+    return state;
+}
+
+static void CustomClose(void *state)
+{
+    PRCustomTransportState *custom = (PRCustomTransportState *)state;
+    if (custom == NULL)
+        return;
+    if (custom->functions->close != NULL)
+        custom->functions->close(custom->context);
+    delete custom;
+}
+
+static int CustomRead(void *state, uint8_t *buffer, int maxBytes)
+{
+    PRCustomTransportState *custom = (PRCustomTransportState *)state;
+    return custom->functions->read(custom->context, buffer, maxBytes);
+}
+
+static int CustomWrite(void *state, uint8_t *buffer, int bytes)
+{
+    PRCustomTransportState *custom = (PRCustomTransportState *)state;
+    return custom->functions->write(custom->context, buffer, bytes);
+}
+
+const PRTransport PRCustomTransport = { CustomOpen, CustomClose, CustomRead, CustomWrite, NULL };
@@ -0,0 +1,64 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PRTransport.h
+ *  libpinproc
+ */
+#ifndef PINPROC_PRTRANSPORT_H
+#define PINPROC_PRTRANSPORT_H
+#if !defined(__GNUC__) || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4) || (__GNUC__ >= 4)	// GCC supports "pragma once" correctly since 3.4
+#pragma once
+#endif
+
+#include <stdint.h>
+#include "pinproc.h"
+
+/**
+ * I/O entry points of one way of reaching a P-ROC.  open() returns the per-device state
+ * handed to the other functions, or NULL on failure.  read() must not wait for data that
+ * hasn't arrived yet for longer than a USB read would.  setLinkParams() is NULL for
+ * transports without link settings; it is never called while read() or write() runs.
+ */
+typedef struct PRTransport {
+    void *(*open)(PRMachineType machineType, const PRCreateOptions *options);
+    void (*close)(void *state);
+    int (*read)(void *state, uint8_t *buffer, int maxBytes);
+    int (*write)(void *state, uint8_t *buffer, int bytes);
+    PRResult (*setLinkParams)(void *state, const PRLinkParams *params);
+} PRTransport;
+
+extern const PRTransport PRFTDITransport;      // PRHardware.cpp
+extern const PRTransport PRSimulatorTransport; // PRSimulator.cpp
+extern const PRTransport PRCustomTransport;    // PRTransport.cpp
+extern const PRTransport PRReplayTransport;    // PRCapture.cpp
+
+/** Returns the transport selected by options->transport, or NULL if it is unknown. */
+const PRTransport *PRTransportForOptions(const PRCreateOptions *options);
+
+/** Checks that every field of params is 0 or in range.  Sets the last error text if not. */
+PRResult PRCheckLinkParams(const PRLinkParams *params);
+
+#endif	/* PINPROC_PRTRANSPORT_H */
@@ -0,0 +1,144 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PRWakeup.cpp
+ *  libpinproc
+ */
+
+#include "PRWakeup.h"
+#include "PRCommon.h"
+
+#if defined(__WIN32__) || defined(_WIN32)
+
+PRWakeup::PRWakeup() : readFd(-1), writeFd(-1) {}
+PRWakeup::~PRWakeup() {}
+
+PRResult PRWakeup::Open()
+{
+    PRSetLastErrorText("Event descriptors are not supported on Windows.");
+    return kPRFailure;
+}
+
+void PRWakeup::Close() {}
+void PRWakeup::Signal() {}
+void PRWakeup::Drain() {}
+
+int PRWakeup::Wait(int32_t timeoutMicroseconds)
+{
+    return -1;
+}
+
+#else
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
+PRWakeup::PRWakeup() : readFd(-1), writeFd(-1)
+{
+}
+
+PRWakeup::~PRWakeup()
+{
+    Close();
+}
+
+PRResult PRWakeup::Open()
+{
+    if (IsOpen())
+        return kPRSuccess;
+
+#if defined(__linux__)
+    readFd = writeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (readFd < 0)
+    {
+        PRSetLastErrorText("Unable to create eventfd: %d", errno);
+        return kPRFailure;
+    }
+#else
+    int fds[2];
+    if (pipe(fds) < 0)
+    {
+        PRSetLastErrorText("Unable to create pipe: %d", errno);
+        return kPRFailure;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    readFd = fds[0];
+    writeFd = fds[1];
+#endif
+    return kPRSuccess;
+}
+
+void PRWakeup::Close()
+{
+    if (!IsOpen())
+        return;
+    if (writeFd != readFd)
+        close(writeFd);
+    close(readFd);
+    readFd = writeFd = -1;
+}
+
+void PRWakeup::Signal()
+{
+    // Both an eventfd and a pipe accept an 8 byte write.  If the pipe is full it is
+    // already readable, so a failed write loses nothing.
+    uint64_t one = 1;
+    ssize_t rc = write(writeFd, &one, sizeof(one));
+    (void)rc;
+}
+
+void PRWakeup::Drain()
+{
+    uint64_t buffer[8];
+    while (read(readFd, buffer, sizeof(buffer)) > 0)
+        ;
+}
+
+int PRWakeup::Wait(int32_t timeoutMicroseconds)
+{
+    struct pollfd pfd;
+    pfd.fd = readFd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    // poll() only has millisecond resolution; round up so short timeouts still wait.
+    int timeoutMs = timeoutMicroseconds < 0 ? -1 : (timeoutMicroseconds + 999) / 1000;
+    int rc = poll(&pfd, 1, timeoutMs);
+    if (rc < 0)
+        return errno == EINTR ? 0 : -1;
+    return rc > 0 ? 1 : 0;
+}
+
+#endif
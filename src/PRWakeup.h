@@ -0,0 +1,68 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  PRWakeup.h
+ *  libpinproc
+ */
+#ifndef PINPROC_PRWAKEUP_H
+#define PINPROC_PRWAKEUP_H
+#if !defined(__GNUC__) || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4) || (__GNUC__ >= 4)	// GCC supports "pragma once" correctly since 3.4
+#pragma once
+#endif
+
+#include "pinproc.h"
+
+/**
+ * A file descriptor that becomes readable when Signal() is called and stays readable until
+ * Drain().  An eventfd on Linux and a non-blocking pipe on other POSIX systems.  Not
+ * available on Windows, where Open() fails and the other methods do nothing.
+ */
+class PRWakeup
+{
+public:
+    PRWakeup();
+    ~PRWakeup();
+
+    PRResult Open();
+    void Close();
+    bool IsOpen() const { return readFd >= 0; }
+    int GetDescriptor() const { return readFd; }
+
+    void Signal();
+    void Drain();
+
+    /**
+     * Waits up to timeoutMicroseconds (or forever if negative) for the descriptor to become readable.
+     * Returns 1 if it is, 0 on timeout and -1 on error.
+     */
+    int Wait(int32_t timeoutMicroseconds);
+
+protected:
+    int readFd;
+    int writeFd; /**< Same as readFd for an eventfd. */
+};
+
+#endif	/* PINPROC_PRWAKEUP_H */
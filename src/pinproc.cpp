@@ -72,7 +72,8 @@ void PRLogSetLevel(PRLogLevel level)
     logLevel = level;
 }
 
-char lastErrorText[MAX_TEXT];
+// Per thread, so handles used concurrently from different threads don't overwrite each other's errors.
+thread_local char lastErrorText[MAX_TEXT];
 
 void PRSetLastErrorText(const char *format, ...)
 {
@@ -89,10 +90,43 @@ const char *PRGetLastErrorText()
 
 #define handleAsDevice ((PRDevice*)handle)
 
+void PRCreateOptionsInit(PRCreateOptions *options)
+{
+    memset(options, 0x00, sizeof(PRCreateOptions));
+    options->asyncTransfers = false;
+    options->serialNumber[0] = '\0';
+    options->deviceIndex = 0;
+    options->transport = kPRTransportFTDI;
+    options->customTransport = NULL;
+    options->customTransportContext = NULL;
+    options->eventThread = false;
+    options->linkParams.latencyTimer = 2; // This helps make reads much faster.  16 appeared to be the default.
+    options->linkParams.readChunkSize = 4096;
+    options->linkParams.writeChunkSize = 0;
+    options->linkParams.baudRate = 1228800;
+    options->eventQueueSize = 4096;
+    options->eventOverflowPolicy = kPREventOverflowDropOldest;
+    options->captureFile = NULL;
+    options->replayFile = NULL;
+    options->replaySpeed = 1.0;
+}
+
 /** Create a new P-ROC device handle.  Only one handle per device may be created. This handle must be destroyed with PRDelete() when it is no longer needed. */
 PRHandle PRCreate(PRMachineType machineType)
 {
-    PRDevice *device = PRDevice::Create(machineType);
+    return PRCreateWithOptions(machineType, NULL);
+}
+
+PRHandle PRCreateWithOptions(PRMachineType machineType, const PRCreateOptions *options)
+{
+    PRCreateOptions defaultOptions;
+    if (options == NULL)
+    {
+        PRCreateOptionsInit(&defaultOptions);
+        options = &defaultOptions;
+    }
+
+    PRDevice *device = PRDevice::Create(machineType, options);
     if (device == NULL)
         return kPRHandleInvalid;
     else
@@ -119,6 +153,31 @@ PRResult PRFlushWriteData(PRHandle handle)
     return handleAsDevice->FlushWriteData();
 }
 
+PRResult PRSetWriteFlushPolicy(PRHandle handle, const PRWriteFlushPolicy *policy)
+{
+    return handleAsDevice->SetWriteFlushPolicy(policy);
+}
+
+PRResult PRGetWriteFlushPolicy(PRHandle handle, PRWriteFlushPolicy *policy)
+{
+    return handleAsDevice->GetWriteFlushPolicy(policy);
+}
+
+PRResult PRSetLinkParams(PRHandle handle, const PRLinkParams *params)
+{
+    return handleAsDevice->SetLinkParams(params);
+}
+
+PRResult PRGetLinkParams(PRHandle handle, PRLinkParams *params)
+{
+    return handleAsDevice->GetLinkParams(params);
+}
+
+PRResult PRCalibrateLink(PRHandle handle, PRLinkGoal goal, int32_t maxRoundTripMicroseconds, PRLinkMeasurement *chosen)
+{
+    return handleAsDevice->CalibrateLink(goal, maxRoundTripMicroseconds, chosen);
+}
+
 /** Write data out to the P-ROC immediately (does not require a call to PRFlushWriteData). */
 PRResult PRWriteData(PRHandle handle, uint32_t moduleSelect, uint32_t startingAddr, int32_t numWriteWords, uint32_t * writeBuffer)
 {
@@ -137,6 +196,21 @@ PRResult PRReadData(PRHandle handle, uint32_t moduleSelect, uint32_t startingAdd
     return handleAsDevice->ReadDataRaw(moduleSelect, startingAddr, numReadWords, readBuffer);
 }
 
+int32_t PRReadDataAsync(PRHandle handle, uint32_t moduleSelect, uint32_t startingAddr, int32_t numReadWords, uint32_t * readBuffer, PRReadCallback callback, void *context)
+{
+    return handleAsDevice->ReadDataAsync(moduleSelect, startingAddr, numReadWords, readBuffer, callback, context);
+}
+
+int PRReadDataWait(PRHandle handle, int32_t ticket, int32_t timeoutMicroseconds)
+{
+    return handleAsDevice->WaitForRead(ticket, timeoutMicroseconds);
+}
+
+PRResult PRReadDataCancel(PRHandle handle, int32_t ticket)
+{
+    return handleAsDevice->CancelRead(ticket);
+}
+
 // Events
 
 /** Get all of the available events that have been received. */
@@ -145,6 +219,91 @@ int PRGetEvents(PRHandle handle, PREvent *eventsOut, int maxEvents)
     return handleAsDevice->GetEvents(eventsOut, maxEvents);
 }
 
+int PRGetEventsSoA(PRHandle handle, PREventType *types, uint32_t *values, uint32_t *times, int maxEvents)
+{
+    return handleAsDevice->GetEventsSoA(types, values, times, maxEvents);
+}
+
+uint64_t PRGetHostTime(void)
+{
+    return PRHostTimeMicroseconds();
+}
+
+int PRGetEventsEx(PRHandle handle, PREventEx *eventsOut, int maxEvents)
+{
+    return handleAsDevice->GetEventsEx(eventsOut, maxEvents);
+}
+
+PRResult PRGetClockEstimate(PRHandle handle, PRClockEstimate *estimate)
+{
+    return handleAsDevice->GetClockEstimate(estimate);
+}
+
+PRResult PRSetEventHandler(PRHandle handle, PREventType type, int32_t switchNum, PREventHandler handler, void *context)
+{
+    return handleAsDevice->SetEventHandler(type, switchNum, handler, context);
+}
+
+PRResult PRGetEventQueueStats(PRHandle handle, PREventQueueStats *stats)
+{
+    return handleAsDevice->GetEventQueueStats(stats);
+}
+
+PRResult PRResetEventQueueStats(PRHandle handle)
+{
+    return handleAsDevice->ResetEventQueueStats();
+}
+
+PRResult PRAccelSetConfig(PRHandle handle, const PRAccelConfig *config)
+{
+    return handleAsDevice->AccelSetConfig(config);
+}
+
+PRResult PRAccelGetConfig(PRHandle handle, PRAccelConfig *config)
+{
+    return handleAsDevice->AccelGetConfig(config);
+}
+
+PRResult PRAccelSetLevel(PRHandle handle)
+{
+    return handleAsDevice->AccelSetLevel();
+}
+
+int PRAccelGetSamples(PRHandle handle, PRAccelSample *samples, int maxSamples)
+{
+    return handleAsDevice->AccelGetSamples(samples, maxSamples);
+}
+
+PRResult PRStartEventThread(PRHandle handle)
+{
+    return handleAsDevice->StartEventThread();
+}
+
+PRResult PRStopEventThread(PRHandle handle)
+{
+    return handleAsDevice->StopEventThread();
+}
+
+int PRGetEventDescriptor(PRHandle handle)
+{
+    return handleAsDevice->GetEventDescriptor();
+}
+
+int PRWaitForEvents(PRHandle handle, int32_t timeoutMicroseconds)
+{
+    return handleAsDevice->WaitForEvents(timeoutMicroseconds);
+}
+
+PRResult PRSimulatorInjectEvents(PRHandle handle, const PREvent *events, int numEvents)
+{
+    return handleAsDevice->SimulatorInjectEvents(events, numEvents);
+}
+
+PRResult PRSimulatorInjectData(PRHandle handle, const uint32_t *words, int numWords)
+{
+    return handleAsDevice->SimulatorInjectData(words, numWords);
+}
+
 // Manager
 PRResult PRManagerUpdateConfig(PRHandle handle, PRManagerConfig *managerConfig)
 {
@@ -172,6 +331,10 @@ PRResult PRDriverUpdateState(PRHandle handle, PRDriverState *driverState)
 {
     return handleAsDevice->DriverUpdateState(driverState);
 }
+PRResult PRDriverUpdateStates(PRHandle handle, const PRDriverState *driverStates, int numStates)
+{
+    return handleAsDevice->DriverUpdateStates(driverStates, numStates);
+}
 PRResult PRDriverLoadMachineTypeDefaults(PRHandle handle, PRMachineType machineType)
 {
     return handleAsDevice->DriverLoadMachineTypeDefaults(machineType);
@@ -532,11 +695,68 @@ PRResult PRSwitchUpdateRule(PRHandle handle, uint8_t switchNum, PREventType even
     return handleAsDevice->SwitchUpdateRule(switchNum, eventType, rule, linkedDrivers, numDrivers, drive_outputs_now);
 }
 
+PRResult PRSwitchRulesBegin(PRHandle handle)
+{
+    return handleAsDevice->SwitchRulesBegin();
+}
+
+PRResult PRSwitchRulesCommit(PRHandle handle)
+{
+    return handleAsDevice->SwitchRulesCommit();
+}
+
+PRResult PRSwitchRulePoolGetStats(PRHandle handle, PRSwitchRulePoolStats *stats)
+{
+    return handleAsDevice->SwitchRulePoolGetStats(stats);
+}
+
+PRResult PRSwitchRulePoolDonate(PRHandle handle, uint8_t switchNum, PREventType eventType)
+{
+    return handleAsDevice->SwitchRulePoolDonate(switchNum, eventType);
+}
+
+int PRSwitchRulePoolCompact(PRHandle handle)
+{
+    return handleAsDevice->SwitchRulePoolCompact();
+}
+
 PRResult PRSwitchGetStates(PRHandle handle, PREventType * switchStates, uint16_t numSwitches)
 {
     return handleAsDevice->SwitchGetStates(switchStates, numSwitches);
 }
 
+PRResult PRSwitchGetStatesAsync(PRHandle handle, uint16_t numSwitches, PRSwitchStatesCallback callback, void *context)
+{
+    return handleAsDevice->SwitchGetStatesAsync(numSwitches, callback, context);
+}
+
+PRResult PRSwitchGetStateBitmap(PRHandle handle, PRSwitchStateBitmap *bitmap)
+{
+    return handleAsDevice->SwitchGetStateBitmap(bitmap);
+}
+
+int PRSwitchGetState(PRHandle handle, uint16_t switchNum, bool_t debounced)
+{
+    return handleAsDevice->SwitchGetState(switchNum, debounced);
+}
+
+uint32_t PRSwitchGetLastChangeTime(PRHandle handle, uint16_t switchNum, bool_t debounced)
+{
+    return handleAsDevice->SwitchGetLastChangeTime(switchNum, debounced);
+}
+
+// Machine images
+
+PRResult PRMachineImageSave(PRHandle handle, const char *path)
+{
+    return handleAsDevice->MachineImageSave(path);
+}
+
+PRResult PRMachineImageLoad(PRHandle handle, const char *path)
+{
+    return handleAsDevice->MachineImageLoad(path);
+}
+
 // DMD
 
 int32_t PRDMDUpdateConfig(PRHandle handle, PRDMDConfig *dmdConfig)
@@ -0,0 +1,121 @@
+/*
+ * The MIT License
+ * Copyright (c) 2009 Gerry Stellenberg, Adam Preble
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ *  prbytebench.cpp
+ *  libpinproc
+ *
+ *  Times big-endian encoding of one DMD-sized flush (1536 words) with the
+ *  shift/mask loop the library used before PREncodeWordsBE, then with
+ *  PREncodeWordsBE itself, and checks that both produce the same bytes.
+ *
+ *  Usage: prbytebench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "../../src/PRByteOrder.h"
+
+#define kFlushWords (1536)
+#define kDefaultIterations (200000)
+#define kWarmupIterations (1000)
+
+typedef void (*EncodeFunction)(const uint32_t *words, uint8_t *bytes, int32_t numWords);
+
+// The loop PRDevice used to fill its write buffers before PREncodeWordsBE.
+static void EncodeShiftMask(const uint32_t *words, uint8_t *bytes, int32_t numWords)
+{
+    for (int32_t i = 0; i < numWords; i++)
+    {
+        uint32_t word = words[i];
+        bytes[(i * 4)] = (word >> 24) & 0xff;
+        bytes[(i * 4) + 1] = (word >> 16) & 0xff;
+        bytes[(i * 4) + 2] = (word >> 8) & 0xff;
+        bytes[(i * 4) + 3] = word & 0xff;
+    }
+}
+
+// Returns the mean time of one flush in nanoseconds.
+static double TimeEncode(EncodeFunction encode, const uint32_t *words, uint8_t *bytes, int iterations)
+{
+    volatile uint32_t sink = 0;
+
+    // Warm the caches and branch predictors before the timed run.
+    for (int i = 0; i < kWarmupIterations; i++)
+        encode(words, bytes, kFlushWords);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        encode(words, bytes, kFlushWords);
+        // Read a byte back so the compiler cannot drop the repeated stores.
+        sink += bytes[(i % kFlushWords) * 4];
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+static void PrintResult(const char *name, double nanoseconds)
+{
+    double megabytesPerSecond = (kFlushWords * 4) / nanoseconds * 1000.0;
+    printf("%-16s %10.1f ns/flush %10.1f MB/s\n", name, nanoseconds, megabytesPerSecond);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = kDefaultIterations;
+    if (argc > 1)
+        iterations = atoi(argv[1]);
+    if (iterations <= 0)
+    {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<uint32_t> words(kFlushWords);
+    for (int i = 0; i < kFlushWords; i++)
+        words[i] = (uint32_t)(i * 2654435761u);
+
+    // Offset the destination by one byte so unaligned stores are what gets timed.
+    std::vector<uint8_t> reference(kFlushWords * 4);
+    std::vector<uint8_t> buffer((kFlushWords * 4) + 1);
+    uint8_t *bytes = &buffer[1];
+
+    EncodeShiftMask(&words[0], &reference[0], kFlushWords);
+    PREncodeWordsBE(&words[0], bytes, kFlushWords);
+    if (memcmp(&reference[0], bytes, kFlushWords * 4) != 0)
+    {
+        fprintf(stderr, "PREncodeWordsBE does not match the shift/mask loop\n");
+        return 1;
+    }
+
+    printf("%d flushes of %d words\n", iterations, kFlushWords);
+    PrintResult("shift/mask", TimeEncode(EncodeShiftMask, &words[0], bytes, iterations));
+    PrintResult("PREncodeWordsBE", TimeEncode(PREncodeWordsBE, &words[0], bytes, iterations));
+    return 0;
+}